@@ -44,12 +44,40 @@ typedef enum cmd{
     TRAIN_CMD,
     PREDICT_SINGLE_IMG,
     PREDICT_MULTIPLE_IMGS,
+    ISA_CMD,
+    BENCH_CMD,
+    BATCH_CMD,
+    ACCURACY_CMD,
+    CHECK_MATH_CMD,
+    ACTIVATION_CMD,
+    LOSS_CMD,
+    OPTIMIZER_CMD,
+    LR_CMD,
+    EPOCHS_CMD,
+    SCHEDULE_CMD,
+    EARLY_STOP_CMD,
+    THREADS_CMD,
+    BENCH_TRAIN_CMD,
+    PARALLEL_CMD,
+    SEED_CMD,
+    PROCESSES_CMD,
+    TRANSPORT_CMD,
+    STREAM_CMD,
+    LABELS_CMD,
     HELP_CMD,
     CMD_NUMBER = HELP_CMD,
     FILE_TYPE,
     SAMPLE_TYPE,
     INDEX_TYPE,
-    TYPES_NUMBER = INDEX_TYPE - HELP_CMD
+    ISA_TYPE,
+    ACCURACY_TYPE,
+    ACTIVATION_TYPE,
+    LOSS_TYPE,
+    OPTIMIZER_TYPE,
+    SCHEDULE_TYPE,
+    PARALLEL_TYPE,
+    TRANSPORT_TYPE,
+    TYPES_NUMBER = TRANSPORT_TYPE - HELP_CMD
 }ZA_Cmd;
 
 const char* cmd_description[] = {
@@ -57,6 +85,26 @@ const char* cmd_description[] = {
     [TRAIN_CMD] = "This command starts the training.",
     [PREDICT_SINGLE_IMG] = "This command load the training data and try to predict the result.",
     [PREDICT_MULTIPLE_IMGS] = "This command load the training data and returns the precision of the neural network.",
+    [ISA_CMD] = "This command forces the instruction set of the math kernels (auto, generic, sse4.2, avx2, avx512) and prints the one in use.",
+    [BENCH_CMD] = "This command measures the matrix product of two square matrices on 1, 2, 4, ... threads up to ZMATH_THREADS or the number of cores.",
+    [BATCH_CMD] = "This command sets the number of images of each update of the training, 1 updates the network after every image.",
+    [ACCURACY_CMD] = "This command sets the accuracy of the activations of the network trained or loaded after it (fast, accurate).",
+    [CHECK_MATH_CMD] = "This command compares the vector exp, sigmoid, tanh and softplus of every instruction set and accuracy with the math library.",
+    [ACTIVATION_CMD] = "This command sets the activations of the hidden and output layers of the network trained after it (identity, sigmoid, relu, tanh, leaky_relu, gelu, softplus).",
+    [LOSS_CMD] = "This command sets the loss of the network trained after it (mse, cross_entropy), cross_entropy puts a softmax on the output layer and ignores its activation.",
+    [OPTIMIZER_CMD] = "This command sets the update rule of the network trained after it (sgd, momentum, nesterov, adam, adamw).",
+    [LR_CMD] = "This command sets the learning rate of the network trained after it, 0.1 for sgd, momentum and nesterov and 0.001 for adam and adamw by default.",
+    [EPOCHS_CMD] = "This command sets the number of passes over the training images, each one in a new random order.",
+    [SCHEDULE_CMD] = "This command sets how the learning rate changes during the training (constant, step, cosine, one_cycle), step divides it by 10 every 10 epochs.",
+    [EARLY_STOP_CMD] = "This command holds out a fraction of the training images to score each epoch, the training stops after patience epochs without a better score and keeps the best weights.",
+    [THREADS_CMD] = "This command sets the number of threads that train the network after it, by default each one updates the shared weights without locks.",
+    [BENCH_TRAIN_CMD] = "This command measures the samples per second of an epoch of training on 1, 2, 4, ... threads up to ZMATH_THREADS or the number of cores.",
+    [PARALLEL_CMD] = "This command sets how the threads share the training (hogwild, sync), sync sums the gradients of each batch in a fixed order and gives the same weights on any number of threads.",
+    [SEED_CMD] = "This command seeds the initial weights and the order of the training images, the same seed trains the same network.",
+    [PROCESSES_CMD] = "This command trains the network after it on worker processes that share its weights, each batch is split among them and their gradients are summed by this process.",
+    [TRANSPORT_CMD] = "This command sets how the worker processes send their gradients (shm, socket), shm uses lock-free rings in shared memory and socket Unix domain sockets.",
+    [STREAM_CMD] = "This command trains the network after it while a loader thread parses the next batches from the file, queue_depth batches are kept ready (2 is double buffering) and the stalls of each epoch are printed.",
+    [LABELS_CMD] = "This command reads the file of --I as the images of an IDX file (train-images-idx3-ubyte) with the labels of labels_file (train-labels-idx1-ubyte), the files are mapped instead of parsed.",
     [HELP_CMD] = "This command prints the usage of the program.",
 };
 
@@ -65,6 +113,26 @@ const char* cmd_usage[] = {
     [TRAIN_CMD] = "--I <filename> --train <training_number_of_samples>",
     [PREDICT_SINGLE_IMG] = "--I <filename> --predict <num_of_Images> <img_index>",
     [PREDICT_MULTIPLE_IMGS] = "--I <filename> --predict -m <num_of_Images>",
+    [ISA_CMD] = "--isa <instruction_set>",
+    [BENCH_CMD] = "--bench <matrix_size>",
+    [BATCH_CMD] = "--batch <batch_size> --I <filename> --train <training_number_of_samples>",
+    [ACCURACY_CMD] = "--accuracy <fast|accurate>",
+    [CHECK_MATH_CMD] = "--check-math",
+    [ACTIVATION_CMD] = "--activation <hidden_activation> <output_activation> --I <filename> --train <training_number_of_samples>",
+    [LOSS_CMD] = "--loss <mse|cross_entropy> --I <filename> --train <training_number_of_samples>",
+    [OPTIMIZER_CMD] = "--optimizer <sgd|momentum|nesterov|adam|adamw> --I <filename> --train <training_number_of_samples>",
+    [LR_CMD] = "--lr <learning_rate> --I <filename> --train <training_number_of_samples>",
+    [EPOCHS_CMD] = "--epochs <number_of_epochs> --I <filename> --train <training_number_of_samples>",
+    [SCHEDULE_CMD] = "--schedule <constant|step|cosine|one_cycle> --I <filename> --train <training_number_of_samples>",
+    [EARLY_STOP_CMD] = "--early-stop <validation_fraction> <patience> --I <filename> --train <training_number_of_samples>",
+    [THREADS_CMD] = "--threads <number_of_threads> --I <filename> --train <training_number_of_samples>",
+    [BENCH_TRAIN_CMD] = "--I <filename> --bench-train <training_number_of_samples>",
+    [PARALLEL_CMD] = "--parallel <hogwild|sync> --threads <number_of_threads> --I <filename> --train <training_number_of_samples>",
+    [SEED_CMD] = "--seed <seed> --I <filename> --train <training_number_of_samples>",
+    [PROCESSES_CMD] = "--processes <number_of_workers> --batch <batch_size> --I <filename> --train <training_number_of_samples>",
+    [TRANSPORT_CMD] = "--transport <shm|socket> --processes <number_of_workers> --I <filename> --train <training_number_of_samples>",
+    [STREAM_CMD] = "--stream <queue_depth> --batch <batch_size> --I <filename> --train <training_number_of_samples>",
+    [LABELS_CMD] = "--labels <labels_file> --I <images_file> --train <training_number_of_samples>",
     [HELP_CMD] = "--h",
 };
 
@@ -151,6 +219,18 @@ void za_push_arg_at_start(ZA_Args** root, int *argc, char ***argv);
 */
 void za_push_arg_at_end(ZA_Args** root, int *argc, char ***argv);
 
+/*!
+    @brief Prints the speed of the matrix product on an increasing number of threads.
+    @param size The rows and cols of the matrices to multiply.
+*/
+void za_bench_gemm(unsigned int size);
+
+/*!
+    @brief Compares the vector exp, sigmoid, tanh and softplus with the math library over the whole float range, for every supported instruction set and accuracy.
+    @return 1 if every function is within the error allowed by its accuracy (2 ulp for the accurate one, 1e-4 relative for the fast one), 0 otherwise.
+*/
+int za_check_math(void);
+
 /*!
     @brief Get the linked list from the arguments given in the command line.
     @param arg The number of the arguments.
@@ -215,11 +295,20 @@ void za_print_args(ZA_Args *args);
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <time.h>
+#include <float.h>
+#include <stdint.h>
 
 #define ZNN_IMPLEMENTATION
 #include "znn.h"
 
+#define ZDIST_IMPLEMENTATION
+#include "zdist.h"
+
 void za_log(ZA_Log_Level level, const char *fmt, ...)
 {
     switch (level) {
@@ -281,7 +370,7 @@ int za_read_file(const char* filename, char** buff){
 
     FILE* fp;
 
-    fopen_s(&fp, filename, "r");
+    fp = fopen(filename, "r");
 
     if(fp == NULL){
         return 0;
@@ -311,7 +400,7 @@ int za_write_file(const char* filename, char* buff){
 
    FILE* fp;
 
-   fopen_s(&fp, filename, "w");
+   fp = fopen(filename, "w");
 
     if(fp == NULL){
         return 0;
@@ -338,7 +427,7 @@ int za_append_buff_to_file(const char* filename, char* buff){
 
     FILE* fp;
 
-    fopen_s(&fp, filename, "a");
+    fp = fopen(filename, "a");
 
     if(fp == NULL){
         return 0;
@@ -391,6 +480,243 @@ void za_push_arg_at_end(ZA_Args** root, int *argc, char ***argv){
 
 }
 
+// a whole number above 0 that fits an int, with nothing after it
+static bool za_parse_positive(const char* text, int* value){
+
+    char* end = NULL;
+    errno = 0;
+    long v = strtol(text, &end, 10);
+
+    if(end == text || *end != '\0' || errno == ERANGE || v <= 0 || v > INT_MAX) return false;
+
+    *value = (int)v;
+    return true;
+}
+
+static double za_seconds(void){
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void za_bench_gemm(unsigned int size){
+
+    MZ_Matrix a = MZ_new_random_float_matrix(size, size, -1, 1);
+    MZ_Matrix b = MZ_new_random_float_matrix(size, size, -1, 1);
+    MZ_Matrix c = MZ_alloc_matrix(size, size);
+
+    unsigned int max_threads = MZ_get_num_threads();
+    double flops = 2.0 * size * size * size;
+    double base = 0;
+
+    printf("GEMM %ux%ux%u with the %s kernels\n", size, size, size, MZ_isa_name(MZ_get_isa()));
+
+    for(unsigned int threads = 1; ; threads *= 2){
+
+        if(threads > max_threads) threads = max_threads;
+
+        MZ_set_num_threads(threads);
+
+        // the first product starts the workers and warms the caches
+        MZ_multiply_two_matrices_into(&c, a, b);
+
+        int reps = 0;
+        double start = za_seconds();
+        double elapsed;
+
+        do{
+            MZ_multiply_two_matrices_into(&c, a, b);
+            reps++;
+            elapsed = za_seconds() - start;
+        }while(elapsed < 0.5);
+
+        double gflops = flops * reps / elapsed * 1e-9;
+        if(threads == 1) base = gflops;
+
+        printf("threads %3u: %8.2f GFLOP/s, speedup %5.2fx\n", threads, gflops, gflops / base);
+
+        if(threads == max_threads) break;
+    }
+
+    MZ_set_num_threads(max_threads);
+
+    MZ_free_matrix(&a);
+    MZ_free_matrix(&b);
+    MZ_free_matrix(&c);
+}
+
+// the images of the csv file, or of the IDX files when there is a labels file
+static ZI_Img** za_load_imgs(const char* filename, const char* labels_filename, int n_images){
+    return labels_filename != NULL ? zi_idx_to_imgs(filename, labels_filename, n_images) : zi_csv_to_imgs(filename, n_images);
+}
+
+// a new network with the settings of the command line, learning_rate 0 for the default of the optimizer
+static ZN_NN* za_nn_new(double learning_rate, MZ_Optimizer optimizer, MZ_Accuracy accuracy, MZ_Activation hidden_activation,
+                        MZ_Activation output_activation, ZN_Loss loss){
+
+    // adam divides by the scale of the gradients, its steps are about the learning rate itself
+    if(learning_rate <= 0.0) learning_rate = optimizer >= MZ_OPT_ADAM ? 0.001 : 0.1;
+
+    ZN_NN* nn = zn_nn_new(784, 300, 10, learning_rate);
+    zn_nn_set_optimizer(nn, MZ_optimizer_default_config(optimizer));
+    nn->accuracy = accuracy;
+    nn->hidden_activation = hidden_activation;
+    nn->output_activation = output_activation;
+    nn->loss = loss;
+
+    return nn;
+}
+
+// samples per second of an epoch of training on 1, 2, 4, ... threads of a network set as model,
+// the epochs and threads of config are replaced
+static void za_bench_train(const ZN_NN* model, ZI_Img** imgs, int n, ZN_Train_Config config){
+
+    unsigned int max_threads = MZ_get_num_threads();
+    double base = 0;
+
+    config.epochs = 1;
+
+    for(unsigned int threads = 1; ; threads *= 2){
+
+        if(threads > max_threads) threads = max_threads;
+
+        // every measure starts from a new network so they all do the same work
+        ZN_NN* nn = zn_nn_new(model->input, model->hidden, model->output, model->learning_rate);
+        zn_nn_set_optimizer(nn, model->optimizer.config);
+        nn->accuracy = model->accuracy;
+        nn->hidden_activation = model->hidden_activation;
+        nn->output_activation = model->output_activation;
+        nn->loss = model->loss;
+        config.threads = threads;
+
+        double start = za_seconds();
+        zn_nn_fit(nn, imgs, n, &config);
+        double rate = n / (za_seconds() - start);
+
+        if(threads == 1) base = rate;
+
+        printf("threads %3u: %10.0f samples/s, speedup %5.2fx\n", threads, rate, rate / base);
+
+        zn_nn_free(nn);
+
+        if(threads == max_threads) break;
+    }
+}
+
+static double za_math_reference(int function, double x){
+    switch(function){
+        case 0: return exp(x);
+        case 1: return 1.0 / (1.0 + exp(-x));
+        case 2: return tanh(x);
+        default: return fmax(x, 0.0) + log1p(exp(-fabs(x)));
+    }
+}
+
+// maps the floats on the integers in the same order, the distance of two floats is their difference in ulp
+static int64_t za_float_order(float x){
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits < 0 ? -(int64_t)(bits & 0x7FFFFFFF) : bits;
+}
+
+int za_check_math(void){
+
+    enum { CHUNK = 4096, STEP = 257 };
+    static float inputs[CHUNK];
+    static float outputs[CHUNK];
+
+    const char* functions[] = { "exp", "sigmoid", "tanh", "softplus" };
+    const MZ_Activation activations[] = { MZ_ACT_IDENTITY, MZ_ACT_SIGMOID, MZ_ACT_TANH, MZ_ACT_SOFTPLUS };
+    const char* accuracies[] = { "accurate", "fast" };
+
+    MZ_Isa active = MZ_get_isa();
+    MZ_Matrix x = MZ_view_from_buffer(inputs, 1, CHUNK, CHUNK, 1);
+    MZ_Matrix y = MZ_view_from_buffer(outputs, 1, CHUNK, CHUNK, 1);
+    bool passed = true;
+
+    printf("%-8s %-8s %-9s %12s %9s %14s %8s\n", "isa", "function", "accuracy", "max rel err", "max ulp", "worst input", "result");
+
+    for(int isa = 0; isa < MZ_ISA_COUNT; isa++){
+
+        if(!MZ_set_isa((MZ_Isa)isa)) continue;
+
+        for(int accuracy = 0; accuracy < MZ_ACCURACY_COUNT; accuracy++){
+            for(int function = 0; function < 4; function++){
+
+                double max_rel = 0.0;
+                int64_t max_ulp = 0;
+                float worst = 0.0f;
+                size_t wrong = 0;
+
+                // every 257th bit pattern covers each binade, the specials are in the first chunk
+                uint64_t bits = 0;
+                bool first = true;
+
+                while(bits <= UINT32_MAX){
+
+                    int n = 0;
+
+                    if(first){
+                        inputs[n++] = INFINITY;
+                        inputs[n++] = -INFINITY;
+                        inputs[n++] = NAN;
+                        first = false;
+                    }
+
+                    for(; n < CHUNK && bits <= UINT32_MAX; bits += STEP){
+                        uint32_t pattern = (uint32_t)bits;
+                        memcpy(&inputs[n++], &pattern, sizeof(float));
+                    }
+
+                    MZ_Matrix xn = MZ_view_block(x, 0, 0, 1, n);
+                    MZ_Matrix yn = MZ_view_block(y, 0, 0, 1, n);
+
+                    if(function == 0){
+                        MZ_exp_into(&yn, xn, (MZ_Accuracy)accuracy);
+                    }else {
+                        MZ_activate_into(&yn, xn, activations[function], (MZ_Accuracy)accuracy);
+                    }
+
+                    for(int i = 0; i < n; i++){
+
+                        double expected = za_math_reference(function, inputs[i]);
+                        float result = outputs[i];
+
+                        if(isnan(expected) || isinf((float)expected) || fabs(expected) < FLT_MIN){
+                            // NaN and infinities must match, the results below the normal range must be close to 0
+                            bool ok = isnan(expected) ? isnan(result) :
+                                      isinf((float)expected) ? result == (float)expected :
+                                      fabs(result - expected) <= FLT_MIN;
+                            if(!ok) wrong++;
+                            continue;
+                        }
+
+                        double rel = fabs(result - expected) / fabs(expected);
+                        int64_t ulp = za_float_order(result) - za_float_order((float)expected);
+                        if(ulp < 0) ulp = -ulp;
+
+                        if(rel > max_rel){
+                            max_rel = rel;
+                            worst = inputs[i];
+                        }
+                        if(ulp > max_ulp) max_ulp = ulp;
+                    }
+                }
+
+                bool ok = wrong == 0 && (accuracy == MZ_ACCURACY_ACCURATE ? max_ulp <= 2 : max_rel <= 1e-4);
+                passed = passed && ok;
+
+                printf("%-8s %-8s %-9s %12.3e %9lld %14.7g %8s\n", MZ_isa_name((MZ_Isa)isa), functions[function],
+                       accuracies[accuracy], max_rel, (long long)max_ulp, worst, ok ? "ok" : "FAILED");
+            }
+        }
+    }
+
+    MZ_set_isa(active);
+
+    return passed ? 1 : 0;
+}
+
 ZA_Args* za_get_args(int *argc, char ***argv){
 
     ZA_Args *args = NULL;
@@ -435,6 +761,66 @@ ZA_Cmd za_get_arg_type(ZA_Args *args){
     }else if(strcmp(args->data, "-m") == 0){
         args->type = PREDICT_MULTIPLE_IMGS;
         return PREDICT_MULTIPLE_IMGS;
+    }else if(strcmp(args->data, "--isa") == 0){
+        args->type = ISA_CMD;
+        return ISA_CMD;
+    }else if(strcmp(args->data, "--bench") == 0){
+        args->type = BENCH_CMD;
+        return BENCH_CMD;
+    }else if(strcmp(args->data, "--batch") == 0){
+        args->type = BATCH_CMD;
+        return BATCH_CMD;
+    }else if(strcmp(args->data, "--accuracy") == 0){
+        args->type = ACCURACY_CMD;
+        return ACCURACY_CMD;
+    }else if(strcmp(args->data, "--check-math") == 0){
+        args->type = CHECK_MATH_CMD;
+        return CHECK_MATH_CMD;
+    }else if(strcmp(args->data, "--activation") == 0){
+        args->type = ACTIVATION_CMD;
+        return ACTIVATION_CMD;
+    }else if(strcmp(args->data, "--loss") == 0){
+        args->type = LOSS_CMD;
+        return LOSS_CMD;
+    }else if(strcmp(args->data, "--optimizer") == 0){
+        args->type = OPTIMIZER_CMD;
+        return OPTIMIZER_CMD;
+    }else if(strcmp(args->data, "--lr") == 0){
+        args->type = LR_CMD;
+        return LR_CMD;
+    }else if(strcmp(args->data, "--epochs") == 0){
+        args->type = EPOCHS_CMD;
+        return EPOCHS_CMD;
+    }else if(strcmp(args->data, "--schedule") == 0){
+        args->type = SCHEDULE_CMD;
+        return SCHEDULE_CMD;
+    }else if(strcmp(args->data, "--early-stop") == 0){
+        args->type = EARLY_STOP_CMD;
+        return EARLY_STOP_CMD;
+    }else if(strcmp(args->data, "--threads") == 0){
+        args->type = THREADS_CMD;
+        return THREADS_CMD;
+    }else if(strcmp(args->data, "--bench-train") == 0){
+        args->type = BENCH_TRAIN_CMD;
+        return BENCH_TRAIN_CMD;
+    }else if(strcmp(args->data, "--parallel") == 0){
+        args->type = PARALLEL_CMD;
+        return PARALLEL_CMD;
+    }else if(strcmp(args->data, "--seed") == 0){
+        args->type = SEED_CMD;
+        return SEED_CMD;
+    }else if(strcmp(args->data, "--processes") == 0){
+        args->type = PROCESSES_CMD;
+        return PROCESSES_CMD;
+    }else if(strcmp(args->data, "--transport") == 0){
+        args->type = TRANSPORT_CMD;
+        return TRANSPORT_CMD;
+    }else if(strcmp(args->data, "--stream") == 0){
+        args->type = STREAM_CMD;
+        return STREAM_CMD;
+    }else if(strcmp(args->data, "--labels") == 0){
+        args->type = LABELS_CMD;
+        return LABELS_CMD;
     }else if(strcmp(args->data, "--h") == 0){
         args->type = HELP_CMD;
         return HELP_CMD;
@@ -450,7 +836,7 @@ void za_set_args_type(ZA_Args* args){
 
     while(tmp != NULL){
         za_get_arg_type(tmp);  
-        if(tmp->type == IN_CMD){
+        if(tmp->type == IN_CMD || tmp->type == LABELS_CMD){
             tmp = tmp->next_arg;
             if(za_get_arg_type(tmp) == NO_CMD){
                 tmp->type = FILE_TYPE; 
@@ -463,6 +849,103 @@ void za_set_args_type(ZA_Args* args){
             tmp->type = SAMPLE_TYPE;
             tmp = tmp->next_arg;
 
+        }else if(tmp->type == BENCH_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = SAMPLE_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == BATCH_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = SAMPLE_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == ACCURACY_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = ACCURACY_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == ACTIVATION_CMD){
+
+            tmp = tmp->next_arg;
+            for(int layer = 0; layer < 2 && tmp != NULL; layer++){
+                tmp->type = ACTIVATION_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == LOSS_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = LOSS_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == OPTIMIZER_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = OPTIMIZER_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == LR_CMD || tmp->type == EPOCHS_CMD || tmp->type == THREADS_CMD || tmp->type == BENCH_TRAIN_CMD ||
+                 tmp->type == SEED_CMD || tmp->type == PROCESSES_CMD || tmp->type == STREAM_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = SAMPLE_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == SCHEDULE_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = SCHEDULE_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == PARALLEL_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = PARALLEL_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == TRANSPORT_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = TRANSPORT_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == EARLY_STOP_CMD){
+
+            tmp = tmp->next_arg;
+            for(int value = 0; value < 2 && tmp != NULL; value++){
+                tmp->type = SAMPLE_TYPE;
+                tmp = tmp->next_arg;
+            }
+
+        }else if(tmp->type == ISA_CMD){
+
+            tmp = tmp->next_arg;
+            if(tmp != NULL){
+                tmp->type = ISA_TYPE;
+                tmp = tmp->next_arg;
+            }
+
         }else if(tmp->type == PREDICT_SINGLE_IMG){ 
 
             if(za_get_arg_type(tmp->next_arg) == PREDICT_MULTIPLE_IMGS ){
@@ -503,6 +986,66 @@ char* za_arg_type_to_string(ZA_Args* arg){
         case PREDICT_MULTIPLE_IMGS:{
             return "PREDICT_MULTIPLE_IMGS";
         }break;
+        case ISA_CMD:{
+            return "ISA_CMD";
+        }break;
+        case BENCH_CMD:{
+            return "BENCH_CMD";
+        }break;
+        case BATCH_CMD:{
+            return "BATCH_CMD";
+        }break;
+        case ACCURACY_CMD:{
+            return "ACCURACY_CMD";
+        }break;
+        case CHECK_MATH_CMD:{
+            return "CHECK_MATH_CMD";
+        }break;
+        case ACTIVATION_CMD:{
+            return "ACTIVATION_CMD";
+        }break;
+        case LOSS_CMD:{
+            return "LOSS_CMD";
+        }break;
+        case OPTIMIZER_CMD:{
+            return "OPTIMIZER_CMD";
+        }break;
+        case LR_CMD:{
+            return "LR_CMD";
+        }break;
+        case EPOCHS_CMD:{
+            return "EPOCHS_CMD";
+        }break;
+        case SCHEDULE_CMD:{
+            return "SCHEDULE_CMD";
+        }break;
+        case EARLY_STOP_CMD:{
+            return "EARLY_STOP_CMD";
+        }break;
+        case THREADS_CMD:{
+            return "THREADS_CMD";
+        }break;
+        case BENCH_TRAIN_CMD:{
+            return "BENCH_TRAIN_CMD";
+        }break;
+        case PARALLEL_CMD:{
+            return "PARALLEL_CMD";
+        }break;
+        case SEED_CMD:{
+            return "SEED_CMD";
+        }break;
+        case PROCESSES_CMD:{
+            return "PROCESSES_CMD";
+        }break;
+        case TRANSPORT_CMD:{
+            return "TRANSPORT_CMD";
+        }break;
+        case STREAM_CMD:{
+            return "STREAM_CMD";
+        }break;
+        case LABELS_CMD:{
+            return "LABELS_CMD";
+        }break;
         case HELP_CMD:{
             return "HELP_CMD";
         }break;
@@ -512,6 +1055,30 @@ char* za_arg_type_to_string(ZA_Args* arg){
         case SAMPLE_TYPE:{
             return "SAMPLE_TYPE";
         }break;
+        case ISA_TYPE:{
+            return "ISA_TYPE";
+        }break;
+        case ACCURACY_TYPE:{
+            return "ACCURACY_TYPE";
+        }break;
+        case ACTIVATION_TYPE:{
+            return "ACTIVATION_TYPE";
+        }break;
+        case LOSS_TYPE:{
+            return "LOSS_TYPE";
+        }break;
+        case OPTIMIZER_TYPE:{
+            return "OPTIMIZER_TYPE";
+        }break;
+        case SCHEDULE_TYPE:{
+            return "SCHEDULE_TYPE";
+        }break;
+        case PARALLEL_TYPE:{
+            return "PARALLEL_TYPE";
+        }break;
+        case TRANSPORT_TYPE:{
+            return "TRANSPORT_TYPE";
+        }break;
         case NO_CMD:{
             return "NO_CMD"; 
         }break;
@@ -522,8 +1089,19 @@ void za_parse_args(const char* prog_name, int *argc, char ***argv){
 
     ZA_Args *args = za_get_args(argc, argv);
 
-    char* filename;
-    char* buff;
+    char* filename = NULL;
+    char* labels_filename = NULL;
+    int batch_size = 1;
+    MZ_Accuracy accuracy = MZ_ACCURACY_ACCURATE;
+    MZ_Activation hidden_activation = MZ_ACT_SIGMOID;
+    MZ_Activation output_activation = MZ_ACT_SIGMOID;
+    ZN_Loss loss = ZN_LOSS_MSE;
+    MZ_Optimizer optimizer = MZ_OPT_SGD;
+    double learning_rate = 0.0;
+    ZN_Train_Config train_config = zn_train_default_config();
+    int processes = 0;
+    ZD_Transport_Kind transport = ZD_TRANSPORT_SHM;
+    int stream_depth = 0;
 
     za_set_args_type(args);
 
@@ -551,12 +1129,39 @@ void za_parse_args(const char* prog_name, int *argc, char ***argv){
                 args = args->next_arg;
 
                 int n_images = atoi(args->data);
-                ZI_Img **imgs = zi_csv_to_imgs(filename, n_images);
-                ZN_NN* nn = zn_nn_new(784, 300, 10, 0.1);
-                zn_nn_train_batch_imgs(nn, imgs, n_images);
+                ZN_NN* nn = za_nn_new(learning_rate, optimizer, accuracy, hidden_activation, output_activation, loss);
+                train_config.batch_size = batch_size;
+                if(stream_depth > 0){
+                    // the training starts as soon as the first batch is parsed, on this process and in the order of the file
+                    if(processes > 0) za_log(WARNING, "> --stream trains on this process, --processes is ignored.\n");
+                    if(train_config.threads > 1 && train_config.parallel != ZN_PARALLEL_SYNC){
+                        za_log(WARNING, "> --stream trains hogwild on one thread, --parallel sync trains on the %d threads.\n", train_config.threads);
+                    }
+                    if(train_config.validation > 0.0 || train_config.patience > 0){
+                        za_log(WARNING, "> --stream holds no images out, --early-stop is ignored.\n");
+                    }
+                    ZI_Loader* loader = labels_filename != NULL ?
+                                        zi_loader_new_idx(filename, labels_filename, n_images, batch_size, stream_depth, train_config.epochs) :
+                                        zi_loader_new(filename, n_images, batch_size, stream_depth, train_config.epochs);
+                    if(loader == NULL) exit(EXIT_FAILURE);
+                    zn_nn_fit_stream(nn, loader, &train_config);
+                    // like the images read at once, a file the loader could not read saves no network
+                    bool failed = zi_loader_failed(loader);
+                    zi_loader_free(loader);
+                    if(failed) exit(EXIT_FAILURE);
+                }else {
+                    ZI_Img **imgs = za_load_imgs(filename, labels_filename, n_images);
+                    if(processes > 0){
+                        ZD_Transport* workers = zd_transport_new(transport, processes);
+                        zd_nn_fit(nn, imgs, n_images, &train_config, workers);
+                        zd_transport_free(workers);
+                    }else {
+                        zn_nn_fit(nn, imgs, n_images, &train_config);
+                    }
+                    zi_imgs_free(imgs, n_images);
+                }
                 zn_nn_save(nn, "../NN_Saved_Data");
 
-                zi_imgs_free(imgs, n_images);
                 zn_nn_free(nn);
 
             }else {
@@ -587,10 +1192,11 @@ void za_parse_args(const char* prog_name, int *argc, char ***argv){
 
                 args = args->next_arg;
 
-                ZI_Img **imgs = zi_csv_to_imgs(filename, n_images);
+                ZI_Img **imgs = za_load_imgs(filename, labels_filename, n_images);
                 ZI_Img* img_to_predict = imgs[atoi(args->data)];
                 zi_img_print(img_to_predict);
                 ZN_NN* nn = zn_nn_load("../NN_Saved_Data");
+                nn->accuracy = accuracy;
                 MZ_Matrix result = zn_nn_predict_img(nn, img_to_predict);
                 printf("NN Predict: %d\n", MZ_matrix_argmax(result));
 
@@ -614,8 +1220,9 @@ void za_parse_args(const char* prog_name, int *argc, char ***argv){
                 args = args->next_arg->next_arg;
 
                 int n_images = atoi(args->data);
-                ZI_Img **imgs = zi_csv_to_imgs(filename, n_images);
+                ZI_Img **imgs = za_load_imgs(filename, labels_filename, n_images);
                 ZN_NN* nn = zn_nn_load("../NN_Saved_Data");
+                nn->accuracy = accuracy;
                 double score = zn_nn_predict_imgs(nn, imgs, n_images);
                 printf("Score: %1.5f\n", score);
 
@@ -632,6 +1239,366 @@ void za_parse_args(const char* prog_name, int *argc, char ***argv){
 
             goto next_arg;          
 
+        }else if(args->type == ISA_CMD){
+
+            if(args->next_arg != NULL){
+
+                args = args->next_arg;
+
+                MZ_Isa isa;
+
+                // an unknown name is printed with the known ones by MZ_isa_from_name
+                if(!MZ_isa_from_name(args->data, &isa)){
+                    za_usage(ERROR, prog_name);
+                    exit(EXIT_FAILURE);
+                }
+
+                if(!MZ_set_isa(isa)){
+                    za_log(ERROR, "> The instruction set %s is not supported by this cpu.", args->data);
+                    exit(EXIT_FAILURE);
+                }
+
+                za_log(INFO, "Math kernels: %s\n", MZ_isa_name(MZ_get_isa()));
+
+            }else {
+
+                za_log(ERROR, "> Missing instruction set token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == BENCH_CMD){
+
+            int size = 0;
+
+            if(args->next_arg != NULL && za_parse_positive(args->next_arg->data, &size)){
+
+                args = args->next_arg;
+
+                za_bench_gemm((unsigned int)size);
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid matrix size token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == BATCH_CMD){
+
+            if(args->next_arg != NULL && atoi(args->next_arg->data) > 0){
+
+                args = args->next_arg;
+
+                batch_size = atoi(args->data);
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid batch size token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == ACCURACY_CMD){
+
+            if(args->next_arg != NULL && strcmp(args->next_arg->data, "fast") == 0){
+                accuracy = MZ_ACCURACY_FAST;
+            }else if(args->next_arg != NULL && strcmp(args->next_arg->data, "accurate") == 0){
+                accuracy = MZ_ACCURACY_ACCURATE;
+            }else {
+                za_log(ERROR, "> Missing or invalid accuracy token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+            }
+
+            args = args->next_arg;
+
+            goto next_arg;
+
+        }else if(args->type == ACTIVATION_CMD){
+
+            if(args->next_arg != NULL && args->next_arg->next_arg != NULL &&
+               MZ_activation_from_name(args->next_arg->data, &hidden_activation) &&
+               MZ_activation_from_name(args->next_arg->next_arg->data, &output_activation)){
+
+                args = args->next_arg->next_arg;
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid activation tokens.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == LOSS_CMD){
+
+            if(args->next_arg != NULL && zn_loss_from_name(args->next_arg->data, &loss)){
+
+                args = args->next_arg;
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid loss token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == OPTIMIZER_CMD){
+
+            if(args->next_arg != NULL && MZ_optimizer_from_name(args->next_arg->data, &optimizer)){
+
+                args = args->next_arg;
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid optimizer token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == LR_CMD){
+
+            if(args->next_arg != NULL && atof(args->next_arg->data) > 0.0){
+
+                args = args->next_arg;
+
+                learning_rate = atof(args->data);
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid learning rate token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == THREADS_CMD){
+
+            if(args->next_arg != NULL && atoi(args->next_arg->data) > 0){
+
+                args = args->next_arg;
+
+                train_config.threads = atoi(args->data);
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid number of threads token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == PARALLEL_CMD){
+
+            if(args->next_arg != NULL && zn_parallel_from_name(args->next_arg->data, &train_config.parallel)){
+
+                args = args->next_arg;
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid parallel mode token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == STREAM_CMD){
+
+            if(args->next_arg != NULL && atoi(args->next_arg->data) > 0){
+
+                args = args->next_arg;
+
+                stream_depth = atoi(args->data);
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid queue depth token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == LABELS_CMD){
+
+            if(args->next_arg != NULL && args->next_arg->type == FILE_TYPE){
+
+                args = args->next_arg;
+
+                labels_filename = args->data;
+
+            }else {
+
+                za_log(ERROR, "> Missing labels file token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == PROCESSES_CMD){
+
+            if(args->next_arg != NULL && atoi(args->next_arg->data) > 0){
+
+                args = args->next_arg;
+
+                processes = atoi(args->data);
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid number of processes token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == TRANSPORT_CMD){
+
+            if(args->next_arg != NULL && zd_transport_from_name(args->next_arg->data, &transport)){
+
+                args = args->next_arg;
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid transport token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == SEED_CMD){
+
+            if(args->next_arg != NULL && isdigit((unsigned char)args->next_arg->data[0])){
+
+                args = args->next_arg;
+
+                zn_seed(strtoull(args->data, NULL, 10));
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid seed token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == BENCH_TRAIN_CMD){
+
+            if(args->next_arg != NULL && atoi(args->next_arg->data) > 0){
+
+                args = args->next_arg;
+
+                int n_images = atoi(args->data);
+                ZI_Img **imgs = za_load_imgs(filename, labels_filename, n_images);
+                ZN_NN* model = za_nn_new(learning_rate, optimizer, accuracy, hidden_activation, output_activation, loss);
+                train_config.batch_size = batch_size;
+                za_bench_train(model, imgs, n_images, train_config);
+
+                zn_nn_free(model);
+                zi_imgs_free(imgs, n_images);
+
+            }else {
+
+                za_log(ERROR, "> Missing training sample token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == EPOCHS_CMD){
+
+            if(args->next_arg != NULL && atoi(args->next_arg->data) > 0){
+
+                args = args->next_arg;
+
+                train_config.epochs = atoi(args->data);
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid number of epochs token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == SCHEDULE_CMD){
+
+            if(args->next_arg != NULL && zn_schedule_from_name(args->next_arg->data, &train_config.schedule)){
+
+                args = args->next_arg;
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid schedule token.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == EARLY_STOP_CMD){
+
+            if(args->next_arg != NULL && args->next_arg->next_arg != NULL &&
+               atof(args->next_arg->data) > 0.0 && atof(args->next_arg->data) < 1.0 &&
+               atoi(args->next_arg->next_arg->data) >= 0){
+
+                train_config.validation = atof(args->next_arg->data);
+                train_config.patience = atoi(args->next_arg->next_arg->data);
+                args = args->next_arg->next_arg;
+
+            }else {
+
+                za_log(ERROR, "> Missing or invalid early stopping tokens.");
+                za_usage(ERROR, prog_name);
+                exit(EXIT_FAILURE);
+
+            }
+
+            goto next_arg;
+
+        }else if(args->type == CHECK_MATH_CMD){
+
+            if(!za_check_math()) exit(EXIT_FAILURE);
+
+            goto next_arg;
+
         }else if(args->type == HELP_CMD){
             za_usage(INFO, prog_name);
 
@@ -647,9 +1614,6 @@ void za_parse_args(const char* prog_name, int *argc, char ***argv){
         args = args->next_arg;
     }
 
-    free(buff);
-    free(filename);
-
     return;
 }
 
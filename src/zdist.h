@@ -0,0 +1,695 @@
+/*
+MIT License
+
+Copyright (c) 2023 zLouis043
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef ZDIST_H_
+#define ZDIST_H_
+
+#include "znn.h"
+
+// bytes of each ring of the shared memory transport, a power of two
+#ifndef ZD_RING_SIZE
+#define ZD_RING_SIZE ((size_t)1 << 20)
+#endif
+
+// the rank of the coordinator, the workers are 0 ... workers - 1
+#define ZD_COORDINATOR (-1)
+
+typedef enum zd_transport_kind{
+    ZD_TRANSPORT_SHM = 0,
+    ZD_TRANSPORT_SOCKET,
+    ZD_TRANSPORT_COUNT
+}ZD_Transport_Kind;
+
+// A transport carries the messages between the coordinator and its workers, in order. It is made
+// before the workers are forked, then each process attaches to its end: the coordinator talks to
+// every worker, a worker only to the coordinator and ignores the peer. send and recv block until
+// the whole message is through and fail once the peer is gone. The coordinator gives the pid of
+// each worker to started as soon as it is forked, and hangs up on a worker when it stops reading
+// from it, then the sends and recvs of that worker fail too. Any other transport, a network one,
+// only has to fill the functions.
+typedef struct zd_transport{
+    const char* name;
+    int workers;
+    int rank;
+    void* state;
+    void (*attach)(struct zd_transport* transport, int rank);
+    void (*started)(struct zd_transport* transport, int rank, long pid);
+    void (*hangup)(struct zd_transport* transport, int peer);
+    bool (*send)(struct zd_transport* transport, int peer, const void* data, size_t size);
+    bool (*recv)(struct zd_transport* transport, int peer, void* data, size_t size);
+    void (*close)(struct zd_transport* transport);
+}ZD_Transport;
+
+const char* zd_transport_name(ZD_Transport_Kind kind);
+bool zd_transport_from_name(const char* name, ZD_Transport_Kind* kind);
+ZD_Transport* zd_transport_new(ZD_Transport_Kind kind, int workers);
+void zd_transport_free(ZD_Transport* transport);
+double zd_nn_fit(ZN_NN* nn, ZI_Img** imgs, int n, const ZN_Train_Config* config, ZD_Transport* transport);
+
+#endif // ZDIST_H_
+
+#ifdef ZDIST_IMPLEMENTATION
+
+static const char* const zd_transport_names[ZD_TRANSPORT_COUNT] = {
+    [ZD_TRANSPORT_SHM] = "shm",
+    [ZD_TRANSPORT_SOCKET] = "socket",
+};
+
+const char* zd_transport_name(ZD_Transport_Kind kind){
+    return _MZ_name_of(zd_transport_names, ZD_TRANSPORT_COUNT, kind);
+}
+
+bool zd_transport_from_name(const char* name, ZD_Transport_Kind* kind){
+
+    int value;
+    if(!_MZ_value_of(zd_transport_names, ZD_TRANSPORT_COUNT, "transport", name, &value)) return false;
+
+    *kind = (ZD_Transport_Kind)value;
+    return true;
+}
+
+void zd_transport_free(ZD_Transport* transport){
+
+    if(transport == NULL) return;
+
+    transport->close(transport);
+    free(transport);
+}
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void* zd_shm_map(size_t bytes){
+
+    // The segment is unlinked as soon as it is mapped, the forked workers inherit the mapping and
+    // nothing is left behind in /dev/shm whatever way the processes end
+    static unsigned int segments = 0;
+    char name[64];
+
+    snprintf(name, sizeof(name), "/znn-%d-%u", (int)getpid(), segments++);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0) return NULL;
+
+    shm_unlink(name);
+
+    if(ftruncate(fd, (off_t)bytes) != 0){
+        close(fd);
+        return NULL;
+    }
+
+    void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+// a ring of bytes with one writer and one reader, each one only moves its own counter
+typedef struct zd_ring{
+    _Alignas(64) size_t head;
+    _Alignas(64) size_t tail;
+    _Alignas(64) unsigned char data[ZD_RING_SIZE];
+}ZD_Ring;
+
+// the rings between the coordinator and one worker, the pid of the worker is written by both ends
+typedef struct zd_link{
+    ZD_Ring up;
+    ZD_Ring down;
+    pid_t worker;
+    bool closed;
+}ZD_Link;
+
+typedef struct zd_shm{
+    ZD_Link* links;
+    size_t bytes;
+    pid_t coordinator;
+}ZD_Shm;
+
+static bool zd_shm_peer_alive(ZD_Transport* transport, int peer){
+
+    ZD_Shm* shm = (ZD_Shm*)transport->state;
+
+    if(transport->rank != ZD_COORDINATOR){
+        return !__atomic_load_n(&shm->links[transport->rank].closed, __ATOMIC_ACQUIRE) && getppid() == shm->coordinator;
+    }
+
+    // the pid is there from the fork on, a worker without one was never started
+    pid_t worker = __atomic_load_n(&shm->links[peer].worker, __ATOMIC_ACQUIRE);
+    if(worker == 0) return false;
+
+    // the worker is a child of the coordinator, its exit is seen without reaping it
+    siginfo_t info = {0};
+    return waitid(P_PID, (id_t)worker, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0;
+}
+
+static bool zd_shm_wait(ZD_Transport* transport, int peer, unsigned int* spins){
+
+    // a short spin for the replies that are already coming, then the core goes to the other processes
+    unsigned int spin = (*spins)++;
+
+    if(spin < 64) return true;
+
+    if((spin & 63) == 0 && !zd_shm_peer_alive(transport, peer)) return false;
+
+    if(spin < 1024){
+        sched_yield();
+    }else {
+        struct timespec ts = { 0, 50000 };
+        nanosleep(&ts, NULL);
+    }
+
+    return true;
+}
+
+static bool zd_ring_write(ZD_Transport* transport, int peer, ZD_Ring* ring, const unsigned char* data, size_t size){
+
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned int spins = 0;
+
+    while(size > 0){
+        size_t room = ZD_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+
+        if(room == 0){
+            if(!zd_shm_wait(transport, peer, &spins)) return false;
+            continue;
+        }
+
+        size_t offset = head & (ZD_RING_SIZE - 1);
+        size_t chunk = MZ_MIN(MZ_MIN(size, room), ZD_RING_SIZE - offset);
+
+        memcpy(ring->data + offset, data, chunk);
+        head += chunk;
+        data += chunk;
+        size -= chunk;
+        spins = 0;
+
+        // the bytes are visible to the reader before the counter that gives them
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+static bool zd_ring_read(ZD_Transport* transport, int peer, ZD_Ring* ring, unsigned char* data, size_t size){
+
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    unsigned int spins = 0;
+
+    while(size > 0){
+        size_t ready = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+
+        if(ready == 0){
+            if(!zd_shm_wait(transport, peer, &spins)) return false;
+            continue;
+        }
+
+        size_t offset = tail & (ZD_RING_SIZE - 1);
+        size_t chunk = MZ_MIN(MZ_MIN(size, ready), ZD_RING_SIZE - offset);
+
+        memcpy(data, ring->data + offset, chunk);
+        tail += chunk;
+        data += chunk;
+        size -= chunk;
+        spins = 0;
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return true;
+}
+
+static void zd_shm_attach(ZD_Transport* transport, int rank){
+
+    ZD_Shm* shm = (ZD_Shm*)transport->state;
+
+    transport->rank = rank;
+    if(rank != ZD_COORDINATOR) __atomic_store_n(&shm->links[rank].worker, getpid(), __ATOMIC_RELEASE);
+}
+
+static void zd_shm_started(ZD_Transport* transport, int rank, long pid){
+
+    ZD_Shm* shm = (ZD_Shm*)transport->state;
+
+    __atomic_store_n(&shm->links[rank].worker, (pid_t)pid, __ATOMIC_RELEASE);
+}
+
+static void zd_shm_hangup(ZD_Transport* transport, int peer){
+
+    // the worker sees it the next time it waits on one of its rings
+    ZD_Shm* shm = (ZD_Shm*)transport->state;
+
+    __atomic_store_n(&shm->links[peer].closed, true, __ATOMIC_RELEASE);
+}
+
+static bool zd_shm_send(ZD_Transport* transport, int peer, const void* data, size_t size){
+
+    ZD_Shm* shm = (ZD_Shm*)transport->state;
+
+    if(transport->rank == ZD_COORDINATOR) return zd_ring_write(transport, peer, &shm->links[peer].down, (const unsigned char*)data, size);
+    return zd_ring_write(transport, peer, &shm->links[transport->rank].up, (const unsigned char*)data, size);
+}
+
+static bool zd_shm_recv(ZD_Transport* transport, int peer, void* data, size_t size){
+
+    ZD_Shm* shm = (ZD_Shm*)transport->state;
+
+    if(transport->rank == ZD_COORDINATOR) return zd_ring_read(transport, peer, &shm->links[peer].up, (unsigned char*)data, size);
+    return zd_ring_read(transport, peer, &shm->links[transport->rank].down, (unsigned char*)data, size);
+}
+
+static void zd_shm_close(ZD_Transport* transport){
+
+    ZD_Shm* shm = (ZD_Shm*)transport->state;
+
+    munmap(shm->links, shm->bytes);
+    free(shm);
+}
+
+static bool zd_socket_send(ZD_Transport* transport, int peer, const void* data, size_t size){
+
+    int* fds = (int*)transport->state;
+    int fd = transport->rank == ZD_COORDINATOR ? fds[2 * peer] : fds[2 * transport->rank + 1];
+    const char* bytes = (const char*)data;
+
+    while(size > 0){
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+
+    return true;
+}
+
+static bool zd_socket_recv(ZD_Transport* transport, int peer, void* data, size_t size){
+
+    int* fds = (int*)transport->state;
+    int fd = transport->rank == ZD_COORDINATOR ? fds[2 * peer] : fds[2 * transport->rank + 1];
+    char* bytes = (char*)data;
+
+    while(size > 0){
+        ssize_t got = recv(fd, bytes, size, 0);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        bytes += got;
+        size -= (size_t)got;
+    }
+
+    return true;
+}
+
+static void zd_socket_attach(ZD_Transport* transport, int rank){
+
+    // every process keeps only its own ends, so a worker that is gone closes its socket for good
+    int* fds = (int*)transport->state;
+
+    transport->rank = rank;
+
+    for(int w = 0; w < transport->workers; w++){
+        if(rank == ZD_COORDINATOR || rank != w){
+            close(fds[2 * w + 1]);
+            fds[2 * w + 1] = -1;
+        }
+        if(rank != ZD_COORDINATOR){
+            close(fds[2 * w]);
+            fds[2 * w] = -1;
+        }
+    }
+}
+
+static void zd_socket_started(ZD_Transport* transport, int rank, long pid){
+    // a worker that is gone closes its end, the coordinator does not need the pid
+    (void)transport;
+    (void)rank;
+    (void)pid;
+}
+
+static void zd_socket_hangup(ZD_Transport* transport, int peer){
+
+    // what was sent stays readable, the sends of the worker fail from now on
+    int* fds = (int*)transport->state;
+
+    if(fds[2 * peer] >= 0) shutdown(fds[2 * peer], SHUT_RD);
+}
+
+static void zd_socket_close(ZD_Transport* transport){
+
+    int* fds = (int*)transport->state;
+
+    for(int i = 0; i < 2 * transport->workers; i++){
+        if(fds[i] >= 0) close(fds[i]);
+    }
+
+    free(fds);
+}
+
+ZD_Transport* zd_transport_new(ZD_Transport_Kind kind, int workers){
+
+    if(workers < 1 || kind >= ZD_TRANSPORT_COUNT) return NULL;
+
+    ZD_Transport* transport = (ZD_Transport*)malloc(sizeof(ZD_Transport));
+    if(transport == NULL) return NULL;
+
+    *transport = (ZD_Transport){
+        .name = zd_transport_name(kind),
+        .workers = workers,
+        .rank = ZD_COORDINATOR,
+    };
+
+    if(kind == ZD_TRANSPORT_SHM){
+        // two lock-free rings per worker in one shared segment
+        ZD_Shm* shm = (ZD_Shm*)malloc(sizeof(ZD_Shm));
+        size_t bytes = (size_t)workers * sizeof(ZD_Link);
+        ZD_Link* links = shm != NULL ? (ZD_Link*)zd_shm_map(bytes) : NULL;
+
+        if(links == NULL){
+            free(shm);
+            free(transport);
+            return NULL;
+        }
+
+        *shm = (ZD_Shm){ links, bytes, getpid() };
+        transport->state = shm;
+        transport->attach = zd_shm_attach;
+        transport->started = zd_shm_started;
+        transport->hangup = zd_shm_hangup;
+        transport->send = zd_shm_send;
+        transport->recv = zd_shm_recv;
+        transport->close = zd_shm_close;
+        return transport;
+    }
+
+    // a pair of connected Unix sockets per worker, a network transport would be a socket per worker too
+    int* fds = (int*)malloc(2 * workers * sizeof(int));
+
+    if(fds == NULL){
+        free(transport);
+        return NULL;
+    }
+
+    for(int w = 0; w < workers; w++){
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[2 * w]) != 0){
+            for(int i = 0; i < 2 * w; i++) close(fds[i]);
+            free(fds);
+            free(transport);
+            return NULL;
+        }
+    }
+
+    transport->state = fds;
+    transport->attach = zd_socket_attach;
+    transport->started = zd_socket_started;
+    transport->hangup = zd_socket_hangup;
+    transport->send = zd_socket_send;
+    transport->recv = zd_socket_recv;
+    transport->close = zd_socket_close;
+    return transport;
+}
+
+typedef enum zd_op{
+    ZD_OP_BATCH = 0,
+    ZD_OP_STOP
+}ZD_Op;
+
+// the samples order[first] ... order[first + size - 1] of a batch of batch samples
+typedef struct zd_command{
+    int op;
+    int first;
+    int size;
+    int batch;
+}ZD_Command;
+
+typedef struct zd_coordinator{
+    ZD_Transport* transport;
+    unsigned int* order;
+    MZ_Matrix hidden_gradient;
+    MZ_Matrix output_gradient;
+    MZ_Matrix hidden_part;
+    MZ_Matrix output_part;
+    bool failed;
+}ZD_Coordinator;
+
+static size_t zd_matrix_bytes(MZ_Matrix matrix){
+    return (size_t)matrix.rows * matrix.stride * sizeof(float);
+}
+
+static void zd_worker_main(ZD_Transport* transport, int rank, ZN_NN* nn, ZI_Img** imgs, const unsigned int* order, int batch_size){
+
+    // The weights of nn are the shared ones, the workspace and the gradients are the worker's own.
+    // A worker answers every command with the sum of the losses and the gradients of its samples.
+    transport->attach(transport, rank);
+
+    // there is a process per core already, the products stay on the thread of the worker
+    MZ_set_num_threads(1);
+
+    ZN_NN local = *nn;
+    local.workspace = (ZN_Workspace){0};
+    local.optimizer = (ZN_Optimizer){0};
+    zn_nn_reserve(&local, (batch_size + transport->workers - 1) / transport->workers);
+
+    MZ_Matrix hidden_gradient = MZ_alloc_matrix(nn->hidden, nn->input);
+    MZ_Matrix output_gradient = MZ_alloc_matrix(nn->output, nn->hidden);
+    ZD_Command command;
+
+    while(transport->recv(transport, ZD_COORDINATOR, &command, sizeof(command)) && command.op == ZD_OP_BATCH){
+
+        MZ_Matrix input_batch = zn_nn_stage_imgs(&local, imgs, order, command.first, command.size);
+        double loss = zn_nn_gradient_labels(&local, input_batch, local.workspace.labels,
+                                            &hidden_gradient, &output_gradient, 1.0f / command.batch);
+
+        if(!transport->send(transport, ZD_COORDINATOR, &loss, sizeof(loss)) ||
+           !transport->send(transport, ZD_COORDINATOR, hidden_gradient.elements, zd_matrix_bytes(hidden_gradient)) ||
+           !transport->send(transport, ZD_COORDINATOR, output_gradient.elements, zd_matrix_bytes(output_gradient))) break;
+    }
+
+    // the memory goes with the process, the buffers of stdio are the coordinator's to flush
+    _exit(EXIT_SUCCESS);
+}
+
+static double zd_coordinator_step(ZD_Coordinator* c, ZN_NN* nn, int first, int size){
+
+    // Each worker gets an even part of the batch, their gradients are summed in the order of the
+    // workers so a training with the same seed and workers always gives the same weights
+    ZD_Transport* transport = c->transport;
+    int workers = transport->workers;
+    double loss = 0.0;
+    bool ok = true;
+    bool summed = false;
+
+    for(int w = 0; w < workers && ok; w++){
+        int lo = (int)((long long)size * w / workers);
+        int hi = (int)((long long)size * (w + 1) / workers);
+        if(hi == lo) continue;
+
+        ZD_Command command = { ZD_OP_BATCH, first + lo, hi - lo, size };
+        ok = transport->send(transport, w, &command, sizeof(command));
+    }
+
+    for(int w = 0; w < workers && ok; w++){
+        int lo = (int)((long long)size * w / workers);
+        int hi = (int)((long long)size * (w + 1) / workers);
+        if(hi == lo) continue;
+
+        MZ_Matrix* hidden = summed ? &c->hidden_part : &c->hidden_gradient;
+        MZ_Matrix* output = summed ? &c->output_part : &c->output_gradient;
+        double part_loss = 0.0;
+
+        ok = transport->recv(transport, w, &part_loss, sizeof(part_loss)) &&
+             transport->recv(transport, w, hidden->elements, zd_matrix_bytes(*hidden)) &&
+             transport->recv(transport, w, output->elements, zd_matrix_bytes(*output));
+
+        if(ok && summed){
+            MZ_add_two_matrices_into(&c->hidden_gradient, c->hidden_gradient, c->hidden_part);
+            MZ_add_two_matrices_into(&c->output_gradient, c->output_gradient, c->output_part);
+        }
+
+        loss += part_loss;
+        summed = true;
+    }
+
+    if(!ok){
+        fprintf(stderr, "[ERROR]: Lost a worker of the %s transport\n", transport->name);
+        c->failed = true;
+        return 0.0;
+    }
+
+    zn_nn_apply_gradients(nn, c->hidden_gradient, c->output_gradient);
+
+    return loss;
+}
+
+static double zd_train_epoch(void* arg, ZN_NN* nn, ZI_Img** imgs, const unsigned int* order, int n,
+                             const ZN_Train_Config* config, double base_rate, unsigned long first_step, unsigned long steps){
+
+    // the workers have their own copy of the images, they find the samples of a command in the shared order
+    ZD_Coordinator* c = (ZD_Coordinator*)arg;
+    int batch_size = MZ_MAX(config->batch_size, 1);
+    double loss = 0.0;
+
+    (void)imgs;
+    memcpy(c->order, order, n * sizeof(unsigned int));
+
+    for(int i = 0; i < n && !c->failed; i += batch_size){
+        nn->learning_rate = zn_schedule_rate(config, base_rate, (double)(first_step + i / batch_size) / steps);
+        loss += zd_coordinator_step(c, nn, i, MZ_MIN(n - i, batch_size));
+    }
+
+    return c->failed ? NAN : loss;
+}
+
+double zd_nn_fit(ZN_NN* nn, ZI_Img** imgs, int n, const ZN_Train_Config* config, ZD_Transport* transport){
+
+    // The weights move to a shared segment for the whole training, the workers forked here read them
+    // from there and send back the gradients of their part of each batch. The coordinator sums them,
+    // updates the weights in place and only then sends the next batch. Everything else, epochs,
+    // schedule, validation and early stopping, is the one of zn_nn_fit.
+    if(transport == NULL){
+        fprintf(stderr, "[WARNING]: No transport for the worker processes, training on this process\n");
+        return zn_nn_fit(nn, imgs, n, config);
+    }
+
+    MZ_Matrix own_hidden = nn->hidden_weights;
+    MZ_Matrix own_output = nn->output_weights;
+    size_t hidden_bytes = zd_matrix_bytes(own_hidden);
+    size_t output_bytes = zd_matrix_bytes(own_output);
+    size_t bytes = hidden_bytes + output_bytes + (size_t)n * sizeof(unsigned int);
+    unsigned char* shared = (unsigned char*)zd_shm_map(bytes);
+
+    if(shared == NULL){
+        fprintf(stderr, "[WARNING]: Failed to map the shared weights, training on this process\n");
+        return zn_nn_fit(nn, imgs, n, config);
+    }
+
+    nn->hidden_weights = MZ_view_from_buffer((float*)shared, own_hidden.rows, own_hidden.cols, own_hidden.stride, 1);
+    nn->output_weights = MZ_view_from_buffer((float*)(shared + hidden_bytes), own_output.rows, own_output.cols, own_output.stride, 1);
+    MZ_copy_matrix_into(&nn->hidden_weights, own_hidden);
+    MZ_copy_matrix_into(&nn->output_weights, own_output);
+
+    ZD_Coordinator c = {
+        .transport = transport,
+        .order = (unsigned int*)(shared + hidden_bytes + output_bytes),
+        .hidden_gradient = MZ_alloc_matrix(nn->hidden, nn->input),
+        .output_gradient = MZ_alloc_matrix(nn->output, nn->hidden),
+        .hidden_part = MZ_alloc_matrix(nn->hidden, nn->input),
+        .output_part = MZ_alloc_matrix(nn->output, nn->hidden),
+    };
+
+    int workers = transport->workers;
+    pid_t* pids = (pid_t*)malloc(workers * sizeof(pid_t));
+    MZ_assert(pids != NULL, MZ_ALLOC_ERROR);
+
+    // whatever is buffered would be written again by every worker
+    fflush(stdout);
+    fflush(stderr);
+
+    int started = 0;
+
+    for(; started < workers; started++){
+        pid_t pid = fork();
+        if(pid < 0) break;
+        if(pid == 0) zd_worker_main(transport, started, nn, imgs, c.order, MZ_MAX(config->batch_size, 1));
+        pids[started] = pid;
+        transport->started(transport, started, (long)pid);
+    }
+
+    transport->attach(transport, ZD_COORDINATOR);
+
+    double loss = 0.0;
+
+    if(started < workers){
+        fprintf(stderr, "[ERROR]: Failed to start the worker processes\n");
+        c.failed = true;
+    }else {
+        printf("Training on %d worker processes over the %s transport\n", workers, transport->name);
+
+        char label[64];
+        snprintf(label, sizeof(label), "%d worker processes", workers);
+
+        ZN_Train_Config dist_config = *config;
+        dist_config.threads = 1;
+        dist_config.parallel = ZN_PARALLEL_HOGWILD;
+        dist_config.trainer = zd_train_epoch;
+        dist_config.trainer_arg = &c;
+        dist_config.trainer_label = label;
+
+        loss = zn_nn_fit(nn, imgs, n, &dist_config);
+    }
+
+    // a worker may still be writing the reply to a batch that failed, the hangup makes it give up
+    ZD_Command stop = { ZD_OP_STOP, 0, 0, 0 };
+
+    for(int w = 0; w < started; w++){
+        transport->send(transport, w, &stop, sizeof(stop));
+        transport->hangup(transport, w);
+    }
+
+    for(int w = 0; w < started; w++){
+        int status = 0;
+        waitpid(pids[w], &status, 0);
+    }
+
+    MZ_copy_matrix_into(&own_hidden, nn->hidden_weights);
+    MZ_copy_matrix_into(&own_output, nn->output_weights);
+    nn->hidden_weights = own_hidden;
+    nn->output_weights = own_output;
+
+    munmap(shared, bytes);
+    MZ_free_matrix(&c.hidden_gradient);
+    MZ_free_matrix(&c.output_gradient);
+    MZ_free_matrix(&c.hidden_part);
+    MZ_free_matrix(&c.output_part);
+    free(pids);
+
+    return loss;
+}
+
+#else
+
+ZD_Transport* zd_transport_new(ZD_Transport_Kind kind, int workers){
+    // processes and shared memory are only done on POSIX systems, zd_nn_fit trains on this process
+    (void)kind;
+    (void)workers;
+    return NULL;
+}
+
+double zd_nn_fit(ZN_NN* nn, ZI_Img** imgs, int n, const ZN_Train_Config* config, ZD_Transport* transport){
+    (void)transport;
+    return zn_nn_fit(nn, imgs, n, config);
+}
+
+#endif
+
+#endif // ZDIST_IMPLEMENTATION
@@ -27,6 +27,7 @@ SOFTWARE.
 
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #define ZMATH_IMPLEMENTATION
 #include "zmath.h"
@@ -36,10 +37,88 @@ typedef struct{
     int label;
 }ZI_Img;
 
+// pixels of an image, the rows of the inputs of a batch
+#define ZI_PIXELS (28 * 28)
+
+// the labels of the images are 0 ... ZI_CLASSES - 1
+#define ZI_CLASSES 10
+
+// the images first ... first + count - 1 of a pass over the file, a sample per col of inputs
+typedef struct{
+    MZ_Matrix inputs;
+    unsigned int* labels;
+    int count;
+    int first;
+    int pass;
+}ZI_Batch;
+
+// trainer_stalls: times the trainer found no batch ready, the training waits on the file
+// loader_stalls: times the loader found no free buffer, the file waits on the training
+typedef struct{
+    unsigned long batches;
+    unsigned long trainer_stalls;
+    double trainer_wait;
+    unsigned long loader_stalls;
+    double loader_wait;
+}ZI_Loader_Stats;
+
+// the most dimensions of an IDX file read by zi_idx_open
+#define ZI_IDX_MAX_DIMS 4
+
+// An IDX file of unsigned bytes mapped read only, the header is checked when it is opened. Item i
+// of the first dimension is the item_size bytes at values + i * item_size, they are never copied.
+typedef struct{
+    char* map;
+    size_t map_size;
+    const unsigned char* values;
+    int ndims;
+    unsigned int dims[ZI_IDX_MAX_DIMS];
+    size_t count;
+    size_t item_size;
+}ZI_Idx;
+
+// A thread that parses the next batches of a csv file into a ring of depth buffers while the
+// current one is trained. Each pass reads the first number_of_images images of the file again.
+// With the IDX files of zi_loader_new_idx the batches are converted from the mapped bytes instead.
+// A file that cannot be read, a malformed row or a pass shorter than number_of_images images is
+// printed by the thread and fails the loader, zi_loader_next gives no batch from then on.
+typedef struct{
+    char* filename;
+    ZI_Idx* idx_images;
+    ZI_Idx* idx_labels;
+    int number_of_images;
+    int batch_size;
+    int depth;
+    int passes;
+    ZI_Batch* batches;
+    unsigned long produced;
+    unsigned long consumed;
+    bool done;
+    bool failed;
+    bool stop;
+    ZI_Loader_Stats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+    pthread_t thread;
+}ZI_Loader;
+
 ZI_Img** zi_csv_to_imgs(const char* filename, int number_of_images);
 void zi_img_print(ZI_Img* img);
 void zi_img_free(ZI_Img* img);
 void zi_imgs_free(ZI_Img** imgs, int n);
+ZI_Idx* zi_idx_open(const char* filename);
+const unsigned char* zi_idx_item(const ZI_Idx* idx, size_t i);
+void zi_idx_pixels(const ZI_Idx* images, size_t i, float* pixels, size_t stride);
+void zi_idx_close(ZI_Idx* idx);
+ZI_Img** zi_idx_to_imgs(const char* images_filename, const char* labels_filename, int number_of_images);
+ZI_Loader* zi_loader_new(const char* filename, int number_of_images, int batch_size, int depth, int passes);
+ZI_Loader* zi_loader_new_idx(const char* images_filename, const char* labels_filename, int number_of_images, int batch_size, int depth, int passes);
+ZI_Batch* zi_loader_next(ZI_Loader* loader);
+bool zi_loader_failed(ZI_Loader* loader);
+void zi_loader_release(ZI_Loader* loader);
+ZI_Loader_Stats zi_loader_stats(ZI_Loader* loader);
+void zi_loader_free(ZI_Loader* loader);
 
 #define MAXCHAR 10000
 
@@ -47,45 +126,246 @@ void zi_imgs_free(ZI_Img** imgs, int n);
 
 #ifdef ZIMG_IMPLEMENTATION
 
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ZI_MMAP 1
+#else
+#define ZI_MMAP 0
+#endif
+
+// bytes of the file parsed by a task at least, smaller files are parsed by fewer threads
+#define ZI_CHUNK_MIN ((size_t)1 << 18)
+
+static char* zi_map_file(const char* filename, size_t* size){
+
+    // The whole file is mapped read only, where there is no mmap it is read in a buffer
+#if ZI_MMAP
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return NULL;
+
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    *size = (size_t)st.st_size;
+    return (char*)data;
+#else
+    FILE* fp = fopen(filename, "rb");
+    if(fp == NULL) return NULL;
+
+    fseek(fp, 0L, SEEK_END);
+    long bytes = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+
+    char* data = bytes > 0 ? (char*)malloc((size_t)bytes) : NULL;
+    if(data == NULL || fread(data, 1, (size_t)bytes, fp) != (size_t)bytes){
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+    *size = (size_t)bytes;
+    return data;
+#endif
+}
+
+static void zi_unmap_file(char* data, size_t size){
+#if ZI_MMAP
+    munmap(data, size);
+#else
+    (void)size;
+    free(data);
+#endif
+}
+
+static const char* zi_parse_uint(const char* cur, const char* end, unsigned int* value){
+
+    unsigned int v = 0;
+
+    // the long numbers stop growing past any valid value instead of wrapping around
+    while(cur < end && (unsigned int)(*cur - '0') < 10){
+        v = v < 100000000u ? v * 10 + (unsigned int)(*cur - '0') : v;
+        cur++;
+    }
+
+    *value = v;
+    return cur;
+}
+
+static bool zi_parse_row(const char* row, const char* end, float* pixels, size_t stride, unsigned int* label){
+
+    // label,pixel,...,pixel up to end with a label below ZI_CLASSES and ZI_PIXELS pixels of a byte,
+    // the pixels are written stride apart
+    unsigned int value;
+    const char* cur = zi_parse_uint(row, end, label);
+
+    if(cur == row || *label >= ZI_CLASSES) return false;
+
+    for(size_t i = 0; i < ZI_PIXELS; i++){
+        if(cur == end || *cur != ',') return false;
+        const char* digits = cur + 1;
+        cur = zi_parse_uint(digits, end, &value);
+        if(cur == digits || value > 255) return false;
+        pixels[i * stride] = value / 256.0f;
+    }
+
+    // only the end of the line may follow
+    while(cur < end && (*cur == '\r' || *cur == '\n')) cur++;
+
+    return cur == end;
+}
+
+// the rows of the file after the header cut in chunks that start at the beginning of a line
+typedef struct{
+    const char* data;
+    size_t size;
+    size_t chunks;
+    size_t* starts;
+    int* rows;
+    int* first;
+    int* bad;
+    ZI_Img** imgs;
+    int number_of_images;
+}ZI_Csv;
+
+static void zi_csv_count_rows(void* arg, size_t chunk){
+
+    ZI_Csv* csv = (ZI_Csv*)arg;
+    const char* cur = csv->data + csv->starts[chunk];
+    const char* end = csv->data + csv->starts[chunk + 1];
+    int rows = 0;
+
+    // a last line without its newline is a row too
+    while(cur < end){
+        const char* line_end = memchr(cur, '\n', end - cur);
+        if(line_end == NULL) line_end = end;
+        if(line_end - cur > 1 || (line_end > cur && *cur != '\r')) rows++;
+        cur = line_end + 1;
+    }
+
+    csv->rows[chunk] = rows;
+}
+
+static void zi_csv_parse_rows(void* arg, size_t chunk){
+
+    ZI_Csv* csv = (ZI_Csv*)arg;
+    const char* cur = csv->data + csv->starts[chunk];
+    const char* end = csv->data + csv->starts[chunk + 1];
+    int i = csv->first[chunk];
+
+    // the first image of the chunk that is not a valid row, -1 when there is none
+    csv->bad[chunk] = -1;
+
+    while(cur < end && i < csv->number_of_images){
+        const char* line_end = memchr(cur, '\n', end - cur);
+        if(line_end == NULL) line_end = end;
+        if(line_end - cur <= 1 && (line_end == cur || *cur == '\r')){
+            cur = line_end + 1;
+            continue;
+        }
+
+        ZI_Img* img = (ZI_Img*)malloc(sizeof(ZI_Img));
+        MZ_assert(img != NULL, MZ_ALLOC_ERROR);
+        img->img_data = MZ_alloc_matrix_with_stride(28, 28, 28);
+
+        // the rows of the image are contiguous, its pixels are in the order of the file
+        unsigned int label = 0;
+        bool valid = zi_parse_row(cur, line_end, img->img_data.elements, img->img_data.col_stride, &label);
+        img->label = (int)label;
+        cur = line_end + 1;
+        csv->imgs[i++] = img;
+
+        if(!valid){
+            csv->bad[chunk] = i - 1;
+            break;
+        }
+    }
+}
+
 ZI_Img** zi_csv_to_imgs(const char* filename, int number_of_images){
-    FILE *fp;
 
-    fopen_s(&fp, filename, "r");
+    // The file is mapped and cut in chunks that end on a newline. The rows of every chunk are counted
+    // in parallel, which gives the first image of each chunk, then the chunks are parsed in parallel
+    // straight into their images.
+    size_t size = 0;
+    char* data = zi_map_file(filename, &size);
 
-    if(fp == NULL){
+    if(data == NULL){
         fprintf(stderr, "[ERROR]: Failed to open image file %s\n", filename);
         exit(EXIT_FAILURE);
     }
 
-    ZI_Img** imgs = (ZI_Img**)malloc(number_of_images * sizeof(ZI_Img*));
+    // the first row holds the names of the cols
+    const char* header_end = memchr(data, '\n', size);
+    size_t body = header_end != NULL ? (size_t)(header_end + 1 - data) : size;
+
+    size_t threads = MZ_get_num_threads();
+    size_t chunks = MZ_MAX(MZ_MIN(threads * 4, (size - body) / ZI_CHUNK_MIN), (size_t)1);
 
-    char row[MAXCHAR];
+    ZI_Csv csv = {
+        .data = data,
+        .size = size,
+        .chunks = chunks,
+        .starts = (size_t*)malloc((chunks + 1) * sizeof(size_t)),
+        .rows = (int*)malloc(chunks * sizeof(int)),
+        .first = (int*)malloc(chunks * sizeof(int)),
+        .bad = (int*)malloc(chunks * sizeof(int)),
+        .imgs = (ZI_Img**)malloc(number_of_images * sizeof(ZI_Img*)),
+        .number_of_images = number_of_images,
+    };
+    MZ_assert(csv.starts != NULL && csv.rows != NULL && csv.first != NULL && csv.bad != NULL && csv.imgs != NULL, MZ_ALLOC_ERROR);
 
-    fgets(row, MAXCHAR, fp);
+    csv.starts[0] = body;
+    csv.starts[chunks] = size;
 
-    int i = 0;
+    for(size_t c = 1; c < chunks; c++){
+        size_t at = MZ_MAX(body + (size - body) * c / chunks, csv.starts[c - 1]);
+        const char* line_end = memchr(data + at, '\n', size - at);
+        csv.starts[c] = line_end != NULL ? (size_t)(line_end + 1 - data) : size;
+    }
 
-    while(feof(fp) != 1 && i < number_of_images){
-        imgs[i] = (ZI_Img*)malloc(sizeof(ZI_Img));
+    MZ_parallel_for(chunks, zi_csv_count_rows, &csv);
 
-        int j = 0;
-        fgets(row, MAXCHAR, fp);
-        char* token = strtok(row, ",");
-        imgs[i]->img_data = MZ_alloc_matrix(28, 28);
-        
-        while(token != NULL){
-            if(j == 0){
-                imgs[i]->label = atoi(token);
-            }else {
-                imgs[i]->img_data.elements[(j-1) / 28][(j-1) % 28] = atoi(token) / 256.0f;
-            }
-            token = strtok(NULL, ",");
-            j++;
+    int rows = 0;
+
+    for(size_t c = 0; c < chunks; c++){
+        csv.first[c] = rows;
+        rows += csv.rows[c];
+    }
+
+    if(rows < number_of_images){
+        fprintf(stderr, "[ERROR]: The image file %s holds %d images, %d were asked\n", filename, rows, number_of_images);
+        exit(EXIT_FAILURE);
+    }
+
+    MZ_parallel_for(chunks, zi_csv_parse_rows, &csv);
+
+    for(size_t c = 0; c < chunks; c++){
+        if(csv.bad[c] >= 0){
+            fprintf(stderr, "[ERROR]: The image %d of %s is not a label below %d and %d pixels of a byte\n",
+                    csv.bad[c], filename, ZI_CLASSES, ZI_PIXELS);
+            exit(EXIT_FAILURE);
         }
-        i++;
     }
-    fclose(fp);
-    return imgs;
+
+    zi_unmap_file(data, size);
+    free(csv.starts);
+    free(csv.rows);
+    free(csv.first);
+    free(csv.bad);
+
+    return csv.imgs;
 }
 
 void zi_img_print(ZI_Img* img){
@@ -107,4 +387,429 @@ void zi_imgs_free(ZI_Img** imgs, int n){
 	imgs = NULL;
 }
 
+// the type byte of the magic number of IDX files of unsigned bytes
+#define ZI_IDX_UBYTE 0x08
+
+ZI_Idx* zi_idx_open(const char* filename){
+
+    // The magic number is 0, 0, the type of the values and the number of dimensions, followed by the
+    // size of each dimension on 4 big endian bytes and the values. With mmap only the header is read here.
+    size_t size = 0;
+    char* map = zi_map_file(filename, &size);
+
+    if(map == NULL){
+        fprintf(stderr, "[ERROR]: Failed to open IDX file %s\n", filename);
+        return NULL;
+    }
+
+    const unsigned char* bytes = (const unsigned char*)map;
+    const char* error = NULL;
+    ZI_Idx idx = {
+        .map = map,
+        .map_size = size,
+        .ndims = size >= 4 ? bytes[3] : 0,
+        .item_size = 1,
+    };
+    size_t header = 4 + 4 * (size_t)idx.ndims;
+
+    if(size < 4 || bytes[0] != 0 || bytes[1] != 0){
+        error = "is not an IDX file";
+    }else if(bytes[2] != ZI_IDX_UBYTE){
+        error = "does not hold unsigned bytes";
+    }else if(idx.ndims < 1 || idx.ndims > ZI_IDX_MAX_DIMS || size < header){
+        error = "has an invalid number of dimensions";
+    }
+
+    for(int d = 0; error == NULL && d < idx.ndims; d++){
+        const unsigned char* dim = bytes + 4 + 4 * d;
+        idx.dims[d] = (unsigned int)dim[0] << 24 | (unsigned int)dim[1] << 16 | (unsigned int)dim[2] << 8 | dim[3];
+        if(d == 0) continue;
+        if(idx.dims[d] != 0 && idx.item_size > SIZE_MAX / idx.dims[d]){
+            error = "has dimensions too large";
+        }else {
+            idx.item_size *= idx.dims[d];
+        }
+    }
+
+    idx.count = idx.dims[0];
+    idx.values = bytes + header;
+
+    if(error == NULL && (idx.item_size == 0 || (size - header) / idx.item_size < idx.count)){
+        error = "is shorter than its dimensions";
+    }
+
+    if(error != NULL){
+        fprintf(stderr, "[ERROR]: The file %s %s\n", filename, error);
+        zi_unmap_file(map, size);
+        return NULL;
+    }
+
+    ZI_Idx* result = (ZI_Idx*)malloc(sizeof(ZI_Idx));
+    MZ_assert(result != NULL, MZ_ALLOC_ERROR);
+    *result = idx;
+
+    return result;
+}
+
+const unsigned char* zi_idx_item(const ZI_Idx* idx, size_t i){
+    return idx->values + i * idx->item_size;
+}
+
+void zi_idx_pixels(const ZI_Idx* images, size_t i, float* pixels, size_t stride){
+
+    // the bytes of an image are scaled like the pixels of the csv files
+    const unsigned char* values = zi_idx_item(images, i);
+
+    for(size_t j = 0; j < images->item_size; j++){
+        pixels[j * stride] = values[j] / 256.0f;
+    }
+}
+
+void zi_idx_close(ZI_Idx* idx){
+
+    if(idx == NULL) return;
+
+    zi_unmap_file(idx->map, idx->map_size);
+    free(idx);
+}
+
+static bool zi_idx_open_set(const char* images_filename, const char* labels_filename, int number_of_images,
+                            ZI_Idx** images, ZI_Idx** labels){
+
+    // images of ZI_PIXELS bytes and a label of one byte for each of the first number_of_images ones
+    *images = zi_idx_open(images_filename);
+    *labels = *images != NULL ? zi_idx_open(labels_filename) : NULL;
+
+    if(*labels == NULL){
+        zi_idx_close(*images);
+        return false;
+    }
+
+    const char* error = NULL;
+
+    if((*images)->ndims != 3 || (*images)->item_size != ZI_PIXELS){
+        error = "The images are not 28 x 28";
+    }else if((*labels)->ndims != 1){
+        error = "The labels are not a list";
+    }else if((*images)->count < (size_t)number_of_images || (*labels)->count < (size_t)number_of_images){
+        error = "There are fewer images or labels than asked";
+    }
+
+    // a label is the row of the output of the network it trains, every one is checked before
+    for(int i = 0; error == NULL && i < number_of_images; i++){
+        if((*labels)->values[i] >= ZI_CLASSES) error = "A label is not a digit";
+    }
+
+    if(error != NULL){
+        fprintf(stderr, "[ERROR]: %s in %s and %s\n", error, images_filename, labels_filename);
+        zi_idx_close(*images);
+        zi_idx_close(*labels);
+        return false;
+    }
+
+    return true;
+}
+
+// the images of an IDX file converted to ZI_Img, a task for every chunk of them
+typedef struct{
+    ZI_Idx* images;
+    ZI_Idx* labels;
+    ZI_Img** imgs;
+    int number_of_images;
+    size_t chunks;
+}ZI_Idx_Imgs;
+
+static void zi_idx_convert_imgs(void* arg, size_t chunk){
+
+    ZI_Idx_Imgs* set = (ZI_Idx_Imgs*)arg;
+    int first = (int)((size_t)set->number_of_images * chunk / set->chunks);
+    int last = (int)((size_t)set->number_of_images * (chunk + 1) / set->chunks);
+
+    for(int i = first; i < last; i++){
+        ZI_Img* img = (ZI_Img*)malloc(sizeof(ZI_Img));
+        MZ_assert(img != NULL, MZ_ALLOC_ERROR);
+        img->img_data = MZ_alloc_matrix_with_stride(28, 28, 28);
+        zi_idx_pixels(set->images, i, img->img_data.elements, img->img_data.col_stride);
+        img->label = *zi_idx_item(set->labels, i);
+        set->imgs[i] = img;
+    }
+}
+
+ZI_Img** zi_idx_to_imgs(const char* images_filename, const char* labels_filename, int number_of_images){
+
+    // Not lazy: every image is converted to floats here and the files are closed, so this costs the
+    // time and the memory of zi_csv_to_imgs without the parsing. Only the loader of zi_loader_new_idx
+    // keeps the files mapped and converts each batch when it is needed.
+    ZI_Idx_Imgs set = {
+        .imgs = (ZI_Img**)malloc(number_of_images * sizeof(ZI_Img*)),
+        .number_of_images = number_of_images,
+        .chunks = MZ_MAX(MZ_MIN((size_t)MZ_get_num_threads() * 4, (size_t)number_of_images), (size_t)1),
+    };
+    MZ_assert(set.imgs != NULL, MZ_ALLOC_ERROR);
+
+    if(!zi_idx_open_set(images_filename, labels_filename, number_of_images, &set.images, &set.labels)){
+        exit(EXIT_FAILURE);
+    }
+
+    MZ_parallel_for(set.chunks, zi_idx_convert_imgs, &set);
+
+    zi_idx_close(set.images);
+    zi_idx_close(set.labels);
+
+    return set.imgs;
+}
+
+static double zi_seconds(void){
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* zi_loader_main(void* arg){
+
+    ZI_Loader* loader = (ZI_Loader*)arg;
+    char* row = (char*)malloc(MAXCHAR);
+    bool failed = row == NULL;
+    bool stop = false;
+
+    for(int pass = 0; pass < loader->passes && !failed && !stop; pass++){
+
+        FILE* fp = NULL;
+        bool more = true;
+        int first = 0;
+
+        if(loader->idx_images == NULL){
+            fp = fopen(loader->filename, "r");
+            if(fp == NULL){
+                fprintf(stderr, "[ERROR]: Failed to open image file %s\n", loader->filename);
+                failed = true;
+                break;
+            }
+
+            // the first row holds the names of the cols
+            more = fgets(row, MAXCHAR, fp) != NULL;
+        }
+
+        while(more && first < loader->number_of_images){
+
+            pthread_mutex_lock(&loader->lock);
+            if(loader->produced - loader->consumed == (unsigned long)loader->depth){
+                double start = zi_seconds();
+                loader->stats.loader_stalls++;
+                while(loader->produced - loader->consumed == (unsigned long)loader->depth && !loader->stop){
+                    pthread_cond_wait(&loader->freed, &loader->lock);
+                }
+                loader->stats.loader_wait += zi_seconds() - start;
+            }
+            stop = loader->stop;
+            pthread_mutex_unlock(&loader->lock);
+
+            if(stop) break;
+
+            // the buffer is neither the one the trainer holds nor one waiting for it
+            ZI_Batch* batch = &loader->batches[loader->produced % loader->depth];
+            int count = 0;
+
+            while(count < loader->batch_size && first + count < loader->number_of_images){
+                float* pixels = batch->inputs.elements + (size_t)count * batch->inputs.col_stride;
+                if(loader->idx_images != NULL){
+                    // the IDX files were checked to hold number_of_images images
+                    zi_idx_pixels(loader->idx_images, first + count, pixels, batch->inputs.stride);
+                    batch->labels[count] = *zi_idx_item(loader->idx_labels, first + count);
+                }else if(fgets(row, MAXCHAR, fp) == NULL){
+                    more = false;
+                    break;
+                }else if(row[strspn(row, "\r\n")] == '\0'){
+                    // the blank lines are skipped like in zi_csv_to_imgs
+                    continue;
+                }else if(!zi_parse_row(row, row + strlen(row), pixels, batch->inputs.stride, &batch->labels[count])){
+                    // like zi_csv_to_imgs, the training never goes on with a part of the file
+                    fprintf(stderr, "[ERROR]: The image %d of %s is not a label below %d and %d pixels of a byte\n",
+                            first + count, loader->filename, ZI_CLASSES, ZI_PIXELS);
+                    failed = true;
+                    break;
+                }
+                count++;
+            }
+
+            if(failed || count == 0) break;
+
+            batch->count = count;
+            batch->first = first;
+            batch->pass = pass;
+            first += count;
+
+            pthread_mutex_lock(&loader->lock);
+            loader->produced++;
+            loader->stats.batches++;
+            pthread_cond_signal(&loader->filled);
+            pthread_mutex_unlock(&loader->lock);
+        }
+
+        if(fp != NULL) fclose(fp);
+
+        if(!failed && !stop && first < loader->number_of_images){
+            fprintf(stderr, "[ERROR]: The image file %s holds %d images, %d were asked\n", loader->filename, first, loader->number_of_images);
+            failed = true;
+        }
+    }
+
+    free(row);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->failed = failed;
+    loader->done = true;
+    pthread_cond_signal(&loader->filled);
+    pthread_mutex_unlock(&loader->lock);
+
+    return NULL;
+}
+
+static void zi_loader_release_buffers(ZI_Loader* loader){
+
+    for(int i = 0; i < loader->depth; i++){
+        MZ_free_matrix(&loader->batches[i].inputs);
+        free(loader->batches[i].labels);
+    }
+
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->filled);
+    pthread_cond_destroy(&loader->freed);
+
+    zi_idx_close(loader->idx_images);
+    zi_idx_close(loader->idx_labels);
+    free(loader->batches);
+    free(loader->filename);
+    free(loader);
+}
+
+static ZI_Loader* zi_loader_start(const char* filename, ZI_Idx* idx_images, ZI_Idx* idx_labels,
+                                  int number_of_images, int batch_size, int depth, int passes){
+
+    // The buffers are allocated here once, with a depth of 2 one is parsed while the other is trained
+    ZI_Loader* loader = (ZI_Loader*)malloc(sizeof(ZI_Loader));
+    MZ_assert(loader != NULL, MZ_ALLOC_ERROR);
+
+    *loader = (ZI_Loader){
+        .filename = (char*)malloc(strlen(filename) + 1),
+        .idx_images = idx_images,
+        .idx_labels = idx_labels,
+        .number_of_images = number_of_images,
+        .batch_size = MZ_MAX(batch_size, 1),
+        .depth = MZ_MAX(depth, 1),
+        .passes = MZ_MAX(passes, 1),
+    };
+    MZ_assert(loader->filename != NULL, MZ_ALLOC_ERROR);
+    strcpy(loader->filename, filename);
+
+    loader->batches = (ZI_Batch*)malloc(loader->depth * sizeof(ZI_Batch));
+    MZ_assert(loader->batches != NULL, MZ_ALLOC_ERROR);
+
+    for(int i = 0; i < loader->depth; i++){
+        loader->batches[i] = (ZI_Batch){
+            .inputs = MZ_alloc_matrix(ZI_PIXELS, loader->batch_size),
+            .labels = (unsigned int*)malloc(loader->batch_size * sizeof(unsigned int)),
+        };
+        MZ_assert(loader->batches[i].labels != NULL, MZ_ALLOC_ERROR);
+    }
+
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->filled, NULL);
+    pthread_cond_init(&loader->freed, NULL);
+
+    if(pthread_create(&loader->thread, NULL, zi_loader_main, loader) != 0){
+        fprintf(stderr, "[ERROR]: Failed to start the loader thread of %s\n", filename);
+        zi_loader_release_buffers(loader);
+        return NULL;
+    }
+
+    return loader;
+}
+
+ZI_Loader* zi_loader_new(const char* filename, int number_of_images, int batch_size, int depth, int passes){
+
+    FILE* fp = fopen(filename, "r");
+
+    if(fp == NULL){
+        fprintf(stderr, "[ERROR]: Failed to open image file %s\n", filename);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    return zi_loader_start(filename, NULL, NULL, number_of_images, batch_size, depth, passes);
+}
+
+ZI_Loader* zi_loader_new_idx(const char* images_filename, const char* labels_filename, int number_of_images, int batch_size, int depth, int passes){
+
+    // Only the headers are read here, whatever the size of the files
+    ZI_Idx* images;
+    ZI_Idx* labels;
+
+    if(!zi_idx_open_set(images_filename, labels_filename, number_of_images, &images, &labels)) return NULL;
+
+    return zi_loader_start(images_filename, images, labels, number_of_images, batch_size, depth, passes);
+}
+
+ZI_Batch* zi_loader_next(ZI_Loader* loader){
+
+    // Gives the oldest batch not released yet without releasing it, NULL once the passes are over or
+    // the loader failed
+    pthread_mutex_lock(&loader->lock);
+
+    if(loader->produced == loader->consumed && !loader->done){
+        double start = zi_seconds();
+        loader->stats.trainer_stalls++;
+        while(loader->produced == loader->consumed && !loader->done){
+            pthread_cond_wait(&loader->filled, &loader->lock);
+        }
+        loader->stats.trainer_wait += zi_seconds() - start;
+    }
+
+    ZI_Batch* batch = loader->produced > loader->consumed && !loader->failed ? &loader->batches[loader->consumed % loader->depth] : NULL;
+
+    pthread_mutex_unlock(&loader->lock);
+
+    return batch;
+}
+
+bool zi_loader_failed(ZI_Loader* loader){
+
+    pthread_mutex_lock(&loader->lock);
+    bool failed = loader->failed;
+    pthread_mutex_unlock(&loader->lock);
+
+    return failed;
+}
+
+void zi_loader_release(ZI_Loader* loader){
+
+    // the buffer of the batch given by zi_loader_next goes back to the loader
+    pthread_mutex_lock(&loader->lock);
+    loader->consumed++;
+    pthread_cond_signal(&loader->freed);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+ZI_Loader_Stats zi_loader_stats(ZI_Loader* loader){
+
+    pthread_mutex_lock(&loader->lock);
+    ZI_Loader_Stats stats = loader->stats;
+    pthread_mutex_unlock(&loader->lock);
+
+    return stats;
+}
+
+void zi_loader_free(ZI_Loader* loader){
+
+    pthread_mutex_lock(&loader->lock);
+    loader->stop = true;
+    pthread_cond_signal(&loader->freed);
+    pthread_mutex_unlock(&loader->lock);
+
+    pthread_join(loader->thread, NULL);
+
+    zi_loader_release_buffers(loader);
+}
+
 #endif // ZIMG_IMPLEMENTATION
\ No newline at end of file
@@ -41,6 +41,10 @@
 #define MZ_PROD_ERROR       "Matrix 1 columns not equal to Matrix 2 rows."
 #define MZ_DIRECTION_ERROR  "Invalid direction."
 #define MZ_SQUARE_ERROR     "Matrix is not square."
+#define MZ_BOUNDS_ERROR     "Index out of bounds."
+#define MZ_CONTIGUOUS_ERROR "Matrix is not contiguous."
+#define MZ_ALIAS_ERROR      "Destination overlaps an operand."
+#define MZ_DIVISION_ERROR   "Division by zero."
 #define MZ_NULL_VECTOR       "(null vector)"
 #define MZ_NULL_MATRIX       "(null matrix)"
 
@@ -158,8 +162,266 @@ bool MZ_is_in_array(unsigned int *arr, int n, float target);
 */
 #define MZ_SRAND() _MZ_SRAND((unsigned)time(NULL) )
 
+/*!
+    @brief Storage class of a variable that has one instance per thread.
+*/
+#if defined (_MSC_VER)
+#define MZ_THREAD_LOCAL __declspec(thread)
+#else
+#define MZ_THREAD_LOCAL _Thread_local
+#endif
+
 #endif // ZMATH_DEF
 
+#ifndef ZARENA_DEF
+#define ZARENA_DEF
+
+/*!
+    @brief A block of memory owned by an arena.
+    @param data The aligned memory of the block.
+    @param capacity The size in bytes of the block.
+    @param next The block allocated before this one.
+*/
+typedef struct MZ_Arena_Block{
+    unsigned char* data;
+    size_t capacity;
+    struct MZ_Arena_Block* next;
+}MZ_Arena_Block;
+
+/*!
+    @brief Bump allocator used for the temporaries of one step, everything is released at once by MZ_arena_reset.
+    @param blocks The list of blocks, the first one is the one being filled.
+    @param offset The bytes used in the first block.
+    @param used The bytes used in the whole arena.
+    @param peak The maximum of used since the arena was created.
+    @param prev The arena that was active before this one was pushed.
+*/
+typedef struct MZ_Arena{
+    MZ_Arena_Block* blocks;
+    size_t offset;
+    size_t used;
+    size_t peak;
+    struct MZ_Arena* prev;
+}MZ_Arena;
+
+/*!
+    @brief Create an arena with an initial block.
+    @param capacity The size in bytes of the initial block.
+    @return The new arena.
+*/
+MZ_Arena MZ_arena_new(size_t capacity);
+
+/*!
+    @brief Release every block of the arena.
+    @param arena The arena to free.
+*/
+void MZ_arena_free(MZ_Arena* arena);
+
+/*!
+    @brief Allocate an aligned chunk from the arena, a new block is chained if the current one is full.
+    @param arena The arena.
+    @param size The size in bytes of the chunk.
+    @return The chunk, valid until the next reset.
+*/
+void* MZ_arena_alloc(MZ_Arena* arena, size_t size);
+
+/*!
+    @brief Release every chunk of the arena. If it had to grow the blocks are merged into one big enough for the next step.
+    @param arena The arena to reset.
+*/
+void MZ_arena_reset(MZ_Arena* arena);
+
+/*!
+    @brief Route the matrix allocations of the calling thread to the arena until MZ_arena_pop.
+    @param arena The arena.
+*/
+void MZ_arena_push(MZ_Arena* arena);
+
+/*!
+    @brief Restore the allocator that was active before the last MZ_arena_push.
+*/
+void MZ_arena_pop(void);
+
+/*!
+    @brief Gives the arena the matrix allocations of the calling thread are routed to.
+    @return The active arena or NULL if matrices are allocated on the heap.
+*/
+MZ_Arena* MZ_arena_current(void);
+
+#endif // ZARENA_DEF
+
+#ifndef ZPOOL_DEF
+#define ZPOOL_DEF
+
+/*!
+    @brief Number of shapes each thread keeps freed matrices of.
+*/
+#define MZ_POOL_THREAD_SHAPES 16
+
+/*!
+    @brief Number of freed matrices of the same shape a thread keeps before handing them to the global list.
+*/
+#define MZ_POOL_THREAD_DEPTH 4
+
+/*!
+    @brief Number of shapes the global overflow list keeps freed matrices of.
+*/
+#define MZ_POOL_GLOBAL_SHAPES 64
+
+/*!
+    @brief Maximum bytes kept by the global overflow list, anything above is given back to the system.
+*/
+#define MZ_POOL_MAX_BYTES ((size_t)256 << 20)
+
+/*!
+    @brief The counters of the matrix pool.
+    @param hits The allocations served by a recycled buffer.
+    @param misses The allocations that had to ask the system.
+    @param buffers_cached The buffers currently kept by the pool.
+    @param bytes_cached The bytes currently kept by the pool.
+*/
+typedef struct MZ_Pool_Stats{
+    size_t hits;
+    size_t misses;
+    size_t buffers_cached;
+    size_t bytes_cached;
+}MZ_Pool_Stats;
+
+/*!
+    @brief Enable or disable the recycling of heap matrices by shape, it is enabled by default.
+    @param enabled Whether MZ_free_matrix keeps the buffers for the next MZ_alloc_matrix of the same shape.
+*/
+void MZ_pool_set_enabled(bool enabled);
+
+/*!
+    @brief Gives the counters of the matrix pool.
+    @return The counters summed over every thread.
+*/
+MZ_Pool_Stats MZ_pool_stats(void);
+
+/*!
+    @brief Prints the counters of the matrix pool and its hit rate.
+    @param fp The file to write the counters.
+*/
+void MZ_pool_print_stats(FILE* fp);
+
+/*!
+    @brief Give the cached buffers back to the system.
+    @param keep_bytes The bytes the global list may keep, the cache of the calling thread is always emptied.
+*/
+void MZ_pool_trim(size_t keep_bytes);
+
+#endif // ZPOOL_DEF
+
+#ifndef ZISA_DEF
+#define ZISA_DEF
+
+/*!
+    @brief Instruction sets the vector kernels are compiled for, from the narrowest to the widest.
+*/
+typedef enum MZ_Isa{
+    MZ_ISA_GENERIC = 0,
+    MZ_ISA_SSE42,
+    MZ_ISA_AVX2,
+    MZ_ISA_AVX512,
+    MZ_ISA_COUNT
+}MZ_Isa;
+
+/*!
+    @brief Environment variable read at the first kernel call to force an instruction set, e.g. ZMATH_ISA=avx2.
+*/
+#define MZ_ISA_ENV "ZMATH_ISA"
+
+/*!
+    @brief Checks if the kernels of an instruction set are compiled in and can run on this cpu.
+    @param isa The instruction set.
+    @return true if the kernels can be used.
+*/
+bool MZ_isa_supported(MZ_Isa isa);
+
+/*!
+    @brief Gives the widest instruction set supported by this cpu.
+    @return The instruction set picked when nothing is forced.
+*/
+MZ_Isa MZ_isa_best(void);
+
+/*!
+    @brief Gives the name of an instruction set.
+    @param isa The instruction set.
+    @return The name, the same accepted by MZ_isa_from_name.
+*/
+const char* MZ_isa_name(MZ_Isa isa);
+
+/*!
+    @brief Parses the name of an instruction set, "auto" stands for MZ_isa_best.
+    @param name The name.
+    @param isa Where to write the instruction set.
+    @return false if the name is unknown.
+*/
+bool MZ_isa_from_name(const char* name, MZ_Isa* isa);
+
+/*!
+    @brief Force the kernels of an instruction set for every thread.
+    @param isa The instruction set.
+    @return false if it is not supported, the kernels in use are left as they are.
+*/
+bool MZ_set_isa(MZ_Isa isa);
+
+/*!
+    @brief Gives the instruction set of the kernels in use.
+    @return The instruction set.
+*/
+MZ_Isa MZ_get_isa(void);
+
+/*!
+    @brief Prints the instruction set of the kernels in use and the ones supported by this cpu.
+    @param fp The file to write in.
+*/
+void MZ_print_isa(FILE* fp);
+
+#endif // ZISA_DEF
+
+#ifndef ZTHREADS_DEF
+#define ZTHREADS_DEF
+
+/*!
+    @brief Environment variable read at the first parallel call to set the number of threads, e.g. ZMATH_THREADS=8.
+*/
+#define MZ_THREADS_ENV "ZMATH_THREADS"
+
+/*!
+    @brief Multiply-adds a product needs before it is split among the threads, smaller ones stay on the calling thread.
+*/
+#define MZ_PARALLEL_MIN_WORK ((size_t)1 << 20)
+
+/*!
+    @brief Set the number of threads of the matrix products, the calling thread included. The workers are started at the next parallel product and kept alive.
+    @param threads The number of threads, 0 goes back to MZ_THREADS_ENV or the number of cores.
+*/
+void MZ_set_num_threads(unsigned int threads);
+
+/*!
+    @brief Gives the number of threads of the matrix products.
+    @return The number of threads, the calling thread included.
+*/
+unsigned int MZ_get_num_threads(void);
+
+/*!
+    @brief Set the size below which a product stays on the calling thread.
+    @param work The multiply-adds of the product, MZ_PARALLEL_MIN_WORK by default.
+*/
+void MZ_set_parallel_threshold(size_t work);
+
+/*!
+    @brief Run task(arg, 0) ... task(arg, tasks - 1) on the threads of the matrix products, the calling thread included. The tasks run in any order, each one on a single thread with its matrix products kept on that thread, so a task gives the same result wherever it runs.
+    @param tasks The number of tasks.
+    @param task The function run for each task, it gets arg and the index of the task.
+    @param arg The argument given to every task.
+*/
+void MZ_parallel_for(size_t tasks, void (*task)(void* arg, size_t task), void* arg);
+
+#endif // ZTHREADS_DEF
+
 #ifndef ZVEC_DEF
 #define ZVEC_DEF
 
@@ -450,17 +712,127 @@ typedef enum Direction{
     DIR_COUNT,
 }Direction;
 
+/*!
+    @brief Operation applied to an operand of MZ_gemm_into.
+    @param MZ_OP_N = 0, the operand as it is
+    @param MZ_OP_T = 1, the transpose of the operand
+*/
+typedef enum MZ_Op{
+    MZ_OP_N = 0,
+    MZ_OP_T,
+}MZ_Op;
+
+/*!
+    @brief Activation applied by the fused layer products.
+    @param MZ_ACT_IDENTITY = 0, x
+    @param MZ_ACT_SIGMOID = 1, 1 / (1 + e^-x)
+    @param MZ_ACT_RELU = 2, max(x, 0)
+    @param MZ_ACT_TANH = 3, tanh(x)
+    @param MZ_ACT_LEAKY_RELU = 4, x if x > 0, MZ_LEAKY_RELU_SLOPE * x otherwise
+    @param MZ_ACT_GELU = 5, x * sigmoid(1.5958 * (x + 0.044715 x^3)), the tanh approximation of x * P(X <= x)
+    @param MZ_ACT_SOFTPLUS = 6, ln(1 + e^x)
+*/
+typedef enum MZ_Activation{
+    MZ_ACT_IDENTITY = 0,
+    MZ_ACT_SIGMOID,
+    MZ_ACT_RELU,
+    MZ_ACT_TANH,
+    MZ_ACT_LEAKY_RELU,
+    MZ_ACT_GELU,
+    MZ_ACT_SOFTPLUS,
+    MZ_ACT_COUNT
+}MZ_Activation;
+
+/*!
+    @brief Slope of MZ_ACT_LEAKY_RELU for the negative inputs.
+*/
+#ifndef MZ_LEAKY_RELU_SLOPE
+#define MZ_LEAKY_RELU_SLOPE 0.01f
+#endif
+
+/*!
+    @brief Accuracy of the vector exp and of the activations computed from it.
+    @param MZ_ACCURACY_ACCURATE = 0, exp, sigmoid, tanh and softplus within 1 or 2 ulp of the exact result
+    @param MZ_ACCURACY_FAST = 1, relative error below 1e-4, cheaper polynomials
+*/
+typedef enum MZ_Accuracy{
+    MZ_ACCURACY_ACCURATE = 0,
+    MZ_ACCURACY_FAST,
+    MZ_ACCURACY_COUNT
+}MZ_Accuracy;
+
+/*!
+    @brief Update rule of MZ_optimizer_update, g is the gradient and lr the learning rate.
+    @param MZ_OPT_SGD = 0, w -= lr g
+    @param MZ_OPT_MOMENTUM = 1, m = mu m + g, w -= lr m
+    @param MZ_OPT_NESTEROV = 2, m = mu m + g, w -= lr (g + mu m)
+    @param MZ_OPT_ADAM = 3, m = b1 m + (1 - b1) g, v = b2 v + (1 - b2) g^2, w -= lr m' / (sqrt(v') + eps) with m' and v' the bias corrected moments
+    @param MZ_OPT_ADAMW = 4, adam with the weight decay applied to the weights instead of the gradient
+*/
+typedef enum MZ_Optimizer{
+    MZ_OPT_SGD = 0,
+    MZ_OPT_MOMENTUM,
+    MZ_OPT_NESTEROV,
+    MZ_OPT_ADAM,
+    MZ_OPT_ADAMW,
+    MZ_OPT_COUNT
+}MZ_Optimizer;
+
+/*!
+    @brief The hyperparameters of an optimizer, the learning rate is given to each update.
+    @param kind The update rule.
+    @param momentum mu of momentum and nesterov, b1 of adam.
+    @param beta2 b2 of adam.
+    @param epsilon eps of adam.
+    @param weight_decay The L2 penalty wd, wd w is added to the gradient, adamw takes lr wd w from the weights instead.
+*/
+typedef struct MZ_Optimizer_Config{
+    MZ_Optimizer kind;
+    float momentum;
+    float beta2;
+    float epsilon;
+    float weight_decay;
+}MZ_Optimizer_Config;
+
+
+/*!
+    @brief The alignment in bytes of the buffer of every allocated matrix.
+*/
+#define MZ_MATRIX_ALIGNMENT 64
+
+/*!
+    @brief The number of floats that fit in MZ_MATRIX_ALIGNMENT bytes, rows are padded to a multiple of it.
+*/
+#define MZ_MATRIX_ALIGN_FLOATS (MZ_MATRIX_ALIGNMENT / sizeof(float))
+
+/*!
+    @brief Who owns the buffer of a matrix.
+    @param MZ_STORAGE_HEAP = 0, The matrix owns its buffer and MZ_free_matrix releases it to the pool.
+    @param MZ_STORAGE_VIEW, The matrix points inside a buffer owned by someone else.
+    @param MZ_STORAGE_ARENA, The matrix lives in an arena and is released by MZ_arena_reset.
+*/
+typedef enum MZ_Storage{
+    MZ_STORAGE_HEAP = 0,
+    MZ_STORAGE_VIEW,
+    MZ_STORAGE_ARENA,
+}MZ_Storage;
 
 /*!
     @brief The struct that holds the information about a matrix.
     @param rows The number of rows.
     @param cols The number of columns.
-    @param elements The elements of the matrix.
+    @param stride The distance in floats between the start of two consecutive rows.
+    @param col_stride The distance in floats between two consecutive elements of a row.
+    @param storage Whether the matrix owns its buffer or is a view on another one.
+    @param elements The buffer holding the elements of the matrix.
 */
 typedef struct MZ_Matrix{
     unsigned int rows;
     unsigned int cols;
-    float** elements;
+    unsigned int stride;
+    unsigned int col_stride;
+    MZ_Storage storage;
+    float* elements;
 }MZ_Matrix;
 
 extern MZ_Matrix NULL_MATRIX;
@@ -489,7 +861,7 @@ void MZ_print_matrix_by_label(FILE *fp, const char* label, MZ_Matrix mat);
 void MZ_print_matrix_by_index(FILE *fp, unsigned int index, MZ_Matrix mat);
 
 /*!
-    @brief Frees the matrix and set the rows and cols to 0.
+    @brief Frees the matrix and set the rows and cols to 0, views and arena matrices are only detached from their buffer.
     @param mat The matrix to free.
 */
 void MZ_free_matrix(MZ_Matrix* mat);
@@ -501,6 +873,33 @@ void MZ_free_matrix(MZ_Matrix* mat);
 */
 void MZ_copy_matrix_pointer(MZ_Matrix *source, MZ_Matrix *dest);
 
+/*!
+    @brief Allocate a memory chunk aligned to MZ_MATRIX_ALIGNMENT bytes.
+    @param size The size in bytes of the chunk.
+    @return The allocated memory chunk or NULL on failure.
+*/
+void* MZ_aligned_alloc(size_t size);
+
+/*!
+    @brief Free a memory chunk allocated with MZ_aligned_alloc.
+    @param ptr The memory chunk to free.
+*/
+void MZ_aligned_free(void* ptr);
+
+/*!
+    @brief Gives the number of chunks MZ_aligned_alloc asked the system for, matrices, arena blocks and GEMM buffers included.
+    @attention Buffers recycled by the pool or taken from an arena are not counted, so the count stays flat in a loop that allocates nothing new.
+    @return The number of allocations since the start of the program.
+*/
+size_t MZ_alloc_count(void);
+
+/*!
+    @brief Gives the row stride used by MZ_alloc_matrix for a certain number of cols.
+    @param cols The cols of the matrix.
+    @return The cols rounded up to a multiple of MZ_MATRIX_ALIGN_FLOATS, column vectors are left unpadded.
+*/
+unsigned int MZ_padded_stride(unsigned int cols);
+
 /*!
     @brief Allocate memory chunk to the matrix through its rows and cols.
     @param rows The rows of the matrix.
@@ -509,6 +908,16 @@ void MZ_copy_matrix_pointer(MZ_Matrix *source, MZ_Matrix *dest);
 */
 MZ_Matrix MZ_alloc_matrix(unsigned int rows, unsigned int cols);
 
+/*!
+    @brief Allocate memory chunk to the matrix through its rows, cols and an explicit row stride.
+    @attention If an arena is pushed on the calling thread the chunk is taken from it.
+    @param rows The rows of the matrix.
+    @param cols The cols of the matrix.
+    @param stride The distance in floats between two rows, must be at least cols.
+    @return The allocated memory chunk, zero filled.
+*/
+MZ_Matrix MZ_alloc_matrix_with_stride(unsigned int rows, unsigned int cols, unsigned int stride);
+
 /*!
     @brief Create a matrix of rows * cols dimensions all set to 0.
     @param rows The rows of the matrix.
@@ -601,6 +1010,75 @@ MZ_Vec MZ_get_vector_from_matrix_col(MZ_Matrix source, unsigned int col);
 */
 MZ_Matrix MZ_flatten_matrix(MZ_Matrix matrix, Direction dir);
 
+/*!
+    @brief Create a view on an existing buffer without copying it.
+    @param elements The buffer, it must outlive the view.
+    @param rows The rows of the view.
+    @param cols The cols of the view.
+    @param stride The distance in floats between two rows.
+    @param col_stride The distance in floats between two elements of a row.
+    @return The view, freeing it never releases the buffer.
+*/
+MZ_Matrix MZ_view_from_buffer(float* elements, unsigned int rows, unsigned int cols, unsigned int stride, unsigned int col_stride);
+
+/*!
+    @brief Checks if the elements of the matrix are laid out row by row without gaps.
+    @param matrix The matrix to check.
+    @return true if the element (i, j) is at elements[i * cols + j].
+*/
+bool MZ_is_matrix_contiguous(MZ_Matrix matrix);
+
+/*!
+    @brief Reinterpret a contiguous matrix with other dimensions without copying it.
+    @param matrix The source matrix, it must be contiguous.
+    @param rows The new rows.
+    @param cols The new cols.
+    @return The reshaped view.
+*/
+MZ_Matrix MZ_view_reshape(MZ_Matrix matrix, unsigned int rows, unsigned int cols);
+
+/*!
+    @brief Flattens the given contiguous matrix in a vertical or horizontal direction without copying it.
+    @param matrix The matrix to flatten.
+    @param dir The direction in which the matrix will be flattened.
+    @return The flatten view.
+*/
+MZ_Matrix MZ_view_flatten(MZ_Matrix matrix, Direction dir);
+
+/*!
+    @brief Take a rectangular block of a matrix without copying it.
+    @param matrix The source matrix.
+    @param row The first row of the block, starting from 0.
+    @param col The first col of the block, starting from 0.
+    @param rows The rows of the block.
+    @param cols The cols of the block.
+    @return The view on the block.
+*/
+MZ_Matrix MZ_view_block(MZ_Matrix matrix, unsigned int row, unsigned int col, unsigned int rows, unsigned int cols);
+
+/*!
+    @brief Take a row of a matrix as a 1 x cols view.
+    @param matrix The source matrix.
+    @param row The row, starting from 0.
+    @return The view on the row.
+*/
+MZ_Matrix MZ_view_row(MZ_Matrix matrix, unsigned int row);
+
+/*!
+    @brief Take a col of a matrix as a rows x 1 view.
+    @param matrix The source matrix.
+    @param col The col, starting from 0.
+    @return The view on the col.
+*/
+MZ_Matrix MZ_view_col(MZ_Matrix matrix, unsigned int col);
+
+/*!
+    @brief Transpose a matrix by swapping its strides, without copying it.
+    @param matrix The source matrix.
+    @return The transposed view.
+*/
+MZ_Matrix MZ_view_transpose(MZ_Matrix matrix);
+
 /*!
     @brief Add two matrices together.
     @param matrix1.
@@ -682,97 +1160,394 @@ MZ_Matrix MZ_hadamard_multiply_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2
 MZ_Matrix MZ_transposed_matrix(MZ_Matrix source);
 
 /*!
-    @brief Swap two rows in a matrix.
-    @param source The original matrix.
-    @param row1.
-    @param row2.
-    @return The matrix in which row1 and row2 have been swapped.
+    @brief Sum every element of a matrix.
+    @param matrix The matrix.
+    @return The sum of the elements.
 */
-bool MZ_swap_two_matrix_rows(MZ_Matrix *source, unsigned int row1, unsigned int row2);
+float MZ_sum_of_matrix(MZ_Matrix matrix);
 
 /*!
-    @brief Add two rows in a matrix.
-    @param source The original matrix.
-    @param row1.
-    @param row2.
-    @return The matrix in which row1 and row2 have been added.
+    @brief Finds the largest element of a matrix.
+    @param matrix The matrix, it must not be empty.
+    @return The largest element.
 */
-bool MZ_add_two_matrix_rows(MZ_Matrix *source, unsigned int row1, unsigned int row2);
+float MZ_max_of_matrix(MZ_Matrix matrix);
 
 /*!
-    @brief Multiply two rows in a matrix.
-    @param source The original matrix.
-    @param row1.
-    @param row2.
-    @return The matrix in which row1 and row2 have been multiplied.
+    @brief Checks if the buffers of two matrices share at least one element.
+    @param matrix1.
+    @param matrix2.
+    @return true if writing to one of them could change the other.
 */
-bool MZ_multiply_two_matrix_rows(MZ_Matrix *source, unsigned int row, int scalar);
+bool MZ_do_matrices_overlap(MZ_Matrix matrix1, MZ_Matrix matrix2);
 
 /*!
-    @brief Multiply one row to a scalar and then add it to the other row.
-    @param source The original matrix.
-    @param row1.
-    @param row2.
-    @return The matrix in which row2 have been multiplied to a scalar and then add it to the row1.
+    @brief Copy the elements of a matrix into another one of the same size.
+    @param dest The destination matrix.
+    @param source The source matrix.
 */
-bool MZ_multiply_add_two_matrix_rows(MZ_Matrix *source, unsigned int row1, unsigned int row2, int scalar);
+void MZ_copy_matrix_into(MZ_Matrix* dest, MZ_Matrix source);
 
 /*!
-    @brief Convert a matrix to its Row Echelon Form.
-    @param source The source matrix.
-    @return The Row Echelon Form of the Matrix.
+    @brief Set every element of the matrix to a certain value.
+    @param dest The destination matrix.
+    @param value The value used to fill the matrix.
 */
-void MZ_to_echelon_form(MZ_Matrix *source);
+void MZ_fill_matrix(MZ_Matrix* dest, float value);
 
 /*!
-    @brief Convert a matrix to its Reduced Row Echelon Form.
-    @param source The source matrix.
-    @return The Reduced Row Echelon Form of the Matrix.
+    @brief Flattens the given matrix in a vertical or horizontal direction into a preallocated matrix.
+    @param dest The destination matrix of size (rows * cols) x 1 or 1 x (rows * cols).
+    @param matrix The matrix to flatten.
+    @param dir The direction in which the matrix will be flattened.
 */
-void MZ_to_reduced_echelon_form(MZ_Matrix *source);
+void MZ_flatten_matrix_into(MZ_Matrix* dest, MZ_Matrix matrix, Direction dir);
 
 /*!
-    @brief Append a vector to a matrix.
-    @param source The source matrix.
-    @param vector The vector to append.
-    @return The matrix with the added vector.
+    @brief Add two matrices together into dest, that can be one of the operands.
+    @param dest The destination matrix.
+    @param matrix1.
+    @param matrix2.
 */
-MZ_Matrix MZ_append_vector_to_matrix(MZ_Matrix source, MZ_Vec vector);
+void MZ_add_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2);
 
 /*!
-    @brief Append a matrix to a matrix.
-    @param source The source matrix.
-    @param matrix The matrix to append.
-    @return The matrix with the added matrix.
+    @brief Add a scalar to every single element of the matrix into dest, that can be the operand.
+    @param dest The destination matrix.
+    @param matrix1.
+    @param scalar.
 */
-MZ_Matrix MZ_append_matrix_to_matrix(MZ_Matrix source, MZ_Matrix matrix);
+void MZ_add_matrix_with_scalar_into(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar);
 
 /*!
-    @brief Remove a row and a col from a matrix.
-    @param source The source matrix.
-    @param remRow The row to remove.
-    @param remCol The col to remove.
-    @return The sub Matrix with the row and col removed.
+    @brief Subtract two matrices together into dest, that can be one of the operands.
+    @param dest The destination matrix.
+    @param matrix1.
+    @param matrix2.
 */
-MZ_Matrix MZ_get_sub_matrix(MZ_Matrix source, unsigned int remRow, unsigned int remCol);
+void MZ_subtract_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2);
 
 /*!
-    @brief Find the determinant of a matrix.
-    @param source The source Matrix.
-    @return The determinant of the matrix.
+    @brief Subtract a scalar to every single element of the matrix into dest, that can be the operand.
+    @param dest The destination matrix.
+    @param matrix1.
+    @param scalar.
 */
-float MZ_determinant_of_matrix_old(MZ_Matrix source);
+void MZ_subtract_matrix_with_scalar_into(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar);
 
 /*!
-    @brief Find the determinant of a matrix through cofactor expansion with an exclusion list.
-    @param source The source Matrix.
-    @return The determinant of the matrix.
+    @brief Multiply two matrices together by the rows per cols product into dest.
+    @param dest The destination matrix, it must not overlap the operands.
+    @param matrix1.
+    @param matrix2.
 */
-float MZ_determinant_of_matrix(MZ_Matrix source);
+void MZ_multiply_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2);
 
 /*!
-    @brief Calculate the determinant of a matrix through cofactor expansion using an exclusion list.
-    @param source The source matrix.
+    @brief General matrix product into dest: dest = alpha * op1(matrix1) * op2(matrix2) + beta * dest.
+    @param dest The destination matrix, it must not overlap the operands.
+    @param alpha The scale of the product.
+    @param matrix1 The first operand.
+    @param op1 MZ_OP_T to use the transpose of matrix1, it is never copied.
+    @param matrix2 The second operand.
+    @param op2 MZ_OP_T to use the transpose of matrix2, it is never copied.
+    @param beta The scale of the old dest, if it is 0 dest is not read.
+*/
+void MZ_gemm_into(MZ_Matrix* dest, float alpha, MZ_Matrix matrix1, MZ_Op op1, MZ_Matrix matrix2, MZ_Op op2, float beta);
+
+/*!
+    @brief Multiply a matrix by a vector into y: y = alpha * matrix * x + beta * y.
+    @param y The destination vector of matrix.rows elements, as a row or a col. It must not overlap the operands.
+    @param alpha The scale of the product.
+    @param matrix The matrix, it can be a transposed view.
+    @param x The vector of matrix.cols elements, as a row or a col.
+    @param beta The scale of the old y, if it is 0 y is not read.
+*/
+void MZ_gemv_into(MZ_Matrix* y, float alpha, MZ_Matrix matrix, MZ_Matrix x, float beta);
+
+/*!
+    @brief Rank one update of a matrix in place: matrix += alpha * x * y^T, done in a single pass over the matrix.
+    @param matrix The matrix to update, it must not overlap the vectors.
+    @param alpha The scale of the update.
+    @param x The vector of matrix.rows elements, as a row or a col.
+    @param y The vector of matrix.cols elements, as a row or a col.
+*/
+void MZ_rank1_update(MZ_Matrix* matrix, float alpha, MZ_Matrix x, MZ_Matrix y);
+
+/*!
+    @brief Forward pass of a dense layer: dest = act(weights * input + bias). The bias and the activation are applied to each block of dest as the product produces it.
+    @param dest The outputs of the layer, weights.rows x input.cols. It must not overlap the operands.
+    @param weights The weights of the layer.
+    @param input The inputs of the layer, one sample per col.
+    @param bias The bias of the layer as a row or a col of weights.rows elements added to every sample, NULL for none.
+    @param act The activation of the layer.
+    @param accuracy The accuracy of the activation.
+*/
+void MZ_dense_forward_into(MZ_Matrix* dest, MZ_Matrix weights, MZ_Matrix input, const MZ_Matrix* bias, MZ_Activation act, MZ_Accuracy accuracy);
+
+/*!
+    @brief Backward pass of a dense layer: delta = (op(weights) * errors) x act'(outputs), the derivative is applied as the product produces each block of delta.
+    @param delta The destination, it must not overlap the operands nor the outputs.
+    @param weights The weights that propagate the errors.
+    @param op The operation applied to the weights, MZ_OP_T to go back through the layer after them.
+    @param errors The errors, one sample per col.
+    @param outputs The outputs of the activation the derivative is taken from, same size as delta. The inputs of the activation when MZ_activation_needs_inputs(act).
+    @param act The activation of the layer.
+*/
+void MZ_dense_backward_into(MZ_Matrix* delta, MZ_Matrix weights, MZ_Op op, MZ_Matrix errors, MZ_Matrix outputs, MZ_Activation act);
+
+/*!
+    @brief Multiply every element by the derivative of the activation into dest, that can be the operand: dest = matrix x act'(outputs).
+    @param dest The destination matrix.
+    @param matrix The matrix to multiply.
+    @param outputs The outputs of the activation the derivative is taken from. The inputs of the activation when MZ_activation_needs_inputs(act).
+    @param act The activation.
+*/
+void MZ_activation_derivative_into(MZ_Matrix* dest, MZ_Matrix matrix, MZ_Matrix outputs, MZ_Activation act);
+
+/*!
+    @brief Apply e^x to every element into dest, that can be the operand.
+    @param dest The destination matrix.
+    @param matrix The exponents.
+    @param accuracy The accuracy of the result.
+*/
+void MZ_exp_into(MZ_Matrix* dest, MZ_Matrix matrix, MZ_Accuracy accuracy);
+
+/*!
+    @brief Apply an activation to every element into dest, that can be the operand.
+    @param dest The destination matrix.
+    @param matrix The matrix to activate.
+    @param act The activation.
+    @param accuracy The accuracy of the activation.
+*/
+void MZ_activate_into(MZ_Matrix* dest, MZ_Matrix matrix, MZ_Activation act, MZ_Accuracy accuracy);
+
+/*!
+    @brief Gives the name of an activation.
+    @param act The activation.
+    @return The name, the same accepted by MZ_activation_from_name.
+*/
+const char* MZ_activation_name(MZ_Activation act);
+
+/*!
+    @brief Parses the name of an activation: identity, sigmoid, relu, tanh, leaky_relu, gelu or softplus.
+    @param name The name.
+    @param act Where to write the activation.
+    @return false if the name is unknown.
+*/
+bool MZ_activation_from_name(const char* name, MZ_Activation* act);
+
+/*!
+    @brief Checks if the derivative of an activation must be taken from its inputs. The others take it from their outputs, so a layer keeps only those.
+    @param act The activation.
+    @return true for MZ_ACT_GELU, its derivative can not be written in terms of its output.
+*/
+bool MZ_activation_needs_inputs(MZ_Activation act);
+
+/*!
+    @brief Softmax of every col into dest, that can be the operand. The max of the col is subtracted before the exp so no col overflows.
+    @param dest The destination matrix.
+    @param matrix The scores, one sample per col.
+*/
+void MZ_softmax_cols_into(MZ_Matrix* dest, MZ_Matrix matrix);
+
+/*!
+    @brief Softmax cross-entropy of every col against an integer label fused with its gradient: dest = softmax(logits) - onehot(labels), the one-hot matrix is never built.
+    @param dest The gradient of the loss with respect to the logits, it can be the logits.
+    @param logits The scores, one sample per col.
+    @param labels The row of the right class of every col, logits.cols of them.
+    @return The sum over the cols of -ln(softmax(logits)[label]).
+*/
+float MZ_softmax_cross_entropy_cols_into(MZ_Matrix* dest, MZ_Matrix logits, const unsigned int* labels);
+
+/*!
+    @brief Finds the row of the largest element of every col, the first one on ties.
+    @param matrix The scores, one sample per col.
+    @param indices Where to write the matrix.cols rows found.
+*/
+void MZ_argmax_cols(MZ_Matrix matrix, unsigned int* indices);
+
+/*!
+    @brief Finds the rows of the k largest elements of every col, from the largest.
+    @param matrix The scores, one sample per col.
+    @param k The rows to find for each col, at most matrix.rows.
+    @param indices Where to write the k rows of every col, the ones of col j start at indices[j * k].
+*/
+void MZ_topk_cols(MZ_Matrix matrix, unsigned int k, unsigned int* indices);
+
+/*!
+    @brief Gives the usual hyperparameters of an optimizer: momentum 0.9, beta2 0.999, epsilon 1e-8, weight decay 0.01 for adamw and 0 for the others.
+    @param kind The update rule.
+    @return The hyperparameters.
+*/
+MZ_Optimizer_Config MZ_optimizer_default_config(MZ_Optimizer kind);
+
+/*!
+    @brief Gives the number of moments an optimizer keeps for each weight matrix.
+    @param kind The update rule.
+    @return 0 for sgd, 1 for momentum and nesterov, 2 for adam and adamw.
+*/
+unsigned int MZ_optimizer_moments(MZ_Optimizer kind);
+
+/*!
+    @brief Gives the name of an optimizer.
+    @param kind The update rule.
+    @return The name, the same accepted by MZ_optimizer_from_name.
+*/
+const char* MZ_optimizer_name(MZ_Optimizer kind);
+
+/*!
+    @brief Parses the name of an optimizer: sgd, momentum, nesterov, adam or adamw.
+    @param name The name.
+    @param kind Where to write the optimizer.
+    @return false if the name is unknown.
+*/
+bool MZ_optimizer_from_name(const char* name, MZ_Optimizer* kind);
+
+/*!
+    @brief One step of an optimizer on a weight matrix. The gradient is read, the moments and the weights are updated in a single pass over the elements.
+    @param weights The weights to update.
+    @param gradient The gradient of the loss with respect to the weights, same size.
+    @param moment1 The first moment, same size and zero before the first step. Unused by sgd, it can be NULL.
+    @param moment2 The second moment, same size and zero before the first step. Only used by adam and adamw, it can be NULL for the others.
+    @param config The hyperparameters.
+    @param learning_rate The learning rate of this step.
+    @param step The number of the step from 1, adam corrects the bias of its moments with it.
+*/
+void MZ_optimizer_update(MZ_Matrix* weights, MZ_Matrix gradient, MZ_Matrix* moment1, MZ_Matrix* moment2,
+                         const MZ_Optimizer_Config* config, float learning_rate, unsigned long step);
+
+/*!
+    @brief Multiply a scalar to every single element of the matrix into dest, that can be the operand.
+    @param dest The destination matrix.
+    @param matrix1.
+    @param scalar.
+*/
+void MZ_multiply_matrix_by_scalar_into(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar);
+
+/*!
+    @brief Divide two matrices together into dest, that can be one of the operands.
+    @param dest The destination matrix.
+    @param matrix1.
+    @param matrix2.
+*/
+void MZ_divide_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2);
+
+/*!
+    @brief Divide a scalar to every single element of the matrix into dest, that can be the operand.
+    @param dest The destination matrix.
+    @param matrix1.
+    @param scalar The divisor, it must not be 0.
+*/
+void MZ_divide_matrix_by_scalar_into(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar);
+
+/*!
+    @brief Multiply two matrices together element by element into dest, that can be one of the operands.
+    @param dest The destination matrix.
+    @param matrix1.
+    @param matrix2.
+*/
+void MZ_hadamard_multiply_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2);
+
+/*!
+    @brief Transpose a matrix into dest.
+    @param dest The destination matrix, it must not overlap the source.
+    @param source The matrix to transpose.
+*/
+void MZ_transposed_matrix_into(MZ_Matrix* dest, MZ_Matrix source);
+
+/*!
+    @brief Swap two rows in a matrix.
+    @param source The original matrix.
+    @param row1.
+    @param row2.
+    @return The matrix in which row1 and row2 have been swapped.
+*/
+bool MZ_swap_two_matrix_rows(MZ_Matrix *source, unsigned int row1, unsigned int row2);
+
+/*!
+    @brief Add two rows in a matrix.
+    @param source The original matrix.
+    @param row1.
+    @param row2.
+    @return The matrix in which row1 and row2 have been added.
+*/
+bool MZ_add_two_matrix_rows(MZ_Matrix *source, unsigned int row1, unsigned int row2);
+
+/*!
+    @brief Multiply two rows in a matrix.
+    @param source The original matrix.
+    @param row1.
+    @param row2.
+    @return The matrix in which row1 and row2 have been multiplied.
+*/
+bool MZ_multiply_two_matrix_rows(MZ_Matrix *source, unsigned int row, int scalar);
+
+/*!
+    @brief Multiply one row to a scalar and then add it to the other row.
+    @param source The original matrix.
+    @param row1.
+    @param row2.
+    @return The matrix in which row2 have been multiplied to a scalar and then add it to the row1.
+*/
+bool MZ_multiply_add_two_matrix_rows(MZ_Matrix *source, unsigned int row1, unsigned int row2, int scalar);
+
+/*!
+    @brief Convert a matrix to its Row Echelon Form.
+    @param source The source matrix.
+    @return The Row Echelon Form of the Matrix.
+*/
+void MZ_to_echelon_form(MZ_Matrix *source);
+
+/*!
+    @brief Convert a matrix to its Reduced Row Echelon Form.
+    @param source The source matrix.
+    @return The Reduced Row Echelon Form of the Matrix.
+*/
+void MZ_to_reduced_echelon_form(MZ_Matrix *source);
+
+/*!
+    @brief Append a vector to a matrix.
+    @param source The source matrix.
+    @param vector The vector to append.
+    @return The matrix with the added vector.
+*/
+MZ_Matrix MZ_append_vector_to_matrix(MZ_Matrix source, MZ_Vec vector);
+
+/*!
+    @brief Append a matrix to a matrix.
+    @param source The source matrix.
+    @param matrix The matrix to append.
+    @return The matrix with the added matrix.
+*/
+MZ_Matrix MZ_append_matrix_to_matrix(MZ_Matrix source, MZ_Matrix matrix);
+
+/*!
+    @brief Remove a row and a col from a matrix.
+    @param source The source matrix.
+    @param remRow The row to remove.
+    @param remCol The col to remove.
+    @return The sub Matrix with the row and col removed.
+*/
+MZ_Matrix MZ_get_sub_matrix(MZ_Matrix source, unsigned int remRow, unsigned int remCol);
+
+/*!
+    @brief Find the determinant of a matrix.
+    @param source The source Matrix.
+    @return The determinant of the matrix.
+*/
+float MZ_determinant_of_matrix_old(MZ_Matrix source);
+
+/*!
+    @brief Find the determinant of a matrix through cofactor expansion with an exclusion list.
+    @param source The source Matrix.
+    @return The determinant of the matrix.
+*/
+float MZ_determinant_of_matrix(MZ_Matrix source);
+
+/*!
+    @brief Calculate the determinant of a matrix through cofactor expansion using an exclusion list.
+    @param source The source matrix.
     @param row The row to expand on.
     @param col The new column to exclude.
     @param skipCols The existing list of columns to exclude.
@@ -848,7 +1623,7 @@ MZ_Matrix MZ_inverse_of_matrix_by_rref(MZ_Matrix source);
     @param y The y coordinate
     @return The value of the element at the specified coordinates in the matrix
 */
-#define MZ_VALUE_OF_MAT_AT(matrix, x, y) (matrix.elements[x][y])
+#define MZ_VALUE_OF_MAT_AT(matrix, x, y) ((matrix).elements[(size_t)(x) * (matrix).stride + (size_t)(y) * (matrix).col_stride])
 
 /*!
     @param matrix The source matrix
@@ -856,7 +1631,14 @@ MZ_Matrix MZ_inverse_of_matrix_by_rref(MZ_Matrix source);
     @param y The y coordinate
     @return the value of the element at the specified coordinates in the matrix pointer
 */
-#define MZ_VALUE_OF_MAT_POINTER_AT(matrix, x, y) (matrix->elements[x][y])
+#define MZ_VALUE_OF_MAT_POINTER_AT(matrix, x, y) ((matrix)->elements[(size_t)(x) * (matrix)->stride + (size_t)(y) * (matrix)->col_stride])
+
+/*!
+    @param matrix The source matrix
+    @param x The row index
+    @return The pointer to the first element of the row
+*/
+#define MZ_ROW_OF_MAT(matrix, x) ((matrix).elements + (size_t)(x) * (matrix).stride)
 
 /*!
     @brief Create a matrix of rows * cols dimensions.
@@ -867,6 +1649,21 @@ MZ_Matrix MZ_inverse_of_matrix_by_rref(MZ_Matrix source);
 */
 #define MZ_new_matrix(rows, cols, ...)  _MZ_new_matrix(rows, cols, rows*cols, __VA_ARGS__)
 
+/*!
+    @brief Rows of A packed at once, the packed block stays in L2. It is a multiple of the rows of the micro-kernel of every instruction set.
+*/
+#define MZ_GEMM_MC 72
+
+/*!
+    @brief Depth of the packed panels of A and B, a sliver of B stays in L1.
+*/
+#define MZ_GEMM_KC 256
+
+/*!
+    @brief Cols of B packed at once, the packed panel stays in L3.
+*/
+#define MZ_GEMM_NC 1024
+
 #endif // ZMATRIX_DEF
 
 #ifdef ZMATH_IMPLEMENTATION
@@ -878,10 +1675,15 @@ MZ_Matrix MZ_inverse_of_matrix_by_rref(MZ_Matrix source);
 #include <stdbool.h>
 #include <time.h>
 
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
 #include <unistd.h>
 #elif _WIN32
 #include <process.h>
+#include <malloc.h>
 #endif 
 
 #if VISUALIZE_RATIONAL
@@ -889,6 +1691,32 @@ MZ_Matrix MZ_inverse_of_matrix_by_rref(MZ_Matrix source);
 #include "zstring.h"
 #endif
 
+/*
+    The names of the values of an enum, for the _name and _from_name functions of the options.
+    A value out of the table is "unknown", a name out of it is printed with the known ones.
+*/
+static const char* _MZ_name_of(const char* const names[], int count, int value){
+    return value >= 0 && value < count ? names[value] : "unknown";
+}
+
+/*
+*/
+static bool _MZ_value_of(const char* const names[], int count, const char* kind, const char* name, int* value){
+
+    for(int i = 0; i < count; i++){
+        if(strcmp(name, names[i]) == 0){
+            *value = i;
+            return true;
+        }
+    }
+
+    fprintf(stderr, "[ERROR]: Unknown %s '%s', expected one of:", kind, name);
+    for(int i = 0; i < count; i++) fprintf(stderr, " %s", names[i]);
+    fprintf(stderr, "\n");
+
+    return false;
+}
+
 /*
 */
 void _MZ_assert(bool condition, const char* message, const char* filepath, size_t line){
@@ -953,7 +1781,7 @@ bool MZ_is_in_array(unsigned int *arr, int n, float target){
 
 void _MZ_SRAND(unsigned int _Seed){
     #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
-        srand((_Seed * getpid()); 
+        srand(_Seed * getpid()); 
     #elif _WIN32
         srand(_Seed * _getpid()); 
     #endif   
@@ -1394,7 +2222,7 @@ float MZ_magnitude_of_vector(MZ_Vec vector){
 
 }
 
-MZ_Matrix NULL_MATRIX = {0, 0, NULL};
+MZ_Matrix NULL_MATRIX = {0, 0, 0, 0, MZ_STORAGE_HEAP, NULL};
 
 /*
 */
@@ -1639,73 +2467,543 @@ void MZ_print_matrix_by_index(FILE *fp, unsigned int index, MZ_Matrix mat){
 	
 }
 
+static size_t _MZ_alloc_count = 0;
+
 /*
 */
-void MZ_free_matrix(MZ_Matrix* mat){
-    MZ_assert(mat->elements != NULL, "Matrix must not be NULL.");
+void* MZ_aligned_alloc(size_t size){
 
-    for(unsigned int i = 0; i < mat->rows; i++){
-        free(mat->elements[i]);
-    }
+    // round up so that the whole chunk is made of full cache lines
+    size = (size + MZ_MATRIX_ALIGNMENT - 1) / MZ_MATRIX_ALIGNMENT * MZ_MATRIX_ALIGNMENT;
+    if(size == 0) size = MZ_MATRIX_ALIGNMENT;
 
-    free(mat->elements);
-    mat->elements = NULL;
-    mat->rows = 0;
-    mat->cols = 0;
+    __atomic_fetch_add(&_MZ_alloc_count, 1, __ATOMIC_RELAXED);
+
+    #if defined (_WIN32)
+        return _aligned_malloc(size, MZ_MATRIX_ALIGNMENT);
+    #else
+        void* ptr = NULL;
+        if(posix_memalign(&ptr, MZ_MATRIX_ALIGNMENT, size) != 0) return NULL;
+        return ptr;
+    #endif
 }
 
 /*
 */
-void MZ_copy_matrix_pointer(MZ_Matrix *source, MZ_Matrix *dest){
-
-    if(dest->elements == NULL){ 
-        *dest= MZ_alloc_matrix(source->rows, source->cols); 
-    }
-
-    dest->rows = source->rows;
-    dest->cols = source->cols;
-    dest->elements = source->elements;
+void MZ_aligned_free(void* ptr){
+    #if defined (_WIN32)
+        _aligned_free(ptr);
+    #else
+        free(ptr);
+    #endif
+}
 
+/*
+*/
+size_t MZ_alloc_count(void){
+    return __atomic_load_n(&_MZ_alloc_count, __ATOMIC_RELAXED);
 }
 
+static MZ_THREAD_LOCAL MZ_Arena* _MZ_current_arena = NULL;
+
 /*
 */
-MZ_Matrix MZ_alloc_matrix(unsigned int rows, unsigned int cols){
+static MZ_Arena_Block* _MZ_arena_new_block(size_t capacity, MZ_Arena_Block* next){
 
-    MZ_Matrix result;
-    result.rows = rows;
-    result.cols = cols;
+    MZ_Arena_Block* block = (MZ_Arena_Block*)malloc(sizeof(MZ_Arena_Block));
+    MZ_assert(block != NULL, MZ_ALLOC_ERROR);
 
-    result.elements = MZ_ALLOC(rows, float*);
-    for(unsigned int i=0; i<rows; i++){
-        result.elements[i] = MZ_ALLOC(cols, float);
-    }
+    block->data = (unsigned char*)MZ_aligned_alloc(capacity);
+    MZ_assert(block->data != NULL, MZ_ALLOC_ERROR);
 
-    MZ_assert(result.elements != NULL, MZ_ALLOC_ERROR);
+    block->capacity = capacity;
+    block->next = next;
 
-    return result;
+    return block;
+}
+
+/*
+*/
+MZ_Arena MZ_arena_new(size_t capacity){
 
+    MZ_Arena arena;
+    arena.blocks = _MZ_arena_new_block(capacity, NULL);
+    arena.offset = 0;
+    arena.used = 0;
+    arena.peak = 0;
+    arena.prev = NULL;
+
+    return arena;
 }
 
 /*
 */
-MZ_Matrix MZ_new_zero_matrix(unsigned int rows, unsigned int cols){
+void MZ_arena_free(MZ_Arena* arena){
 
-    MZ_Matrix result = MZ_alloc_matrix(rows, cols);
+    MZ_Arena_Block* block = arena->blocks;
 
-    for(unsigned int i = 0; i < rows; i++){
-        for(unsigned int j = 0; j < cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = 0.0f;
-        }
+    while(block != NULL){
+        MZ_Arena_Block* next = block->next;
+        MZ_aligned_free(block->data);
+        free(block);
+        block = next;
     }
 
-    return result;
-
+    arena->blocks = NULL;
+    arena->offset = 0;
+    arena->used = 0;
 }
 
 /*
 */
-MZ_Matrix MZ_new_random_float_matrix(unsigned int rows, unsigned int cols, float min, float max){
+void* MZ_arena_alloc(MZ_Arena* arena, size_t size){
+
+    size = (size + MZ_MATRIX_ALIGNMENT - 1) / MZ_MATRIX_ALIGNMENT * MZ_MATRIX_ALIGNMENT;
+    if(size == 0) size = MZ_MATRIX_ALIGNMENT;
+
+    if(arena->blocks == NULL || arena->offset + size > arena->blocks->capacity){
+        // chain a block twice as big as the last one, reset merges them back
+        size_t capacity = arena->blocks != NULL ? arena->blocks->capacity * 2 : 0;
+        if(capacity < size) capacity = size;
+        arena->blocks = _MZ_arena_new_block(capacity, arena->blocks);
+        arena->offset = 0;
+    }
+
+    void* result = arena->blocks->data + arena->offset;
+
+    arena->offset += size;
+    arena->used += size;
+    if(arena->used > arena->peak) arena->peak = arena->used;
+
+    return result;
+}
+
+/*
+*/
+void MZ_arena_reset(MZ_Arena* arena){
+
+    if(arena->blocks != NULL && arena->blocks->next != NULL){
+        size_t capacity = 0;
+        for(MZ_Arena_Block* block = arena->blocks; block != NULL; block = block->next){
+            capacity += block->capacity;
+        }
+        MZ_arena_free(arena);
+        arena->blocks = _MZ_arena_new_block(capacity, NULL);
+    }
+
+    arena->offset = 0;
+    arena->used = 0;
+}
+
+/*
+*/
+void MZ_arena_push(MZ_Arena* arena){
+    arena->prev = _MZ_current_arena;
+    _MZ_current_arena = arena;
+}
+
+/*
+*/
+void MZ_arena_pop(void){
+    MZ_assert(_MZ_current_arena != NULL, "No arena to pop.");
+    MZ_Arena* arena = _MZ_current_arena;
+    _MZ_current_arena = arena->prev;
+    arena->prev = NULL;
+}
+
+/*
+*/
+MZ_Arena* MZ_arena_current(void){
+    return _MZ_current_arena;
+}
+
+/*
+    A freed buffer stores the link to the next one of the same shape in its first bytes.
+*/
+typedef struct _MZ_Pool_Node{
+    struct _MZ_Pool_Node* next;
+}_MZ_Pool_Node;
+
+typedef struct _MZ_Pool_Bucket{
+    unsigned int rows;
+    unsigned int cols;
+    unsigned int stride;
+    unsigned int count;
+    _MZ_Pool_Node* head;
+}_MZ_Pool_Bucket;
+
+typedef struct _MZ_Pool_Cache{
+    _MZ_Pool_Bucket buckets[MZ_POOL_THREAD_SHAPES];
+    bool registered;
+}_MZ_Pool_Cache;
+
+static bool _MZ_pool_enabled = true;
+static size_t _MZ_pool_hits = 0;
+static size_t _MZ_pool_misses = 0;
+static size_t _MZ_pool_buffers = 0;
+static size_t _MZ_pool_bytes = 0;
+
+static pthread_mutex_t _MZ_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _MZ_Pool_Bucket _MZ_pool_global[MZ_POOL_GLOBAL_SHAPES];
+static size_t _MZ_pool_global_bytes = 0;
+
+static pthread_once_t _MZ_pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _MZ_pool_key;
+static MZ_THREAD_LOCAL _MZ_Pool_Cache _MZ_pool_cache;
+
+/*
+*/
+static _MZ_Pool_Bucket* _MZ_pool_find(_MZ_Pool_Bucket* buckets, unsigned int n, unsigned int rows, unsigned int cols, unsigned int stride, bool create){
+
+    _MZ_Pool_Bucket* empty = NULL;
+
+    for(unsigned int i = 0; i < n; i++){
+        _MZ_Pool_Bucket* bucket = &buckets[i];
+        if(bucket->count > 0 && bucket->rows == rows && bucket->cols == cols && bucket->stride == stride){
+            return bucket;
+        }
+        if(bucket->count == 0 && empty == NULL) empty = bucket;
+    }
+
+    if(!create || empty == NULL) return NULL;
+
+    empty->rows = rows;
+    empty->cols = cols;
+    empty->stride = stride;
+
+    return empty;
+}
+
+/*
+*/
+static void* _MZ_pool_take(_MZ_Pool_Bucket* bucket){
+
+    _MZ_Pool_Node* node = bucket->head;
+
+    bucket->head = node->next;
+    bucket->count--;
+
+    return node;
+}
+
+/*
+*/
+static void _MZ_pool_give(_MZ_Pool_Bucket* bucket, void* ptr){
+
+    _MZ_Pool_Node* node = (_MZ_Pool_Node*)ptr;
+
+    node->next = bucket->head;
+    bucket->head = node;
+    bucket->count++;
+}
+
+/*
+*/
+static size_t _MZ_pool_bucket_bytes(_MZ_Pool_Bucket* bucket){
+    return (size_t)bucket->rows * bucket->stride * sizeof(float);
+}
+
+/*
+    Hands every buffer of a thread cache to the global list, or to the system once the list is full.
+*/
+static void _MZ_pool_flush(_MZ_Pool_Cache* cache){
+
+    pthread_mutex_lock(&_MZ_pool_mutex);
+
+    for(unsigned int i = 0; i < MZ_POOL_THREAD_SHAPES; i++){
+        _MZ_Pool_Bucket* bucket = &cache->buckets[i];
+        size_t size = _MZ_pool_bucket_bytes(bucket);
+
+        while(bucket->count > 0){
+            void* ptr = _MZ_pool_take(bucket);
+            _MZ_Pool_Bucket* global = NULL;
+
+            if(_MZ_pool_global_bytes + size <= MZ_POOL_MAX_BYTES){
+                global = _MZ_pool_find(_MZ_pool_global, MZ_POOL_GLOBAL_SHAPES, bucket->rows, bucket->cols, bucket->stride, true);
+            }
+
+            if(global != NULL){
+                _MZ_pool_give(global, ptr);
+                _MZ_pool_global_bytes += size;
+            }else {
+                MZ_aligned_free(ptr);
+                __atomic_sub_fetch(&_MZ_pool_buffers, 1, __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&_MZ_pool_bytes, size, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&_MZ_pool_mutex);
+}
+
+/*
+*/
+static void _MZ_pool_thread_exit(void* cache){
+    _MZ_pool_flush((_MZ_Pool_Cache*)cache);
+}
+
+/*
+*/
+static void _MZ_pool_make_key(void){
+    pthread_key_create(&_MZ_pool_key, _MZ_pool_thread_exit);
+}
+
+/*
+*/
+static _MZ_Pool_Cache* _MZ_pool_thread_cache(void){
+
+    _MZ_Pool_Cache* cache = &_MZ_pool_cache;
+
+    if(!cache->registered){
+        // the key destructor gives the cache back when the thread exits
+        pthread_once(&_MZ_pool_key_once, _MZ_pool_make_key);
+        pthread_setspecific(_MZ_pool_key, cache);
+        cache->registered = true;
+    }
+
+    return cache;
+}
+
+/*
+*/
+static float* _MZ_pool_alloc(unsigned int rows, unsigned int cols, unsigned int stride, size_t size){
+
+    void* ptr = NULL;
+
+    if(_MZ_pool_enabled && size > 0){
+        _MZ_Pool_Cache* cache = _MZ_pool_thread_cache();
+        _MZ_Pool_Bucket* bucket = _MZ_pool_find(cache->buckets, MZ_POOL_THREAD_SHAPES, rows, cols, stride, false);
+
+        if(bucket != NULL){
+            ptr = _MZ_pool_take(bucket);
+        }else {
+            pthread_mutex_lock(&_MZ_pool_mutex);
+            bucket = _MZ_pool_find(_MZ_pool_global, MZ_POOL_GLOBAL_SHAPES, rows, cols, stride, false);
+            if(bucket != NULL){
+                ptr = _MZ_pool_take(bucket);
+                _MZ_pool_global_bytes -= size;
+            }
+            pthread_mutex_unlock(&_MZ_pool_mutex);
+        }
+
+        if(ptr != NULL){
+            __atomic_add_fetch(&_MZ_pool_hits, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&_MZ_pool_buffers, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&_MZ_pool_bytes, size, __ATOMIC_RELAXED);
+            return (float*)ptr;
+        }
+
+        __atomic_add_fetch(&_MZ_pool_misses, 1, __ATOMIC_RELAXED);
+    }
+
+    return (float*)MZ_aligned_alloc(size);
+}
+
+/*
+*/
+static void _MZ_pool_release(MZ_Matrix* mat){
+
+    size_t size = (size_t)mat->rows * mat->stride * sizeof(float);
+
+    if(!_MZ_pool_enabled || size == 0){
+        MZ_aligned_free(mat->elements);
+        return;
+    }
+
+    __atomic_add_fetch(&_MZ_pool_buffers, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_MZ_pool_bytes, size, __ATOMIC_RELAXED);
+
+    _MZ_Pool_Cache* cache = _MZ_pool_thread_cache();
+    _MZ_Pool_Bucket* bucket = _MZ_pool_find(cache->buckets, MZ_POOL_THREAD_SHAPES, mat->rows, mat->cols, mat->stride, true);
+
+    if(bucket != NULL && bucket->count < MZ_POOL_THREAD_DEPTH){
+        _MZ_pool_give(bucket, mat->elements);
+        return;
+    }
+
+    pthread_mutex_lock(&_MZ_pool_mutex);
+
+    if(_MZ_pool_global_bytes + size <= MZ_POOL_MAX_BYTES){
+        bucket = _MZ_pool_find(_MZ_pool_global, MZ_POOL_GLOBAL_SHAPES, mat->rows, mat->cols, mat->stride, true);
+        if(bucket != NULL){
+            _MZ_pool_give(bucket, mat->elements);
+            _MZ_pool_global_bytes += size;
+            pthread_mutex_unlock(&_MZ_pool_mutex);
+            return;
+        }
+    }
+
+    pthread_mutex_unlock(&_MZ_pool_mutex);
+
+    __atomic_sub_fetch(&_MZ_pool_buffers, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&_MZ_pool_bytes, size, __ATOMIC_RELAXED);
+    MZ_aligned_free(mat->elements);
+}
+
+/*
+*/
+void MZ_pool_set_enabled(bool enabled){
+    _MZ_pool_enabled = enabled;
+}
+
+/*
+*/
+MZ_Pool_Stats MZ_pool_stats(void){
+
+    MZ_Pool_Stats stats;
+    stats.hits = __atomic_load_n(&_MZ_pool_hits, __ATOMIC_RELAXED);
+    stats.misses = __atomic_load_n(&_MZ_pool_misses, __ATOMIC_RELAXED);
+    stats.buffers_cached = __atomic_load_n(&_MZ_pool_buffers, __ATOMIC_RELAXED);
+    stats.bytes_cached = __atomic_load_n(&_MZ_pool_bytes, __ATOMIC_RELAXED);
+
+    return stats;
+}
+
+/*
+*/
+void MZ_pool_print_stats(FILE* fp){
+
+    MZ_Pool_Stats stats = MZ_pool_stats();
+    size_t total = stats.hits + stats.misses;
+
+    fprintf(fp, "   | Matrix pool: {\n");
+    fprintf(fp, "   |\thits: %zu, misses: %zu, hit rate: %.2f%%;\n", stats.hits, stats.misses, total ? 100.0 * stats.hits / total : 0.0);
+    fprintf(fp, "   |\tcached: %zu buffers, %zu bytes;\n", stats.buffers_cached, stats.bytes_cached);
+    fprintf(fp, "   | }\n\n");
+}
+
+/*
+*/
+void MZ_pool_trim(size_t keep_bytes){
+
+    _MZ_Pool_Cache* cache = _MZ_pool_thread_cache();
+
+    for(unsigned int i = 0; i < MZ_POOL_THREAD_SHAPES; i++){
+        _MZ_Pool_Bucket* bucket = &cache->buckets[i];
+        size_t size = _MZ_pool_bucket_bytes(bucket);
+        while(bucket->count > 0){
+            MZ_aligned_free(_MZ_pool_take(bucket));
+            __atomic_sub_fetch(&_MZ_pool_buffers, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&_MZ_pool_bytes, size, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_lock(&_MZ_pool_mutex);
+
+    for(unsigned int i = 0; i < MZ_POOL_GLOBAL_SHAPES && _MZ_pool_global_bytes > keep_bytes; i++){
+        _MZ_Pool_Bucket* bucket = &_MZ_pool_global[i];
+        size_t size = _MZ_pool_bucket_bytes(bucket);
+        while(bucket->count > 0 && _MZ_pool_global_bytes > keep_bytes){
+            MZ_aligned_free(_MZ_pool_take(bucket));
+            _MZ_pool_global_bytes -= size;
+            __atomic_sub_fetch(&_MZ_pool_buffers, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&_MZ_pool_bytes, size, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_unlock(&_MZ_pool_mutex);
+}
+
+/*
+*/
+void MZ_free_matrix(MZ_Matrix* mat){
+    MZ_assert(mat->elements != NULL, "Matrix must not be NULL.");
+
+    if(mat->storage == MZ_STORAGE_HEAP){
+        _MZ_pool_release(mat);
+    }
+
+    mat->elements = NULL;
+    mat->rows = 0;
+    mat->cols = 0;
+    mat->stride = 0;
+    mat->col_stride = 0;
+    mat->storage = MZ_STORAGE_HEAP;
+}
+
+/*
+*/
+void MZ_copy_matrix_pointer(MZ_Matrix *source, MZ_Matrix *dest){
+
+    if(dest->elements == NULL){ 
+        *dest= MZ_alloc_matrix(source->rows, source->cols); 
+    }
+
+    dest->rows = source->rows;
+    dest->cols = source->cols;
+    dest->stride = source->stride;
+    dest->col_stride = source->col_stride;
+    dest->storage = source->storage;
+    dest->elements = source->elements;
+
+}
+
+/*
+*/
+unsigned int MZ_padded_stride(unsigned int cols){
+
+    if(cols <= 1) return cols;
+
+    return (cols + MZ_MATRIX_ALIGN_FLOATS - 1) / MZ_MATRIX_ALIGN_FLOATS * MZ_MATRIX_ALIGN_FLOATS;
+}
+
+/*
+*/
+MZ_Matrix MZ_alloc_matrix(unsigned int rows, unsigned int cols){
+
+    return MZ_alloc_matrix_with_stride(rows, cols, MZ_padded_stride(cols));
+
+}
+
+/*
+*/
+MZ_Matrix MZ_alloc_matrix_with_stride(unsigned int rows, unsigned int cols, unsigned int stride){
+
+    MZ_assert(stride >= cols, MZ_EQUAL_ERROR);
+
+    MZ_Matrix result;
+    result.rows = rows;
+    result.cols = cols;
+    result.stride = stride;
+    result.col_stride = 1;
+
+    size_t size = (size_t)rows * stride * sizeof(float);
+
+    if(_MZ_current_arena != NULL){
+        result.storage = MZ_STORAGE_ARENA;
+        result.elements = (float*)MZ_arena_alloc(_MZ_current_arena, size);
+    }else {
+        result.storage = MZ_STORAGE_HEAP;
+        result.elements = _MZ_pool_alloc(rows, cols, stride, size);
+    }
+
+    MZ_assert(result.elements != NULL, MZ_ALLOC_ERROR);
+
+    memset(result.elements, 0, size);
+
+    return result;
+
+}
+
+/*
+*/
+MZ_Matrix MZ_new_zero_matrix(unsigned int rows, unsigned int cols){
+
+    MZ_Matrix result = MZ_alloc_matrix(rows, cols);
+
+    for(unsigned int i = 0; i < rows; i++){
+        for(unsigned int j = 0; j < cols; j++){
+            MZ_VALUE_OF_MAT_AT(result, i, j) = 0.0f;
+        }
+    }
+
+    return result;
+
+}
+
+/*
+*/
+MZ_Matrix MZ_new_random_float_matrix(unsigned int rows, unsigned int cols, float min, float max){
 
     MZ_Matrix result = MZ_alloc_matrix(rows, cols);
     
@@ -1912,51 +3210,2565 @@ MZ_Matrix MZ_flatten_matrix(MZ_Matrix matrix, Direction dir){
 
 /*
 */
-MZ_Matrix MZ_add_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2){
+MZ_Matrix MZ_view_from_buffer(float* elements, unsigned int rows, unsigned int cols, unsigned int stride, unsigned int col_stride){
 
-    MZ_assert(matrix1.rows == matrix2.rows && matrix1.cols == matrix2.cols, MZ_EQUAL_ERROR);
-    
-    MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
-
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) + MZ_VALUE_OF_MAT_AT(matrix2, i, j);
-        }
-    }
+    MZ_Matrix result;
+    result.rows = rows;
+    result.cols = cols;
+    result.stride = stride;
+    result.col_stride = col_stride;
+    result.storage = MZ_STORAGE_VIEW;
+    result.elements = elements;
 
     return result;
-
 }
 
 /*
 */
-MZ_Matrix MZ_add_matrix_with_scalar(MZ_Matrix matrix1, float scalar){
-    
-    MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
+bool MZ_is_matrix_contiguous(MZ_Matrix matrix){
 
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) + scalar;
-        }
-    }
+    // a single column only needs its rows to be adjacent
+    if(matrix.cols == 1) return matrix.rows <= 1 || matrix.stride == 1;
 
-    return result;
+    if(matrix.col_stride != 1) return false;
 
+    return matrix.rows <= 1 || matrix.stride == matrix.cols;
 }
 
 /*
 */
-MZ_Matrix MZ_subtract_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2){
+MZ_Matrix MZ_view_reshape(MZ_Matrix matrix, unsigned int rows, unsigned int cols){
 
-    MZ_assert(matrix1.rows == matrix2.rows && matrix1.cols == matrix2.cols, MZ_EQUAL_ERROR);
+    MZ_assert(matrix.rows * matrix.cols == rows * cols, MZ_EQUAL_ERROR);
+    MZ_assert(MZ_is_matrix_contiguous(matrix), MZ_CONTIGUOUS_ERROR);
 
-    MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
+    return MZ_view_from_buffer(matrix.elements, rows, cols, cols, 1);
+}
 
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) - MZ_VALUE_OF_MAT_AT(matrix2, i, j);
-        }
+/*
+*/
+MZ_Matrix MZ_view_flatten(MZ_Matrix matrix, Direction dir){
+
+    MZ_assert(dir < DIR_COUNT, MZ_DIRECTION_ERROR);
+
+    unsigned int n = matrix.rows * matrix.cols;
+
+    return dir == VERTICAL ? MZ_view_reshape(matrix, n, 1) : MZ_view_reshape(matrix, 1, n);
+}
+
+/*
+*/
+MZ_Matrix MZ_view_block(MZ_Matrix matrix, unsigned int row, unsigned int col, unsigned int rows, unsigned int cols){
+
+    MZ_assert(row + rows <= matrix.rows && col + cols <= matrix.cols, MZ_BOUNDS_ERROR);
+
+    return MZ_view_from_buffer(&MZ_VALUE_OF_MAT_AT(matrix, row, col), rows, cols, matrix.stride, matrix.col_stride);
+}
+
+/*
+*/
+MZ_Matrix MZ_view_row(MZ_Matrix matrix, unsigned int row){
+    return MZ_view_block(matrix, row, 0, 1, matrix.cols);
+}
+
+/*
+*/
+MZ_Matrix MZ_view_col(MZ_Matrix matrix, unsigned int col){
+    return MZ_view_block(matrix, 0, col, matrix.rows, 1);
+}
+
+/*
+*/
+MZ_Matrix MZ_view_transpose(MZ_Matrix matrix){
+    return MZ_view_from_buffer(matrix.elements, matrix.cols, matrix.rows, matrix.col_stride, matrix.stride);
+}
+
+/*
+    Vector kernels.
+
+    Every kernel is written once on the generic vector extensions of GCC and instantiated for each
+    instruction set with the target attribute and the vector width of that instruction set. The
+    instance used is chosen once at the first call by looking at the cpu, MZ_set_isa and the
+    MZ_ISA_ENV variable can force another.
+*/
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define _MZ_ISA_DISPATCH 1
+#else
+#define _MZ_ISA_DISPATCH 0
+#endif
+
+typedef float _MZ_F32x4 __attribute__((vector_size(16)));
+typedef float _MZ_F32x8 __attribute__((vector_size(32)));
+typedef float _MZ_F32x16 __attribute__((vector_size(64)));
+
+/*
+    Lanes of a vector type, unaligned load and store, horizontal sum and lane select.
+    They are macros because passing vectors to functions depends on the instruction set the caller is compiled for.
+*/
+#define _MZ_LANES(vec) (sizeof(vec) / sizeof(float))
+
+#define _MZ_loadv(vec, ptr) ({\
+    vec _v;\
+    memcpy(&_v, (ptr), sizeof(_v));\
+    _v;\
+})
+
+#define _MZ_storev(ptr, value) ({\
+    __auto_type _v = (value);\
+    memcpy((ptr), &_v, sizeof(_v));\
+})
+
+#define _MZ_sumv(value) ({\
+    __auto_type _v = (value);\
+    float _s = 0.0f;\
+    for(size_t _i = 0; _i < sizeof(_v) / sizeof(float); _i++) _s += _v[_i];\
+    _s;\
+})
+
+#define _MZ_selectv(mask, a, b) ({\
+    __auto_type _m = (mask);\
+    (typeof(a))(((typeof(_m))(a) & _m) | ((typeof(_m))(b) & ~_m));\
+})
+
+#define _MZ_splatv(vec, value) ((vec){0} + (float)(value))
+
+/*
+    Vector square root. GCC turns sqrtf on the lanes into scalar calls because of errno, on x86 the
+    instruction of each width is called directly, the helpers are inlined in the kernels of that width.
+*/
+#if _MZ_ISA_DISPATCH
+__attribute__((target("sse"))) static inline _MZ_F32x4 _MZ_sqrt_f32x4(_MZ_F32x4 x){
+    return __builtin_ia32_sqrtps(x);
+}
+
+__attribute__((target("avx"))) static inline _MZ_F32x8 _MZ_sqrt_f32x8(_MZ_F32x8 x){
+    return __builtin_ia32_sqrtps256(x);
+}
+
+__attribute__((target("avx512f"))) static inline _MZ_F32x16 _MZ_sqrt_f32x16(_MZ_F32x16 x){
+    return __builtin_ia32_sqrtps512_mask(x, x, (unsigned short)-1, 4);
+}
+
+#define _MZ_sqrtv(vec, value) _Generic((vec){0}, _MZ_F32x4: _MZ_sqrt_f32x4, _MZ_F32x8: _MZ_sqrt_f32x8, _MZ_F32x16: _MZ_sqrt_f32x16)(value)
+#else
+#define _MZ_sqrtv(vec, value) ({\
+    vec _q = (value);\
+    for(size_t _i = 0; _i < _MZ_LANES(vec); _i++) _q[_i] = sqrtf(_q[_i]);\
+    _q;\
+})
+#endif
+
+/*
+    Vector exp. x is reduced to r = x - n ln2 with |r| <= ln2 / 2 and e^x = 2^n e^r, 2^n is built
+    from the exponent bits in two halves so the results down to the smallest subnormal survive.
+    The accurate tier uses the degree 7 polynomial of Cephes expf, the fast one a degree 4 Taylor
+    polynomial with a relative error of about 4e-5.
+*/
+#define _MZ_EXP_MAX 88.72283905f
+#define _MZ_EXP_MIN -103.97208404f
+
+#define _MZ_expv(vec, value, accurate) ({\
+    vec _e_x = (value);\
+    vec _e_c = _MZ_selectv(_e_x > _MZ_splatv(vec, _MZ_EXP_MAX), _MZ_splatv(vec, _MZ_EXP_MAX), _e_x);\
+    _e_c = _MZ_selectv(_e_c < _MZ_splatv(vec, _MZ_EXP_MIN), _MZ_splatv(vec, _MZ_EXP_MIN), _e_c);\
+    /* round to nearest by the 1.5 * 2^23 trick, the sum is not folded without fast math */\
+    vec _e_n = (_e_c * 1.44269504088896341f + 12582912.0f) - 12582912.0f;\
+    vec _e_r = _e_c - _e_n * 0.693359375f;\
+    _e_r = _e_r - _e_n * -2.12194440e-4f;\
+    vec _e_p;\
+    if(accurate){\
+        _e_p = 1.9875691500e-4f * _e_r + 1.3981999507e-3f;\
+        _e_p = _e_p * _e_r + 8.3334519073e-3f;\
+        _e_p = _e_p * _e_r + 4.1665795894e-2f;\
+        _e_p = _e_p * _e_r + 1.6666665459e-1f;\
+        _e_p = _e_p * _e_r + 5.0000001201e-1f;\
+        _e_p = _e_p * _e_r * _e_r + _e_r + 1.0f;\
+    }else {\
+        _e_p = (((4.1666667e-2f * _e_r + 1.6666667e-1f) * _e_r + 0.5f) * _e_r + 1.0f) * _e_r + 1.0f;\
+    }\
+    __auto_type _e_i = __builtin_convertvector(_e_n, __typeof__(_e_n > _e_n));\
+    __auto_type _e_h = _e_i >> 1;\
+    _e_p = _e_p * (vec)((_e_h + 127) << 23) * (vec)((_e_i - _e_h + 127) << 23);\
+    _e_p = _MZ_selectv(_e_x > _MZ_splatv(vec, _MZ_EXP_MAX), _MZ_splatv(vec, INFINITY), _e_p);\
+    _MZ_selectv(_e_x < _MZ_splatv(vec, _MZ_EXP_MIN), (vec){0}, _e_p);\
+})
+
+/*
+    sigmoid(x) = e^min(x, 0) / (1 + e^-|x|), the exp never overflows and small results keep their precision.
+*/
+#define _MZ_sigmoidv(vec, value, accurate) ({\
+    vec _s_x = (value);\
+    vec _s_e = _MZ_expv(vec, _MZ_selectv(_s_x > (vec){0}, -_s_x, _s_x), accurate);\
+    _MZ_selectv(_s_x > (vec){0}, _MZ_splatv(vec, 1.0f), _s_e) / (1.0f + _s_e);\
+})
+
+/*
+    tanh(x) is the odd polynomial of Cephes tanhf below 0.625, above 1 - 2 / (e^2|x| + 1) with the sign of x.
+*/
+#define _MZ_tanhv(vec, value, accurate) ({\
+    vec _t_x = (value);\
+    vec _t_a = _MZ_selectv(_t_x < (vec){0}, -_t_x, _t_x);\
+    vec _t_z = _t_x * _t_x;\
+    vec _t_p = -5.70498872745e-3f * _t_z + 2.06390887954e-2f;\
+    _t_p = _t_p * _t_z - 5.37397155531e-2f;\
+    _t_p = _t_p * _t_z + 1.33314422036e-1f;\
+    _t_p = _t_p * _t_z - 3.33332819422e-1f;\
+    vec _t_small = _t_p * _t_z * _t_x + _t_x;\
+    vec _t_big = 1.0f - 2.0f / (_MZ_expv(vec, 2.0f * _t_a, accurate) + 1.0f);\
+    _t_big = _MZ_selectv(_t_x < (vec){0}, -_t_big, _t_big);\
+    _MZ_selectv(_t_a < _MZ_splatv(vec, 0.625f), _t_small, _t_big);\
+})
+
+#define _MZ_reluv(vec, value, accurate) ({\
+    vec _r_x = (value);\
+    _MZ_selectv(_r_x > (vec){0}, _r_x, (vec){0});\
+})
+
+#define _MZ_leaky_reluv(vec, value, accurate) ({\
+    vec _l_x = (value);\
+    _MZ_selectv(_l_x > (vec){0}, _l_x, MZ_LEAKY_RELU_SLOPE * _l_x);\
+})
+
+/*
+    gelu(x) = x / 2 (1 + tanh(u)) = x sigmoid(2u) with u = sqrt(2 / pi) (x + 0.044715 x^3),
+    the sigmoid keeps the precision of the small results of the negative inputs and -inf gives 0.
+*/
+#define _MZ_GELU_C 1.5957691216f
+#define _MZ_GELU_A 0.044715f
+
+#define _MZ_geluv(vec, value, accurate) ({\
+    vec _g_x = (value);\
+    vec _g_s = _MZ_sigmoidv(vec, _MZ_GELU_C * (_g_x + _MZ_GELU_A * _g_x * _g_x * _g_x), accurate);\
+    _MZ_selectv(_g_s == (vec){0}, (vec){0}, _g_x * _g_s);\
+})
+
+/*
+    ln(1 + z) for z in [0, 1]. u = 1 + z is split in 2^e m with m in [sqrt(2) / 2, sqrt(2)], ln(m) is the
+    polynomial of Cephes logf, and the factor z / (u - 1) gives back what the rounding of u lost.
+*/
+#define _MZ_log1pv(vec, value) ({\
+    vec _p_z = (value);\
+    vec _p_u = 1.0f + _p_z;\
+    vec _p_e = _MZ_selectv(_p_u > _MZ_splatv(vec, 1.41421356f), _MZ_splatv(vec, 1.0f), (vec){0});\
+    vec _p_f = _MZ_selectv(_p_u > _MZ_splatv(vec, 1.41421356f), 0.5f * _p_u, _p_u) - 1.0f;\
+    vec _p_f2 = _p_f * _p_f;\
+    vec _p_y = 7.0376836292e-2f * _p_f - 1.1514610310e-1f;\
+    _p_y = _p_y * _p_f + 1.1676998740e-1f;\
+    _p_y = _p_y * _p_f - 1.2420140846e-1f;\
+    _p_y = _p_y * _p_f + 1.4249322787e-1f;\
+    _p_y = _p_y * _p_f - 1.6668057665e-1f;\
+    _p_y = _p_y * _p_f + 2.0000714765e-1f;\
+    _p_y = _p_y * _p_f - 2.4999993993e-1f;\
+    _p_y = _p_y * _p_f + 3.3333331174e-1f;\
+    _p_y = _p_y * _p_f * _p_f2 + _p_e * -2.12194440e-4f - 0.5f * _p_f2;\
+    vec _p_l = _p_f + _p_y + _p_e * 0.693359375f;\
+    vec _p_d = _p_u - 1.0f;\
+    _MZ_selectv(_p_d == (vec){0}, _p_z, _p_l * (_p_z / _MZ_selectv(_p_d == (vec){0}, _MZ_splatv(vec, 1.0f), _p_d)));\
+})
+
+/*
+    softplus(x) = max(x, 0) + ln(1 + e^-|x|), the exp never overflows.
+*/
+#define _MZ_softplusv(vec, value, accurate) ({\
+    vec _o_x = (value);\
+    vec _o_n = _MZ_selectv(_o_x > (vec){0}, -_o_x, _o_x);\
+    _MZ_selectv(_o_x > (vec){0}, _o_x, (vec){0}) + _MZ_log1pv(vec, _MZ_expv(vec, _o_n, accurate));\
+})
+
+/*
+    1 - e^-y = -expm1(-y) for y >= 0. Below 0.5 the subtraction would cancel the small results, the
+    Taylor series up to y^8 is used there instead.
+*/
+#define _MZ_neg_expm1_negv(vec, value) ({\
+    vec _m_y = (value);\
+    vec _m_p = 1.0f / 5040.0f - _m_y * (1.0f / 40320.0f);\
+    _m_p = 1.0f / 720.0f - _m_y * _m_p;\
+    _m_p = 1.0f / 120.0f - _m_y * _m_p;\
+    _m_p = 1.0f / 24.0f - _m_y * _m_p;\
+    _m_p = 1.0f / 6.0f - _m_y * _m_p;\
+    _m_p = 0.5f - _m_y * _m_p;\
+    _m_p = _m_y * (1.0f - _m_y * _m_p);\
+    _MZ_selectv(_m_y < _MZ_splatv(vec, 0.5f), _m_p, 1.0f - _MZ_expv(vec, -_m_y, true));\
+})
+
+/*
+    The activations, act is a constant in the kernels of a single activation and a switch in the GEMM epilogue.
+*/
+#define _MZ_activatev(vec, act, accuracy, value) ({\
+    vec _a_x = (value);\
+    bool _a_accurate = (accuracy) == MZ_ACCURACY_ACCURATE;\
+    switch(act){\
+        case MZ_ACT_SIGMOID: _a_x = _MZ_sigmoidv(vec, _a_x, _a_accurate); break;\
+        case MZ_ACT_RELU: _a_x = _MZ_reluv(vec, _a_x, _a_accurate); break;\
+        case MZ_ACT_TANH: _a_x = _MZ_tanhv(vec, _a_x, _a_accurate); break;\
+        case MZ_ACT_LEAKY_RELU: _a_x = _MZ_leaky_reluv(vec, _a_x, _a_accurate); break;\
+        case MZ_ACT_GELU: _a_x = _MZ_geluv(vec, _a_x, _a_accurate); break;\
+        case MZ_ACT_SOFTPLUS: _a_x = _MZ_softplusv(vec, _a_x, _a_accurate); break;\
+        default: break;\
+    }\
+    _a_x;\
+})
+
+/*
+    The derivatives of the activations in terms of the output y = act(x), or of x for the GELU.
+    The softplus one is sigmoid(x) = 1 - e^-y, without the cancellation of the small y.
+*/
+#define _MZ_derivativev(vec, act, value) ({\
+    vec _y = (value);\
+    vec _d;\
+    switch(act){\
+        case MZ_ACT_SIGMOID: _d = _y * (1.0f - _y); break;\
+        case MZ_ACT_RELU: _d = _MZ_selectv(_y > (vec){0}, _MZ_splatv(vec, 1.0f), (vec){0}); break;\
+        case MZ_ACT_TANH: _d = 1.0f - _y * _y; break;\
+        case MZ_ACT_LEAKY_RELU: _d = _MZ_selectv(_y > (vec){0}, _MZ_splatv(vec, 1.0f), _MZ_splatv(vec, MZ_LEAKY_RELU_SLOPE)); break;\
+        case MZ_ACT_GELU:{\
+            vec _x2 = _y * _y;\
+            vec _s = _MZ_sigmoidv(vec, _MZ_GELU_C * (_y + _MZ_GELU_A * _x2 * _y), true);\
+            _d = _s + _y * _s * (1.0f - _s) * (_MZ_GELU_C * (1.0f + 3.0f * _MZ_GELU_A * _x2));\
+        }break;\
+        case MZ_ACT_SOFTPLUS: _d = _MZ_neg_expm1_negv(vec, _y); break;\
+        default: _d = _MZ_splatv(vec, 1.0f); break;\
+    }\
+    _d;\
+})
+
+/*
+    Work done on C by the last pass of a product over it: the bias of each row and the activation,
+    or the product by the derivative of the activation taken from the outputs y of the layer.
+*/
+typedef struct _MZ_Epilogue{
+    MZ_Activation act;
+    MZ_Accuracy accuracy;
+    bool derivative;
+    const float* bias;
+    size_t inc_bias;
+    const float* y;
+    size_t rs_y;
+    size_t cs_y;
+}_MZ_Epilogue;
+
+/*
+    The epilogue of the block of C that starts at row, col.
+*/
+static _MZ_Epilogue _MZ_epilogue_at(const _MZ_Epilogue* ep, size_t row, size_t col){
+
+    _MZ_Epilogue result = *ep;
+
+    if(result.bias != NULL) result.bias += row * result.inc_bias;
+    if(result.y != NULL) result.y += row * result.rs_y + col * result.cs_y;
+
+    return result;
+}
+
+/*
+    Epilogue applied to a block of C already written back, it runs the activation kernels in use.
+*/
+static void _MZ_epilogue_apply(const _MZ_Epilogue* ep, size_t m, size_t n, float* c, size_t rs_c, size_t cs_c);
+
+/*
+    Write back of a block of C computed by a GEMM micro-kernel, clipped to the real mr x nr.
+*/
+static void _MZ_gemm_store_tile(const float* tile, size_t ld, float* c, size_t rs_c, size_t cs_c,
+                                size_t mr, size_t nr, float alpha, float beta){
+
+    for(size_t i = 0; i < mr; i++){
+        const float* src = tile + i * ld;
+        float* row = c + i * rs_c;
+        if(beta == 0.0f){
+            for(size_t j = 0; j < nr; j++){
+                row[j * cs_c] = alpha * src[j];
+            }
+        }else {
+            for(size_t j = 0; j < nr; j++){
+                row[j * cs_c] = alpha * src[j] + beta * row[j * cs_c];
+            }
+        }
+    }
+}
+
+/*
+    The micro-kernel keeps MR x NV vectors of C in registers, NR is NV times the lanes of the vector.
+*/
+#define _MZ_DEFINE_GEMM_KERNEL(name, target, vec, MR, NV)\
+target static void name(size_t kc, const float* restrict a, const float* restrict b,\
+                        float* c, size_t rs_c, size_t cs_c, size_t mr, size_t nr,\
+                        float alpha, float beta, const _MZ_Epilogue* ep){\
+    enum { NR = NV * _MZ_LANES(vec) };\
+    vec acc[MR][NV];\
+    _Pragma("GCC unroll 16")\
+    for(int i = 0; i < MR; i++){\
+        _Pragma("GCC unroll 4")\
+        for(int v = 0; v < NV; v++) acc[i][v] = (vec){0};\
+    }\
+    for(size_t p = 0; p < kc; p++){\
+        _Pragma("GCC unroll 16")\
+        for(int i = 0; i < MR; i++){\
+            _Pragma("GCC unroll 4")\
+            for(int v = 0; v < NV; v++) acc[i][v] += a[i] * ((const vec*)b)[v];\
+        }\
+        a += MR;\
+        b += NR;\
+    }\
+    /* full blocks of a row-major C are written back with vectors, the epilogue is applied on the way */\
+    if(mr == MR && nr == NR && cs_c == 1 && (ep == NULL || !ep->derivative || ep->cs_y == 1)){\
+        _Pragma("GCC unroll 16")\
+        for(int i = 0; i < MR; i++){\
+            float bias = ep != NULL && ep->bias != NULL ? ep->bias[i * ep->inc_bias] : 0.0f;\
+            _Pragma("GCC unroll 4")\
+            for(int v = 0; v < NV; v++){\
+                float* dest = c + i * rs_c + v * _MZ_LANES(vec);\
+                vec result = alpha * acc[i][v];\
+                if(beta != 0.0f) result += beta * _MZ_loadv(vec, dest);\
+                if(ep != NULL && ep->derivative){\
+                    result *= _MZ_derivativev(vec, ep->act, _MZ_loadv(vec, ep->y + i * ep->rs_y + v * _MZ_LANES(vec)));\
+                }else if(ep != NULL){\
+                    result = _MZ_activatev(vec, ep->act, ep->accuracy, result + bias);\
+                }\
+                _MZ_storev(dest, result);\
+            }\
+        }\
+        return;\
+    }\
+    float tile[MR][NR];\
+    memcpy(tile, acc, sizeof(tile));\
+    _MZ_gemm_store_tile(tile[0], NR, c, rs_c, cs_c, mr, nr, alpha, beta);\
+    if(ep != NULL) _MZ_epilogue_apply(ep, mr, nr, c, rs_c, cs_c);\
+}
+
+#define _MZ_DEFINE_DOT_KERNEL(name, target, vec)\
+target static float name(size_t n, const float* x, const float* y){\
+    enum { W = _MZ_LANES(vec) };\
+    vec acc0 = {0};\
+    vec acc1 = {0};\
+    size_t i = 0;\
+    for(; i + 2 * W <= n; i += 2 * W){\
+        acc0 += _MZ_loadv(vec, x + i) * _MZ_loadv(vec, y + i);\
+        acc1 += _MZ_loadv(vec, x + i + W) * _MZ_loadv(vec, y + i + W);\
+    }\
+    for(; i + W <= n; i += W){\
+        acc0 += _MZ_loadv(vec, x + i) * _MZ_loadv(vec, y + i);\
+    }\
+    float result = _MZ_sumv(acc0 + acc1);\
+    for(; i < n; i++){\
+        result += x[i] * y[i];\
+    }\
+    return result;\
+}
+
+/*
+    y += alpha * x
+*/
+#define _MZ_DEFINE_AXPY_KERNEL(name, target, vec)\
+target static void name(size_t n, float alpha, const float* x, float* y){\
+    enum { W = _MZ_LANES(vec) };\
+    size_t i = 0;\
+    for(; i + W <= n; i += W){\
+        _MZ_storev(y + i, _MZ_loadv(vec, y + i) + alpha * _MZ_loadv(vec, x + i));\
+    }\
+    for(; i < n; i++){\
+        y[i] += alpha * x[i];\
+    }\
+}
+
+/*
+    z = x op y, z may be exactly x or y.
+*/
+#define _MZ_DEFINE_BINARY_KERNEL(name, target, vec, op)\
+target static void name(size_t n, const float* x, const float* y, float* z){\
+    enum { W = _MZ_LANES(vec) };\
+    size_t i = 0;\
+    for(; i + W <= n; i += W){\
+        _MZ_storev(z + i, _MZ_loadv(vec, x + i) op _MZ_loadv(vec, y + i));\
+    }\
+    for(; i < n; i++){\
+        z[i] = x[i] op y[i];\
+    }\
+}
+
+/*
+    z = x / y, with 0 where y is 0.
+*/
+#define _MZ_DEFINE_DIV_KERNEL(name, target, vec)\
+target static void name(size_t n, const float* x, const float* y, float* z){\
+    enum { W = _MZ_LANES(vec) };\
+    const vec zero = {0};\
+    size_t i = 0;\
+    for(; i + W <= n; i += W){\
+        vec den = _MZ_loadv(vec, y + i);\
+        _MZ_storev(z + i, _MZ_selectv(den != zero, _MZ_loadv(vec, x + i) / den, zero));\
+    }\
+    for(; i < n; i++){\
+        z[i] = y[i] != 0.0f ? x[i] / y[i] : 0.0f;\
+    }\
+}
+
+/*
+    z = x op scalar, z may be exactly x.
+*/
+#define _MZ_DEFINE_SCALAR_KERNEL(name, target, vec, op)\
+target static void name(size_t n, const float* x, float scalar, float* z){\
+    enum { W = _MZ_LANES(vec) };\
+    size_t i = 0;\
+    for(; i + W <= n; i += W){\
+        _MZ_storev(z + i, _MZ_loadv(vec, x + i) op scalar);\
+    }\
+    for(; i < n; i++){\
+        z[i] = x[i] op scalar;\
+    }\
+}
+
+/*
+    y = alpha * A * x + beta * y for A with contiguous rows, four rows share each load of x.
+*/
+#define _MZ_GEMV_STORE(dest, value) (*(dest) = beta == 0.0f ? alpha * (value) : alpha * (value) + beta * *(dest))
+
+#define _MZ_DEFINE_GEMV_KERNEL(name, target, vec)\
+target static void name(size_t m, size_t n, float alpha, const float* a, size_t lda, const float* x,\
+                        float beta, float* y, size_t inc_y){\
+    enum { W = _MZ_LANES(vec) };\
+    size_t i = 0;\
+    for(; i + 4 <= m; i += 4){\
+        const float* a0 = a + i * lda;\
+        const float* a1 = a0 + lda;\
+        const float* a2 = a1 + lda;\
+        const float* a3 = a2 + lda;\
+        vec acc0 = {0};\
+        vec acc1 = {0};\
+        vec acc2 = {0};\
+        vec acc3 = {0};\
+        size_t j = 0;\
+        for(; j + W <= n; j += W){\
+            vec xv = _MZ_loadv(vec, x + j);\
+            acc0 += _MZ_loadv(vec, a0 + j) * xv;\
+            acc1 += _MZ_loadv(vec, a1 + j) * xv;\
+            acc2 += _MZ_loadv(vec, a2 + j) * xv;\
+            acc3 += _MZ_loadv(vec, a3 + j) * xv;\
+        }\
+        float s0 = _MZ_sumv(acc0);\
+        float s1 = _MZ_sumv(acc1);\
+        float s2 = _MZ_sumv(acc2);\
+        float s3 = _MZ_sumv(acc3);\
+        for(; j < n; j++){\
+            s0 += a0[j] * x[j];\
+            s1 += a1[j] * x[j];\
+            s2 += a2[j] * x[j];\
+            s3 += a3[j] * x[j];\
+        }\
+        _MZ_GEMV_STORE(y + i * inc_y, s0);\
+        _MZ_GEMV_STORE(y + (i + 1) * inc_y, s1);\
+        _MZ_GEMV_STORE(y + (i + 2) * inc_y, s2);\
+        _MZ_GEMV_STORE(y + (i + 3) * inc_y, s3);\
+    }\
+    for(; i < m; i++){\
+        const float* row = a + i * lda;\
+        vec acc = {0};\
+        size_t j = 0;\
+        for(; j + W <= n; j += W){\
+            acc += _MZ_loadv(vec, row + j) * _MZ_loadv(vec, x + j);\
+        }\
+        float sum = _MZ_sumv(acc);\
+        for(; j < n; j++){\
+            sum += row[j] * x[j];\
+        }\
+        _MZ_GEMV_STORE(y + i * inc_y, sum);\
+    }\
+}
+
+#define _MZ_DEFINE_SUM_KERNEL(name, target, vec)\
+target static float name(size_t n, const float* x){\
+    enum { W = _MZ_LANES(vec) };\
+    vec acc = {0};\
+    size_t i = 0;\
+    for(; i + W <= n; i += W){\
+        acc += _MZ_loadv(vec, x + i);\
+    }\
+    float result = _MZ_sumv(acc);\
+    for(; i < n; i++){\
+        result += x[i];\
+    }\
+    return result;\
+}
+
+/*
+    y = fn(x) with one of the vector math functions, y may be exactly x. The tail goes through a padded
+    vector so every element gets the same rounding.
+*/
+#define _MZ_DEFINE_UNARY_KERNEL(name, target, vec, fn, accurate)\
+target static void name(size_t n, const float* x, float* y){\
+    enum { W = _MZ_LANES(vec) };\
+    size_t i = 0;\
+    for(; i + W <= n; i += W){\
+        _MZ_storev(y + i, fn(vec, _MZ_loadv(vec, x + i), accurate));\
+    }\
+    if(i < n){\
+        float tail[W] = {0};\
+        memcpy(tail, x + i, (n - i) * sizeof(float));\
+        _MZ_storev(tail, fn(vec, _MZ_loadv(vec, tail), accurate));\
+        memcpy(y + i, tail, (n - i) * sizeof(float));\
+    }\
+}
+
+/*
+    z = x * act'(y) with act a constant, z may be exactly x or y. The tail is padded like the unary kernels.
+*/
+#define _MZ_DEFINE_DERIVATIVE_KERNEL(name, target, vec, act)\
+target static void name(size_t n, const float* x, const float* y, float* z){\
+    enum { W = _MZ_LANES(vec) };\
+    size_t i = 0;\
+    for(; i + W <= n; i += W){\
+        _MZ_storev(z + i, _MZ_loadv(vec, x + i) * _MZ_derivativev(vec, act, _MZ_loadv(vec, y + i)));\
+    }\
+    if(i < n){\
+        float tail_x[W] = {0};\
+        float tail_y[W] = {0};\
+        memcpy(tail_x, x + i, (n - i) * sizeof(float));\
+        memcpy(tail_y, y + i, (n - i) * sizeof(float));\
+        _MZ_storev(tail_x, _MZ_loadv(vec, tail_x) * _MZ_derivativev(vec, act, _MZ_loadv(vec, tail_y)));\
+        memcpy(z + i, tail_x, (n - i) * sizeof(float));\
+    }\
+}
+
+#define _MZ_DEFINE_MAX_KERNEL(name, target, vec)\
+target static float name(size_t n, const float* x){\
+    enum { W = _MZ_LANES(vec) };\
+    float result = -INFINITY;\
+    size_t i = 0;\
+    if(n >= W){\
+        vec acc = _MZ_loadv(vec, x);\
+        for(i = W; i + W <= n; i += W){\
+            vec v = _MZ_loadv(vec, x + i);\
+            acc = _MZ_selectv(v > acc, v, acc);\
+        }\
+        for(int j = 0; j < W; j++){\
+            result = acc[j] > result ? acc[j] : result;\
+        }\
+    }\
+    for(; i < n; i++){\
+        result = x[i] > result ? x[i] : result;\
+    }\
+    return result;\
+}
+
+/*
+    Loads and stores of the first n lanes of a vector, the other lanes are read as 0.
+*/
+#define _MZ_load_partialv(vec, ptr, n) ({\
+    vec _pv = {0};\
+    if((n) == _MZ_LANES(vec)) _pv = _MZ_loadv(vec, ptr);\
+    else memcpy(&_pv, (ptr), (n) * sizeof(float));\
+    _pv;\
+})
+
+#define _MZ_store_partialv(ptr, value, n) ({\
+    __auto_type _sv = (value);\
+    if((n) == _MZ_LANES(_sv)) _MZ_storev(ptr, _sv);\
+    else memcpy((ptr), &_sv, (n) * sizeof(float));\
+})
+
+/*
+    Softmax of the cols of a row-major block, a vector of cols at a time. The max and the sum of each col
+    are lanes of a vector, so the rows are combined without horizontal reductions, and e^(x - max) is
+    computed once and kept in y until the sum is known.
+*/
+#define _MZ_DEFINE_SOFTMAX_COLS_KERNEL(name, target, vec)\
+target static void name(size_t rows, size_t cols, const float* x, size_t rs_x, float* y, size_t rs_y){\
+    enum { W = _MZ_LANES(vec) };\
+    for(size_t j = 0; j < cols; j += W){\
+        size_t n = MZ_MIN(cols - j, (size_t)W);\
+        vec max = _MZ_splatv(vec, -INFINITY);\
+        for(size_t i = 0; i < rows; i++){\
+            vec v = _MZ_load_partialv(vec, x + i * rs_x + j, n);\
+            max = _MZ_selectv(v > max, v, max);\
+        }\
+        vec sum = {0};\
+        for(size_t i = 0; i < rows; i++){\
+            vec e = _MZ_expv(vec, _MZ_load_partialv(vec, x + i * rs_x + j, n) - max, true);\
+            sum += e;\
+            _MZ_store_partialv(y + i * rs_y + j, e, n);\
+        }\
+        vec scale = 1.0f / sum;\
+        for(size_t i = 0; i < rows; i++){\
+            _MZ_store_partialv(y + i * rs_y + j, _MZ_load_partialv(vec, y + i * rs_y + j, n) * scale, n);\
+        }\
+    }\
+}
+
+/*
+    Softmax of the cols followed by the subtraction of the one-hot labels on the way out. The logit of the
+    label is picked up with the max, so y can be x, and the loss of each col is ln(sum) + max - x[label].
+*/
+#define _MZ_DEFINE_SOFTMAX_XENT_COLS_KERNEL(name, target, vec)\
+target static float name(size_t rows, size_t cols, const float* x, size_t rs_x, const unsigned int* labels, float* y, size_t rs_y){\
+    enum { W = _MZ_LANES(vec) };\
+    float loss = 0.0f;\
+    for(size_t j = 0; j < cols; j += W){\
+        size_t n = MZ_MIN(cols - j, (size_t)W);\
+        vec label = {0};\
+        for(size_t l = 0; l < n; l++) label[l] = (float)labels[j + l];\
+        vec max = _MZ_splatv(vec, -INFINITY);\
+        vec picked = {0};\
+        for(size_t i = 0; i < rows; i++){\
+            vec v = _MZ_load_partialv(vec, x + i * rs_x + j, n);\
+            max = _MZ_selectv(v > max, v, max);\
+            picked = _MZ_selectv(label == _MZ_splatv(vec, i), v, picked);\
+        }\
+        vec sum = {0};\
+        for(size_t i = 0; i < rows; i++){\
+            vec e = _MZ_expv(vec, _MZ_load_partialv(vec, x + i * rs_x + j, n) - max, true);\
+            sum += e;\
+            _MZ_store_partialv(y + i * rs_y + j, e, n);\
+        }\
+        vec scale = 1.0f / sum;\
+        for(size_t i = 0; i < rows; i++){\
+            vec p = _MZ_load_partialv(vec, y + i * rs_y + j, n) * scale;\
+            _MZ_store_partialv(y + i * rs_y + j, p - _MZ_selectv(label == _MZ_splatv(vec, i), _MZ_splatv(vec, 1.0f), (vec){0}), n);\
+        }\
+        for(size_t l = 0; l < n; l++) loss += logf(sum[l]) + max[l] - picked[l];\
+    }\
+    return loss;\
+}
+
+/*
+    Argmax of the cols of a row-major block, the best value and its row are kept per lane.
+*/
+#define _MZ_DEFINE_ARGMAX_COLS_KERNEL(name, target, vec)\
+target static void name(size_t rows, size_t cols, const float* x, size_t rs_x, unsigned int* indices){\
+    enum { W = _MZ_LANES(vec) };\
+    for(size_t j = 0; j < cols; j += W){\
+        size_t n = MZ_MIN(cols - j, (size_t)W);\
+        vec best = _MZ_load_partialv(vec, x + j, n);\
+        vec row = {0};\
+        for(size_t i = 1; i < rows; i++){\
+            vec v = _MZ_load_partialv(vec, x + i * rs_x + j, n);\
+            __auto_type greater = v > best;\
+            best = _MZ_selectv(greater, v, best);\
+            row = _MZ_selectv(greater, _MZ_splatv(vec, i), row);\
+        }\
+        for(size_t l = 0; l < n; l++) indices[j + l] = (unsigned int)row[l];\
+    }\
+}
+
+/*
+    The constants of one optimizer step. The bias corrections of adam are folded in its rate and epsilon:
+    lr m' / (sqrt(v') + eps) = rate m / (sqrt(v) + epsilon) with rate = lr sqrt(1 - b2^t) / (1 - b1^t)
+    and epsilon = eps sqrt(1 - b2^t).
+*/
+typedef struct _MZ_Update{
+    float rate;
+    float momentum;
+    float beta2;
+    float epsilon;
+    float decay;
+    float shrink;
+}_MZ_Update;
+
+/*
+    One optimizer step on n weights with opt a constant: the gradient plus the L2 term is read once, the
+    moments and the weights are written once. m and v are only touched by the rules that keep them.
+*/
+#define _MZ_DEFINE_UPDATE_KERNEL(name, target, vec, opt)\
+target static void name(size_t n, float* w, const float* g, float* m, float* v, const _MZ_Update* u){\
+    enum { W = _MZ_LANES(vec) };\
+    const float rate = u->rate, momentum = u->momentum, beta2 = u->beta2;\
+    const float epsilon = u->epsilon, decay = u->decay, shrink = u->shrink;\
+    for(size_t i = 0; i < n; i += W){\
+        size_t len = MZ_MIN(n - i, (size_t)W);\
+        vec wv = _MZ_load_partialv(vec, w + i, len);\
+        vec gv = _MZ_load_partialv(vec, g + i, len) + decay * wv;\
+        if((opt) == MZ_OPT_SGD){\
+            wv -= rate * gv;\
+        }else if((opt) == MZ_OPT_MOMENTUM || (opt) == MZ_OPT_NESTEROV){\
+            vec mv = momentum * _MZ_load_partialv(vec, m + i, len) + gv;\
+            _MZ_store_partialv(m + i, mv, len);\
+            wv -= rate * ((opt) == MZ_OPT_NESTEROV ? gv + momentum * mv : mv);\
+        }else {\
+            vec mv = momentum * _MZ_load_partialv(vec, m + i, len) + (1.0f - momentum) * gv;\
+            vec vv = beta2 * _MZ_load_partialv(vec, v + i, len) + (1.0f - beta2) * gv * gv;\
+            _MZ_store_partialv(m + i, mv, len);\
+            _MZ_store_partialv(v + i, vv, len);\
+            wv = shrink * wv - rate * mv / (_MZ_sqrtv(vec, vv) + epsilon);\
+        }\
+        _MZ_store_partialv(w + i, wv, len);\
+    }\
+}
+
+typedef void (*_MZ_Gemm_Kernel)(size_t kc, const float* a, const float* b, float* c, size_t rs_c, size_t cs_c,
+                                size_t mr, size_t nr, float alpha, float beta, const _MZ_Epilogue* ep);
+typedef void (*_MZ_Gemv_Kernel)(size_t m, size_t n, float alpha, const float* a, size_t lda, const float* x,
+                                float beta, float* y, size_t inc_y);
+typedef void (*_MZ_Binary_Kernel)(size_t n, const float* x, const float* y, float* z);
+typedef void (*_MZ_Scalar_Kernel)(size_t n, const float* x, float scalar, float* z);
+typedef float (*_MZ_Reduce_Kernel)(size_t n, const float* x);
+typedef void (*_MZ_Unary_Kernel)(size_t n, const float* x, float* y);
+typedef void (*_MZ_Softmax_Cols_Kernel)(size_t rows, size_t cols, const float* x, size_t rs_x, float* y, size_t rs_y);
+typedef float (*_MZ_Softmax_Xent_Cols_Kernel)(size_t rows, size_t cols, const float* x, size_t rs_x, const unsigned int* labels,
+                                             float* y, size_t rs_y);
+typedef void (*_MZ_Argmax_Cols_Kernel)(size_t rows, size_t cols, const float* x, size_t rs_x, unsigned int* indices);
+typedef void (*_MZ_Update_Kernel)(size_t n, float* w, const float* g, float* m, float* v, const _MZ_Update* u);
+
+/*
+    The kernels of one instruction set. The GEMM micro-kernel computes blocks of mr x nr,
+    the packing of the operands follows the shape of the kernel in use.
+*/
+typedef struct _MZ_Kernels{
+    MZ_Isa isa;
+    size_t mr;
+    size_t nr;
+    _MZ_Gemm_Kernel gemm;
+    _MZ_Gemv_Kernel gemv;
+    float (*dot)(size_t n, const float* x, const float* y);
+    void (*axpy)(size_t n, float alpha, const float* x, float* y);
+    _MZ_Binary_Kernel add;
+    _MZ_Binary_Kernel sub;
+    _MZ_Binary_Kernel mul;
+    _MZ_Binary_Kernel div;
+    _MZ_Scalar_Kernel add_scalar;
+    _MZ_Scalar_Kernel mul_scalar;
+    _MZ_Reduce_Kernel sum;
+    _MZ_Reduce_Kernel max;
+    _MZ_Unary_Kernel exp[MZ_ACCURACY_COUNT];
+    _MZ_Unary_Kernel activate[MZ_ACT_COUNT][MZ_ACCURACY_COUNT];
+    _MZ_Binary_Kernel derivative[MZ_ACT_COUNT];
+    _MZ_Softmax_Cols_Kernel softmax_cols;
+    _MZ_Softmax_Xent_Cols_Kernel softmax_xent_cols;
+    _MZ_Argmax_Cols_Kernel argmax_cols;
+    _MZ_Update_Kernel update[MZ_OPT_COUNT];
+}_MZ_Kernels;
+
+/*
+    The forward kernels of both accuracies and the derivative kernel of an activation, the identity has none.
+*/
+#define _MZ_DEFINE_ACTIVATION_KERNELS(name, target, vec, fn, act)\
+_MZ_DEFINE_UNARY_KERNEL(name, target, vec, fn, true)\
+_MZ_DEFINE_UNARY_KERNEL(name##_fast, target, vec, fn, false)\
+_MZ_DEFINE_DERIVATIVE_KERNEL(name##_derivative, target, vec, act)
+
+#define _MZ_ACTIVATION_ENTRY(name, act) [act] = { name, name##_fast }
+
+
+/*
+    Instantiate every kernel for an instruction set, vec is its widest vector.
+*/
+#define _MZ_DEFINE_KERNELS(name, isa_id, target, vec, MR, NV)\
+_MZ_DEFINE_GEMM_KERNEL(_MZ_gemm_kernel_##name, target, vec, MR, NV)\
+_MZ_DEFINE_DOT_KERNEL(_MZ_dot_##name, target, vec)\
+_MZ_DEFINE_GEMV_KERNEL(_MZ_gemv_kernel_##name, target, vec)\
+_MZ_DEFINE_AXPY_KERNEL(_MZ_axpy_##name, target, vec)\
+_MZ_DEFINE_BINARY_KERNEL(_MZ_add_##name, target, vec, +)\
+_MZ_DEFINE_BINARY_KERNEL(_MZ_sub_##name, target, vec, -)\
+_MZ_DEFINE_BINARY_KERNEL(_MZ_mul_##name, target, vec, *)\
+_MZ_DEFINE_DIV_KERNEL(_MZ_div_##name, target, vec)\
+_MZ_DEFINE_SCALAR_KERNEL(_MZ_add_scalar_##name, target, vec, +)\
+_MZ_DEFINE_SCALAR_KERNEL(_MZ_mul_scalar_##name, target, vec, *)\
+_MZ_DEFINE_SUM_KERNEL(_MZ_sum_##name, target, vec)\
+_MZ_DEFINE_MAX_KERNEL(_MZ_max_##name, target, vec)\
+_MZ_DEFINE_UNARY_KERNEL(_MZ_exp_##name, target, vec, _MZ_expv, true)\
+_MZ_DEFINE_UNARY_KERNEL(_MZ_exp_fast_##name, target, vec, _MZ_expv, false)\
+_MZ_DEFINE_ACTIVATION_KERNELS(_MZ_sigmoid_##name, target, vec, _MZ_sigmoidv, MZ_ACT_SIGMOID)\
+_MZ_DEFINE_ACTIVATION_KERNELS(_MZ_relu_##name, target, vec, _MZ_reluv, MZ_ACT_RELU)\
+_MZ_DEFINE_ACTIVATION_KERNELS(_MZ_tanh_##name, target, vec, _MZ_tanhv, MZ_ACT_TANH)\
+_MZ_DEFINE_ACTIVATION_KERNELS(_MZ_leaky_relu_##name, target, vec, _MZ_leaky_reluv, MZ_ACT_LEAKY_RELU)\
+_MZ_DEFINE_ACTIVATION_KERNELS(_MZ_gelu_##name, target, vec, _MZ_geluv, MZ_ACT_GELU)\
+_MZ_DEFINE_ACTIVATION_KERNELS(_MZ_softplus_##name, target, vec, _MZ_softplusv, MZ_ACT_SOFTPLUS)\
+_MZ_DEFINE_SOFTMAX_COLS_KERNEL(_MZ_softmax_cols_##name, target, vec)\
+_MZ_DEFINE_SOFTMAX_XENT_COLS_KERNEL(_MZ_softmax_xent_cols_##name, target, vec)\
+_MZ_DEFINE_ARGMAX_COLS_KERNEL(_MZ_argmax_cols_##name, target, vec)\
+_MZ_DEFINE_UPDATE_KERNEL(_MZ_sgd_##name, target, vec, MZ_OPT_SGD)\
+_MZ_DEFINE_UPDATE_KERNEL(_MZ_momentum_##name, target, vec, MZ_OPT_MOMENTUM)\
+_MZ_DEFINE_UPDATE_KERNEL(_MZ_nesterov_##name, target, vec, MZ_OPT_NESTEROV)\
+_MZ_DEFINE_UPDATE_KERNEL(_MZ_adam_##name, target, vec, MZ_OPT_ADAM)\
+static const _MZ_Kernels _MZ_kernels_##name = {\
+    isa_id, MR, NV * _MZ_LANES(vec), _MZ_gemm_kernel_##name, _MZ_gemv_kernel_##name,\
+    _MZ_dot_##name, _MZ_axpy_##name,\
+    _MZ_add_##name, _MZ_sub_##name, _MZ_mul_##name, _MZ_div_##name,\
+    _MZ_add_scalar_##name, _MZ_mul_scalar_##name,\
+    _MZ_sum_##name, _MZ_max_##name,\
+    { _MZ_exp_##name, _MZ_exp_fast_##name },\
+    {\
+        _MZ_ACTIVATION_ENTRY(_MZ_sigmoid_##name, MZ_ACT_SIGMOID),\
+        _MZ_ACTIVATION_ENTRY(_MZ_relu_##name, MZ_ACT_RELU),\
+        _MZ_ACTIVATION_ENTRY(_MZ_tanh_##name, MZ_ACT_TANH),\
+        _MZ_ACTIVATION_ENTRY(_MZ_leaky_relu_##name, MZ_ACT_LEAKY_RELU),\
+        _MZ_ACTIVATION_ENTRY(_MZ_gelu_##name, MZ_ACT_GELU),\
+        _MZ_ACTIVATION_ENTRY(_MZ_softplus_##name, MZ_ACT_SOFTPLUS),\
+    },\
+    {\
+        [MZ_ACT_SIGMOID] = _MZ_sigmoid_##name##_derivative,\
+        [MZ_ACT_RELU] = _MZ_relu_##name##_derivative,\
+        [MZ_ACT_TANH] = _MZ_tanh_##name##_derivative,\
+        [MZ_ACT_LEAKY_RELU] = _MZ_leaky_relu_##name##_derivative,\
+        [MZ_ACT_GELU] = _MZ_gelu_##name##_derivative,\
+        [MZ_ACT_SOFTPLUS] = _MZ_softplus_##name##_derivative,\
+    },\
+    _MZ_softmax_cols_##name, _MZ_softmax_xent_cols_##name, _MZ_argmax_cols_##name,\
+    {\
+        [MZ_OPT_SGD] = _MZ_sgd_##name,\
+        [MZ_OPT_MOMENTUM] = _MZ_momentum_##name,\
+        [MZ_OPT_NESTEROV] = _MZ_nesterov_##name,\
+        [MZ_OPT_ADAM] = _MZ_adam_##name,\
+        [MZ_OPT_ADAMW] = _MZ_adam_##name,\
+    },\
+};
+
+// the baseline has 16 registers of 4 floats, a block of 4 x 8 keeps its accumulators in half of them
+_MZ_DEFINE_KERNELS(generic, MZ_ISA_GENERIC, , _MZ_F32x4, 4, 2)
+
+#if _MZ_ISA_DISPATCH
+_MZ_DEFINE_KERNELS(sse42, MZ_ISA_SSE42, __attribute__((target("sse4.2"))), _MZ_F32x4, 4, 2)
+_MZ_DEFINE_KERNELS(avx2, MZ_ISA_AVX2, __attribute__((target("avx2,fma"))), _MZ_F32x8, 6, 2)
+_MZ_DEFINE_KERNELS(avx512, MZ_ISA_AVX512, __attribute__((target("avx512f,avx2,fma"))), _MZ_F32x16, 8, 2)
+#endif
+
+static const _MZ_Kernels* _MZ_kernels_table[MZ_ISA_COUNT] = {
+    [MZ_ISA_GENERIC] = &_MZ_kernels_generic,
+#if _MZ_ISA_DISPATCH
+    [MZ_ISA_SSE42] = &_MZ_kernels_sse42,
+    [MZ_ISA_AVX2] = &_MZ_kernels_avx2,
+    [MZ_ISA_AVX512] = &_MZ_kernels_avx512,
+#endif
+};
+
+static const char* const _MZ_isa_names[MZ_ISA_COUNT] = {
+    [MZ_ISA_GENERIC] = "generic",
+    [MZ_ISA_SSE42] = "sse4.2",
+    [MZ_ISA_AVX2] = "avx2",
+    [MZ_ISA_AVX512] = "avx512",
+};
+
+static const char* const _MZ_activation_names[MZ_ACT_COUNT] = {
+    [MZ_ACT_IDENTITY] = "identity",
+    [MZ_ACT_SIGMOID] = "sigmoid",
+    [MZ_ACT_RELU] = "relu",
+    [MZ_ACT_TANH] = "tanh",
+    [MZ_ACT_LEAKY_RELU] = "leaky_relu",
+    [MZ_ACT_GELU] = "gelu",
+    [MZ_ACT_SOFTPLUS] = "softplus",
+};
+
+static const char* const _MZ_optimizer_names[MZ_OPT_COUNT] = {
+    [MZ_OPT_SGD] = "sgd",
+    [MZ_OPT_MOMENTUM] = "momentum",
+    [MZ_OPT_NESTEROV] = "nesterov",
+    [MZ_OPT_ADAM] = "adam",
+    [MZ_OPT_ADAMW] = "adamw",
+};
+
+static const _MZ_Kernels* _MZ_active_kernels = NULL;
+
+/*
+*/
+bool MZ_isa_supported(MZ_Isa isa){
+
+    if(isa >= MZ_ISA_COUNT || _MZ_kernels_table[isa] == NULL) return false;
+
+#if _MZ_ISA_DISPATCH
+    __builtin_cpu_init();
+
+    switch(isa){
+        case MZ_ISA_SSE42:  return __builtin_cpu_supports("sse4.2");
+        case MZ_ISA_AVX2:   return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case MZ_ISA_AVX512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+                                   __builtin_cpu_supports("fma");
+        default:            return true;
+    }
+#else
+    return true;
+#endif
+}
+
+/*
+*/
+MZ_Isa MZ_isa_best(void){
+
+    for(int isa = MZ_ISA_COUNT - 1; isa > MZ_ISA_GENERIC; isa--){
+        if(MZ_isa_supported((MZ_Isa)isa)) return (MZ_Isa)isa;
+    }
+
+    return MZ_ISA_GENERIC;
+}
+
+/*
+*/
+const char* MZ_isa_name(MZ_Isa isa){
+    return _MZ_name_of(_MZ_isa_names, MZ_ISA_COUNT, isa);
+}
+
+/*
+*/
+bool MZ_isa_from_name(const char* name, MZ_Isa* isa){
+
+    if(strcmp(name, "auto") == 0){
+        *isa = MZ_isa_best();
+        return true;
+    }
+
+    int value;
+    if(!_MZ_value_of(_MZ_isa_names, MZ_ISA_COUNT, "instruction set", name, &value)) return false;
+
+    *isa = (MZ_Isa)value;
+    return true;
+}
+
+/*
+*/
+bool MZ_set_isa(MZ_Isa isa){
+
+    if(!MZ_isa_supported(isa)) return false;
+
+    __atomic_store_n(&_MZ_active_kernels, _MZ_kernels_table[isa], __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*
+    The kernels in use, the first call picks them from MZ_ISA_ENV or the best the cpu supports.
+*/
+static const _MZ_Kernels* _MZ_kernels(void){
+
+    const _MZ_Kernels* kernels = __atomic_load_n(&_MZ_active_kernels, __ATOMIC_ACQUIRE);
+
+    if(kernels != NULL) return kernels;
+
+    MZ_Isa isa = MZ_isa_best();
+    const char* forced = getenv(MZ_ISA_ENV);
+
+    if(forced != NULL && *forced != '\0'){
+        MZ_Isa wanted;
+        if(!MZ_isa_from_name(forced, &wanted)){
+            fprintf(stderr, "[WARNING] %s=%s is ignored, using %s.\n", MZ_ISA_ENV, forced, MZ_isa_name(isa));
+        }else if(!MZ_isa_supported(wanted)){
+            fprintf(stderr, "[WARNING] %s=%s is not supported by this cpu, using %s.\n", MZ_ISA_ENV, forced, MZ_isa_name(isa));
+        }else {
+            isa = wanted;
+        }
+    }
+
+    kernels = _MZ_kernels_table[isa];
+
+    // two threads racing here pick the same kernels
+    __atomic_store_n(&_MZ_active_kernels, kernels, __ATOMIC_RELEASE);
+
+    return kernels;
+}
+
+/*
+*/
+MZ_Isa MZ_get_isa(void){
+    return _MZ_kernels()->isa;
+}
+
+/*
+*/
+void MZ_print_isa(FILE* fp){
+
+    fprintf(fp, "zMath kernels: %s (supported:", MZ_isa_name(MZ_get_isa()));
+
+    for(int isa = 0; isa < MZ_ISA_COUNT; isa++){
+        if(MZ_isa_supported((MZ_Isa)isa)) fprintf(fp, " %s", MZ_isa_name((MZ_Isa)isa));
+    }
+
+    fprintf(fp, ")\n");
+}
+
+/*
+    Run an element by element kernel over matrices of the same shape. It covers the operands that are
+    one contiguous run of floats and the ones whose rows are, anything else is left to the caller.
+*/
+static bool _MZ_map_binary(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2, _MZ_Binary_Kernel kernel){
+
+    if(MZ_is_matrix_contiguous(*dest) && MZ_is_matrix_contiguous(matrix1) && MZ_is_matrix_contiguous(matrix2)){
+        kernel((size_t)dest->rows * dest->cols, matrix1.elements, matrix2.elements, dest->elements);
+        return true;
+    }
+
+    if(dest->cols < 16 || dest->col_stride != 1 || matrix1.col_stride != 1 || matrix2.col_stride != 1) return false;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        kernel(dest->cols, MZ_ROW_OF_MAT(matrix1, i), MZ_ROW_OF_MAT(matrix2, i), MZ_ROW_OF_MAT(*dest, i));
+    }
+
+    return true;
+}
+
+/*
+*/
+static bool _MZ_map_scalar(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar, _MZ_Scalar_Kernel kernel){
+
+    if(MZ_is_matrix_contiguous(*dest) && MZ_is_matrix_contiguous(matrix1)){
+        kernel((size_t)dest->rows * dest->cols, matrix1.elements, scalar, dest->elements);
+        return true;
+    }
+
+    if(dest->cols < 16 || dest->col_stride != 1 || matrix1.col_stride != 1) return false;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        kernel(dest->cols, MZ_ROW_OF_MAT(matrix1, i), scalar, MZ_ROW_OF_MAT(*dest, i));
+    }
+
+    return true;
+}
+
+/*
+    Unary kernel on strided arrays, the elements go through a buffer when they are not contiguous.
+*/
+static void _MZ_map_unary_strided(_MZ_Unary_Kernel kernel, size_t n, const float* x, size_t inc_x, float* y, size_t inc_y){
+
+    if(inc_x == 1 && inc_y == 1){
+        kernel(n, x, y);
+        return;
+    }
+
+    float buffer[64];
+
+    for(size_t i = 0; i < n; i += 64){
+        size_t len = MZ_MIN(n - i, (size_t)64);
+        for(size_t j = 0; j < len; j++) buffer[j] = x[(i + j) * inc_x];
+        kernel(len, buffer, buffer);
+        for(size_t j = 0; j < len; j++) y[(i + j) * inc_y] = buffer[j];
+    }
+}
+
+/*
+*/
+static void _MZ_map_unary(MZ_Matrix* dest, MZ_Matrix matrix, _MZ_Unary_Kernel kernel){
+
+    if(MZ_is_matrix_contiguous(*dest) && MZ_is_matrix_contiguous(matrix)){
+        kernel((size_t)dest->rows * dest->cols, matrix.elements, dest->elements);
+        return;
+    }
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        _MZ_map_unary_strided(kernel, dest->cols, MZ_ROW_OF_MAT(matrix, i), matrix.col_stride,
+                              MZ_ROW_OF_MAT(*dest, i), dest->col_stride);
+    }
+}
+
+/*
+    Binary kernel on strided arrays, the elements go through buffers when they are not contiguous.
+*/
+static void _MZ_map_binary_strided(_MZ_Binary_Kernel kernel, size_t n, const float* x, size_t inc_x,
+                                   const float* y, size_t inc_y, float* z, size_t inc_z){
+
+    if(inc_x == 1 && inc_y == 1 && inc_z == 1){
+        kernel(n, x, y, z);
+        return;
+    }
+
+    float buffer_x[64];
+    float buffer_y[64];
+
+    for(size_t i = 0; i < n; i += 64){
+        size_t len = MZ_MIN(n - i, (size_t)64);
+        for(size_t j = 0; j < len; j++){
+            buffer_x[j] = x[(i + j) * inc_x];
+            buffer_y[j] = y[(i + j) * inc_y];
+        }
+        kernel(len, buffer_x, buffer_y, buffer_x);
+        for(size_t j = 0; j < len; j++) z[(i + j) * inc_z] = buffer_x[j];
+    }
+}
+
+/*
+    The kernel of an activation, NULL for the identity.
+*/
+static _MZ_Unary_Kernel _MZ_activation_kernel(const _MZ_Kernels* kernels, MZ_Activation act, MZ_Accuracy accuracy){
+    return act < MZ_ACT_COUNT ? kernels->activate[act][accuracy] : NULL;
+}
+
+/*
+*/
+static void _MZ_epilogue_apply(const _MZ_Epilogue* ep, size_t m, size_t n, float* c, size_t rs_c, size_t cs_c){
+
+    const _MZ_Kernels* kernels = _MZ_kernels();
+    _MZ_Unary_Kernel kernel = _MZ_activation_kernel(kernels, ep->act, ep->accuracy);
+
+    for(size_t i = 0; i < m; i++){
+        float* row = c + i * rs_c;
+        if(ep->derivative){
+            if(kernels->derivative[ep->act] != NULL){
+                _MZ_map_binary_strided(kernels->derivative[ep->act], n, row, cs_c, ep->y + i * ep->rs_y, ep->cs_y, row, cs_c);
+            }
+        }else {
+            if(ep->bias != NULL){
+                float bias = ep->bias[i * ep->inc_bias];
+                for(size_t j = 0; j < n; j++){
+                    row[j * cs_c] += bias;
+                }
+            }
+            if(kernel != NULL) _MZ_map_unary_strided(kernel, n, row, cs_c, row, cs_c);
+        }
+    }
+}
+
+/*
+*/
+static float _MZ_reduce(MZ_Matrix matrix, _MZ_Reduce_Kernel kernel, float (*combine)(float, float), float init){
+
+    if(MZ_is_matrix_contiguous(matrix)){
+        return kernel((size_t)matrix.rows * matrix.cols, matrix.elements);
+    }
+
+    float result = init;
+
+    for(unsigned int i = 0; i < matrix.rows; i++){
+        if(matrix.col_stride == 1){
+            result = combine(result, kernel(matrix.cols, MZ_ROW_OF_MAT(matrix, i)));
+        }else {
+            for(unsigned int j = 0; j < matrix.cols; j++){
+                result = combine(result, MZ_VALUE_OF_MAT_AT(matrix, i, j));
+            }
+        }
+    }
+
+    return result;
+}
+
+static float _MZ_combine_sum(float a, float b){ return a + b; }
+static float _MZ_combine_max(float a, float b){ return b > a ? b : a; }
+
+/*
+*/
+float MZ_sum_of_matrix(MZ_Matrix matrix){
+    return _MZ_reduce(matrix, _MZ_kernels()->sum, _MZ_combine_sum, 0.0f);
+}
+
+/*
+*/
+float MZ_max_of_matrix(MZ_Matrix matrix){
+
+    MZ_assert(matrix.rows > 0 && matrix.cols > 0, MZ_EQUAL_ERROR);
+
+    return _MZ_reduce(matrix, _MZ_kernels()->max, _MZ_combine_max, -INFINITY);
+}
+
+/*
+*/
+bool MZ_do_matrices_overlap(MZ_Matrix matrix1, MZ_Matrix matrix2){
+
+    if(matrix1.elements == NULL || matrix2.elements == NULL) return false;
+    if(matrix1.rows == 0 || matrix1.cols == 0 || matrix2.rows == 0 || matrix2.cols == 0) return false;
+
+    const float* begin1 = matrix1.elements;
+    const float* end1 = &MZ_VALUE_OF_MAT_AT(matrix1, matrix1.rows - 1, matrix1.cols - 1);
+    const float* begin2 = matrix2.elements;
+    const float* end2 = &MZ_VALUE_OF_MAT_AT(matrix2, matrix2.rows - 1, matrix2.cols - 1);
+
+    return begin1 <= end2 && begin2 <= end1;
+}
+
+/*
+    Element by element ops can write over an operand only if it is exactly the destination.
+*/
+static bool _MZ_is_safe_alias(MZ_Matrix dest, MZ_Matrix source){
+
+    if(!MZ_do_matrices_overlap(dest, source)) return true;
+
+    return dest.elements == source.elements &&
+           dest.stride == source.stride &&
+           dest.col_stride == source.col_stride;
+}
+
+/*
+*/
+void MZ_copy_matrix_into(MZ_Matrix* dest, MZ_Matrix source){
+
+    MZ_assert(dest->rows == source.rows && dest->cols == source.cols, MZ_EQUAL_ERROR);
+
+    if(dest->elements == source.elements) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(source, i, j);
+        }
+    }
+}
+
+/*
+*/
+void MZ_fill_matrix(MZ_Matrix* dest, float value){
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = value;
+        }
+    }
+}
+
+/*
+*/
+void MZ_flatten_matrix_into(MZ_Matrix* dest, MZ_Matrix matrix, Direction dir){
+
+    MZ_assert(dir < DIR_COUNT, MZ_DIRECTION_ERROR);
+
+    unsigned int n = matrix.rows * matrix.cols;
+
+    if(dir == VERTICAL){
+        MZ_assert(dest->rows == n && dest->cols == 1, MZ_EQUAL_ERROR);
+    }else {
+        MZ_assert(dest->rows == 1 && dest->cols == n, MZ_EQUAL_ERROR);
+    }
+    MZ_assert(!MZ_do_matrices_overlap(*dest, matrix), MZ_ALIAS_ERROR);
+
+    for(unsigned int i = 0; i < matrix.rows; i++){
+        for(unsigned int j = 0; j < matrix.cols; j++){
+            if(dir == VERTICAL){
+                MZ_VALUE_OF_MAT_POINTER_AT(dest, i*matrix.cols + j, 0) = MZ_VALUE_OF_MAT_AT(matrix, i, j);
+            }else {
+                MZ_VALUE_OF_MAT_POINTER_AT(dest, 0, i*matrix.cols + j) = MZ_VALUE_OF_MAT_AT(matrix, i, j);
+            }
+        }
+    }
+}
+
+/*
+*/
+void MZ_add_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2){
+
+    MZ_assert(matrix1.rows == matrix2.rows && matrix1.cols == matrix2.cols, MZ_EQUAL_ERROR);
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix1.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix1) && _MZ_is_safe_alias(*dest, matrix2), MZ_ALIAS_ERROR);
+
+    if(_MZ_map_binary(dest, matrix1, matrix2, _MZ_kernels()->add)) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) + MZ_VALUE_OF_MAT_AT(matrix2, i, j);
+        }
+    }
+}
+
+/*
+*/
+void MZ_add_matrix_with_scalar_into(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar){
+
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix1.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix1), MZ_ALIAS_ERROR);
+
+    if(_MZ_map_scalar(dest, matrix1, scalar, _MZ_kernels()->add_scalar)) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) + scalar;
+        }
+    }
+}
+
+/*
+*/
+void MZ_subtract_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2){
+
+    MZ_assert(matrix1.rows == matrix2.rows && matrix1.cols == matrix2.cols, MZ_EQUAL_ERROR);
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix1.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix1) && _MZ_is_safe_alias(*dest, matrix2), MZ_ALIAS_ERROR);
+
+    if(_MZ_map_binary(dest, matrix1, matrix2, _MZ_kernels()->sub)) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) - MZ_VALUE_OF_MAT_AT(matrix2, i, j);
+        }
+    }
+}
+
+/*
+*/
+void MZ_subtract_matrix_with_scalar_into(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar){
+
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix1.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix1), MZ_ALIAS_ERROR);
+
+    if(_MZ_map_scalar(dest, matrix1, -scalar, _MZ_kernels()->add_scalar)) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) - scalar;
+        }
+    }
+}
+
+/*
+    Worker pool of the parallel products.
+
+    The workers are started at the first parallel call and sleep on a condition variable between
+    jobs. A job is a number of tasks taken from a shared counter by the workers and by the calling
+    thread, that then waits for the last worker to finish. Only one job runs at a time, a thread that
+    finds the pool busy and the workers themselves run their tasks serially.
+*/
+
+typedef void (*_MZ_Task)(void* arg, size_t task);
+
+typedef struct _MZ_Workers{
+    pthread_mutex_t submit;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_t* threads;
+    unsigned int count;
+    unsigned int wanted;
+    unsigned long generation;
+    _MZ_Task task;
+    void* arg;
+    size_t tasks;
+    size_t next;
+    unsigned int running;
+    bool stop;
+}_MZ_Workers;
+
+static _MZ_Workers _MZ_workers = {
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static size_t _MZ_parallel_threshold = MZ_PARALLEL_MIN_WORK;
+static MZ_THREAD_LOCAL bool _MZ_is_worker = false;
+
+/*
+*/
+static void _MZ_workers_drain(_MZ_Task task, void* arg, size_t tasks){
+
+    size_t t;
+
+    while((t = __atomic_fetch_add(&_MZ_workers.next, 1, __ATOMIC_RELAXED)) < tasks){
+        task(arg, t);
+    }
+}
+
+/*
+    The generation the worker starts from is given by the spawner, so a job published right after
+    the spawn is not missed.
+*/
+static void* _MZ_worker_main(void* generation){
+
+    _MZ_Workers* w = &_MZ_workers;
+    unsigned long seen = (unsigned long)(uintptr_t)generation;
+
+    _MZ_is_worker = true;
+
+    for(;;){
+        pthread_mutex_lock(&w->lock);
+        while(w->generation == seen && !w->stop){
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        if(w->stop){
+            pthread_mutex_unlock(&w->lock);
+            return NULL;
+        }
+        seen = w->generation;
+        _MZ_Task task = w->task;
+        void* arg = w->arg;
+        size_t tasks = w->tasks;
+        pthread_mutex_unlock(&w->lock);
+
+        _MZ_workers_drain(task, arg, tasks);
+
+        pthread_mutex_lock(&w->lock);
+        if(--w->running == 0) pthread_cond_signal(&w->done);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/*
+    Join every worker, the submit lock must be held.
+*/
+static void _MZ_workers_join(void){
+
+    _MZ_Workers* w = &_MZ_workers;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+
+    for(unsigned int i = 0; i < w->count; i++){
+        pthread_join(w->threads[i], NULL);
+    }
+
+    free(w->threads);
+    w->threads = NULL;
+    w->count = 0;
+    w->stop = false;
+}
+
+/*
+    Only the thread that called fork lives on in the child, it starts its own workers from none.
+*/
+static void _MZ_workers_after_fork(void){
+
+    _MZ_Workers* w = &_MZ_workers;
+
+    free(w->threads);
+    w->threads = NULL;
+    w->count = 0;
+    w->running = 0;
+    w->stop = false;
+
+    pthread_mutex_init(&w->submit, NULL);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->done, NULL);
+}
+
+static pthread_once_t _MZ_workers_fork_once = PTHREAD_ONCE_INIT;
+
+/*
+*/
+static void _MZ_workers_register_fork(void){
+    pthread_atfork(NULL, NULL, _MZ_workers_after_fork);
+}
+
+/*
+    Start the workers missing to reach the wanted threads, the submit lock must be held.
+*/
+static void _MZ_workers_spawn(unsigned int threads){
+
+    _MZ_Workers* w = &_MZ_workers;
+
+    if(w->count == threads - 1) return;
+
+    _MZ_workers_join();
+
+    pthread_once(&_MZ_workers_fork_once, _MZ_workers_register_fork);
+
+    w->threads = (pthread_t*)malloc((threads - 1) * sizeof(pthread_t));
+    if(w->threads == NULL) return;
+
+    for(unsigned int i = 0; i < threads - 1; i++){
+        if(pthread_create(&w->threads[i], NULL, _MZ_worker_main, (void*)(uintptr_t)w->generation) != 0) break;
+        w->count++;
+    }
+}
+
+/*
+*/
+static unsigned int _MZ_default_threads(void){
+
+    const char* env = getenv(MZ_THREADS_ENV);
+
+    if(env != NULL && atoi(env) > 0) return (unsigned int)atoi(env);
+
+#if defined (_SC_NPROCESSORS_ONLN)
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (unsigned int)cores : 1;
+#else
+    return 1;
+#endif
+}
+
+/*
+*/
+void MZ_set_num_threads(unsigned int threads){
+
+    pthread_mutex_lock(&_MZ_workers.submit);
+
+    if(threads == 0) threads = _MZ_default_threads();
+
+    // the workers are restarted with the new count by the next parallel call
+    if(_MZ_workers.count != threads - 1) _MZ_workers_join();
+    __atomic_store_n(&_MZ_workers.wanted, threads, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&_MZ_workers.submit);
+}
+
+/*
+*/
+unsigned int MZ_get_num_threads(void){
+
+    unsigned int threads = __atomic_load_n(&_MZ_workers.wanted, __ATOMIC_RELAXED);
+
+    if(threads == 0){
+        threads = _MZ_default_threads();
+        __atomic_store_n(&_MZ_workers.wanted, threads, __ATOMIC_RELAXED);
+    }
+
+    return threads;
+}
+
+/*
+*/
+void MZ_set_parallel_threshold(size_t work){
+    __atomic_store_n(&_MZ_parallel_threshold, work, __ATOMIC_RELAXED);
+}
+
+/*
+    The calling thread counts as a worker while it runs tasks, the products of a task are never split
+    again and their result does not depend on the thread that took it.
+*/
+void MZ_parallel_for(size_t tasks, _MZ_Task task, void* arg){
+
+    _MZ_Workers* w = &_MZ_workers;
+    unsigned int threads = MZ_get_num_threads();
+    bool nested = _MZ_is_worker;
+
+    if(tasks > 1 && threads > 1 && !_MZ_is_worker && pthread_mutex_trylock(&w->submit) == 0){
+
+        _MZ_workers_spawn(threads);
+
+        if(w->count > 0){
+            pthread_mutex_lock(&w->lock);
+            w->task = task;
+            w->arg = arg;
+            w->tasks = tasks;
+            __atomic_store_n(&w->next, 0, __ATOMIC_RELAXED);
+            w->running = w->count;
+            w->generation++;
+            pthread_cond_broadcast(&w->wake);
+            pthread_mutex_unlock(&w->lock);
+
+            _MZ_is_worker = true;
+            _MZ_workers_drain(task, arg, tasks);
+            _MZ_is_worker = nested;
+
+            pthread_mutex_lock(&w->lock);
+            while(w->running > 0){
+                pthread_cond_wait(&w->done, &w->lock);
+            }
+            pthread_mutex_unlock(&w->lock);
+
+            pthread_mutex_unlock(&w->submit);
+            return;
+        }
+
+        pthread_mutex_unlock(&w->submit);
+    }
+
+    _MZ_is_worker = true;
+
+    for(size_t t = 0; t < tasks; t++){
+        task(arg, t);
+    }
+
+    _MZ_is_worker = nested;
+}
+
+/*
+    GEMM engine: C = alpha * A * B + beta * C on strided operands.
+
+    The loops follow the BLIS layout. B is packed in panels of KC x NC split in slivers NR cols wide,
+    A in blocks of MC x KC split in slivers MR rows tall, and the micro-kernel multiplies one sliver
+    of A by one sliver of B keeping the MR x NR block of C in registers. Packing pads the slivers with
+    zeros so the micro-kernel never sees a partial block, only the write back clips to the real size.
+    MR and NR are the ones of the kernels in use.
+*/
+
+/*
+    y = beta * y on a contiguous array, beta == 0 never reads y.
+*/
+static void _MZ_scal(size_t n, float beta, float* y){
+
+    if(beta == 1.0f) return;
+
+    for(size_t i = 0; i < n; i++){
+        y[i] = beta == 0.0f ? 0.0f : beta * y[i];
+    }
+}
+
+static MZ_THREAD_LOCAL float* _MZ_gemm_pack_a = NULL;
+static MZ_THREAD_LOCAL float* _MZ_gemm_pack_b = NULL;
+static MZ_THREAD_LOCAL size_t _MZ_gemm_pack_b_capacity = 0;
+
+static pthread_once_t _MZ_gemm_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _MZ_gemm_key;
+
+/*
+    The key destructor runs on the exiting thread, so it still sees the packing buffers of that thread.
+*/
+static void _MZ_gemm_thread_exit(void* unused){
+
+    (void)unused;
+
+    MZ_aligned_free(_MZ_gemm_pack_a);
+    MZ_aligned_free(_MZ_gemm_pack_b);
+    _MZ_gemm_pack_a = NULL;
+    _MZ_gemm_pack_b = NULL;
+    _MZ_gemm_pack_b_capacity = 0;
+}
+
+/*
+*/
+static void _MZ_gemm_make_key(void){
+    pthread_key_create(&_MZ_gemm_key, _MZ_gemm_thread_exit);
+}
+
+/*
+*/
+static void _MZ_gemm_pack_a_block(size_t mc, size_t kc, size_t MR, const float* a, size_t rs_a, size_t cs_a, float* dest){
+
+    for(size_t ir = 0; ir < mc; ir += MR){
+        size_t mr = MZ_MIN(mc - ir, MR);
+        for(size_t p = 0; p < kc; p++){
+            for(size_t i = 0; i < mr; i++){
+                dest[i] = a[(ir + i) * rs_a + p * cs_a];
+            }
+            for(size_t i = mr; i < MR; i++){
+                dest[i] = 0.0f;
+            }
+            dest += MR;
+        }
+    }
+}
+
+/*
+*/
+static void _MZ_gemm_pack_b_panel(size_t kc, size_t nc, size_t NR, const float* b, size_t rs_b, size_t cs_b, float* dest){
+
+    for(size_t jr = 0; jr < nc; jr += NR){
+        size_t nr = MZ_MIN(nc - jr, NR);
+        for(size_t p = 0; p < kc; p++){
+            const float* row = b + p * rs_b + jr * cs_b;
+            if(cs_b == 1){
+                memcpy(dest, row, nr * sizeof(float));
+            }else {
+                for(size_t j = 0; j < nr; j++){
+                    dest[j] = row[j * cs_b];
+                }
+            }
+            for(size_t j = nr; j < NR; j++){
+                dest[j] = 0.0f;
+            }
+            dest += NR;
+        }
+    }
+}
+
+/*
+*/
+static void _MZ_gemm_scale(size_t m, size_t n, float beta, float* c, size_t rs_c, size_t cs_c){
+
+    for(size_t i = 0; i < m; i++){
+        for(size_t j = 0; j < n; j++){
+            c[i * rs_c + j * cs_c] = beta == 0.0f ? 0.0f : beta * c[i * rs_c + j * cs_c];
+        }
+    }
+}
+
+/*
+    y = alpha * A * x + beta * y, with dot products when the rows of A are contiguous and with one
+    axpy per col when its cols are.
+*/
+static bool _MZ_gemv(const _MZ_Kernels* kernels, size_t m, size_t n, float alpha,
+                     const float* a, size_t rs_a, size_t cs_a, const float* x, size_t inc_x,
+                     float beta, float* y, size_t inc_y){
+
+    if(cs_a == 1 && inc_x == 1){
+        kernels->gemv(m, n, alpha, a, rs_a, x, beta, y, inc_y);
+        return true;
+    }
+
+    if(rs_a == 1 && inc_y == 1){
+        _MZ_scal(m, beta, y);
+        for(size_t j = 0; j < n; j++){
+            kernels->axpy(m, alpha * x[j * inc_x], a + j * cs_a, y);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/*
+    Skinny products (matrix by vector, outer products, tiny depth) gain nothing from packing,
+    they are done straight on the operands when the strides let the inner loop be contiguous.
+*/
+static bool _MZ_gemm_small(const _MZ_Kernels* kernels, size_t m, size_t n, size_t k, float alpha,
+                           const float* a, size_t rs_a, size_t cs_a,
+                           const float* b, size_t rs_b, size_t cs_b,
+                           float beta, float* c, size_t rs_c, size_t cs_c){
+
+    // each row of C is a sum of rows of B, a few cols with a deep product are left to the packed path
+    if(cs_c == 1 && cs_b == 1 && n >= 8 && (m < kernels->mr || k < kernels->mr)){
+        for(size_t i = 0; i < m; i++){
+            float* row = c + i * rs_c;
+            _MZ_scal(n, beta, row);
+            for(size_t p = 0; p < k; p++){
+                kernels->axpy(n, alpha * a[i * rs_a + p * cs_a], b + p * rs_b, row);
+            }
+        }
+        return true;
+    }
+
+    // each element of C is the dot product of a row of A and a col of B
+    if(cs_a == 1 && rs_b == 1){
+        for(size_t i = 0; i < m; i++){
+            for(size_t j = 0; j < n; j++){
+                float* dest = c + i * rs_c + j * cs_c;
+                float dot = alpha * kernels->dot(k, a + i * rs_a, b + j * cs_b);
+                *dest = beta == 0.0f ? dot : dot + beta * *dest;
+            }
+        }
+        return true;
+    }
+
+    // C^T = B^T * A^T, each col of C is a sum of cols of A
+    if(rs_c == 1 && rs_a == 1 && m >= 8){
+        for(size_t j = 0; j < n; j++){
+            float* col = c + j * cs_c;
+            _MZ_scal(m, beta, col);
+            for(size_t p = 0; p < k; p++){
+                kernels->axpy(m, alpha * b[p * rs_b + j * cs_b], a + p * cs_a, col);
+            }
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/*
+    The products that gain nothing from packing, false if the shape or the strides need the packed path.
+*/
+static bool _MZ_gemm_unpacked(const _MZ_Kernels* kernels, size_t m, size_t n, size_t k, float alpha,
+                              const float* a, size_t rs_a, size_t cs_a,
+                              const float* b, size_t rs_b, size_t cs_b,
+                              float beta, float* c, size_t rs_c, size_t cs_c){
+
+    if(n == 1 && _MZ_gemv(kernels, m, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c)) return true;
+
+    // a row of C is the row of A times B, that is B^T times the row
+    if(m == 1 && _MZ_gemv(kernels, n, k, alpha, b, cs_b, rs_b, a, cs_a, beta, c, cs_c)) return true;
+
+    if(m < kernels->mr || n < kernels->nr / 2 || k < kernels->mr){
+        return _MZ_gemm_small(kernels, m, n, k, alpha, a, rs_a, cs_a, b, rs_b, cs_b, beta, c, rs_c, cs_c);
+    }
+
+    return false;
+}
+
+/*
+    The epilogue is given to the micro-kernels of the last panel of k, while the block of C is in registers.
+*/
+static void _MZ_gemm_packed(const _MZ_Kernels* kernels, size_t m, size_t n, size_t k, float alpha,
+                            const float* a, size_t rs_a, size_t cs_a,
+                            const float* b, size_t rs_b, size_t cs_b,
+                            float beta, float* c, size_t rs_c, size_t cs_c, const _MZ_Epilogue* ep){
+
+    size_t MR = kernels->mr;
+    size_t NR = kernels->nr;
+
+    if(_MZ_gemm_pack_a == NULL){
+        _MZ_gemm_pack_a = (float*)MZ_aligned_alloc(MZ_GEMM_MC * MZ_GEMM_KC * sizeof(float));
+        MZ_assert(_MZ_gemm_pack_a != NULL, MZ_ALLOC_ERROR);
+        // the buffers of the thread are freed when it exits
+        pthread_once(&_MZ_gemm_key_once, _MZ_gemm_make_key);
+        pthread_setspecific(_MZ_gemm_key, _MZ_gemm_pack_a);
+    }
+
+    size_t panel_cols = (MZ_MIN(n, (size_t)MZ_GEMM_NC) + NR - 1) / NR * NR;
+    size_t panel_size = panel_cols * MZ_MIN(k, (size_t)MZ_GEMM_KC);
+
+    if(_MZ_gemm_pack_b_capacity < panel_size){
+        MZ_aligned_free(_MZ_gemm_pack_b);
+        _MZ_gemm_pack_b = (float*)MZ_aligned_alloc(panel_size * sizeof(float));
+        MZ_assert(_MZ_gemm_pack_b != NULL, MZ_ALLOC_ERROR);
+        _MZ_gemm_pack_b_capacity = panel_size;
+    }
+
+    for(size_t jc = 0; jc < n; jc += MZ_GEMM_NC){
+        size_t nc = MZ_MIN(n - jc, (size_t)MZ_GEMM_NC);
+
+        for(size_t pc = 0; pc < k; pc += MZ_GEMM_KC){
+            size_t kc = MZ_MIN(k - pc, (size_t)MZ_GEMM_KC);
+            // only the first panel of k sees the old C, the next ones accumulate
+            float beta_pc = pc == 0 ? beta : 1.0f;
+            bool last = pc + kc == k;
+
+            _MZ_gemm_pack_b_panel(kc, nc, NR, b + pc * rs_b + jc * cs_b, rs_b, cs_b, _MZ_gemm_pack_b);
+
+            for(size_t ic = 0; ic < m; ic += MZ_GEMM_MC){
+                size_t mc = MZ_MIN(m - ic, (size_t)MZ_GEMM_MC);
+
+                _MZ_gemm_pack_a_block(mc, kc, MR, a + ic * rs_a + pc * cs_a, rs_a, cs_a, _MZ_gemm_pack_a);
+
+                for(size_t jr = 0; jr < nc; jr += NR){
+                    size_t nr = MZ_MIN(nc - jr, NR);
+                    for(size_t ir = 0; ir < mc; ir += MR){
+                        size_t mr = MZ_MIN(mc - ir, MR);
+                        _MZ_Epilogue tile_ep;
+                        if(last && ep != NULL) tile_ep = _MZ_epilogue_at(ep, ic + ir, jc + jr);
+                        kernels->gemm(kc, _MZ_gemm_pack_a + ir * kc, _MZ_gemm_pack_b + jr * kc,
+                                      c + (ic + ir) * rs_c + (jc + jr) * cs_c, rs_c, cs_c,
+                                      mr, nr, alpha, beta_pc, last && ep != NULL ? &tile_ep : NULL);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+*/
+static void _MZ_gemm_serial(size_t m, size_t n, size_t k, float alpha,
+                            const float* a, size_t rs_a, size_t cs_a,
+                            const float* b, size_t rs_b, size_t cs_b,
+                            float beta, float* c, size_t rs_c, size_t cs_c, const _MZ_Epilogue* ep){
+
+    if(m == 0 || n == 0) return;
+
+    const _MZ_Kernels* kernels = _MZ_kernels();
+
+    if(k == 0 || alpha == 0.0f){
+        _MZ_gemm_scale(m, n, beta, c, rs_c, cs_c);
+    }else if(!_MZ_gemm_unpacked(kernels, m, n, k, alpha, a, rs_a, cs_a, b, rs_b, cs_b, beta, c, rs_c, cs_c)){
+        _MZ_gemm_packed(kernels, m, n, k, alpha, a, rs_a, cs_a, b, rs_b, cs_b, beta, c, rs_c, cs_c, ep);
+        return;
+    }
+
+    // the products that skip the micro-kernels get the epilogue in a second pass over C
+    if(ep != NULL) _MZ_epilogue_apply(ep, m, n, c, rs_c, cs_c);
+}
+
+/*
+    A product split in tiles of C, each tile is a serial product on its rows of A and cols of B.
+*/
+typedef struct _MZ_Gemm_Job{
+    size_t m, n, k;
+    float alpha;
+    const float* a;
+    size_t rs_a, cs_a;
+    const float* b;
+    size_t rs_b, cs_b;
+    float beta;
+    float* c;
+    size_t rs_c, cs_c;
+    const _MZ_Epilogue* ep;
+    size_t tile_m, tile_n, tiles_n;
+}_MZ_Gemm_Job;
+
+/*
+*/
+static void _MZ_gemm_tile(void* arg, size_t task){
+
+    const _MZ_Gemm_Job* job = (const _MZ_Gemm_Job*)arg;
+    size_t i = task / job->tiles_n * job->tile_m;
+    size_t j = task % job->tiles_n * job->tile_n;
+
+    _MZ_Epilogue ep;
+    if(job->ep != NULL) ep = _MZ_epilogue_at(job->ep, i, j);
+
+    _MZ_gemm_serial(MZ_MIN(job->m - i, job->tile_m), MZ_MIN(job->n - j, job->tile_n), job->k, job->alpha,
+                    job->a + i * job->rs_a, job->rs_a, job->cs_a,
+                    job->b + j * job->cs_b, job->rs_b, job->cs_b,
+                    job->beta, job->c + i * job->rs_c + j * job->cs_c, job->rs_c, job->cs_c,
+                    job->ep != NULL ? &ep : NULL);
+}
+
+/*
+    C = alpha * A * B + beta * C followed by the epilogue if there is one.
+*/
+static void _MZ_gemm(size_t m, size_t n, size_t k, float alpha,
+                     const float* a, size_t rs_a, size_t cs_a,
+                     const float* b, size_t rs_b, size_t cs_b,
+                     float beta, float* c, size_t rs_c, size_t cs_c, const _MZ_Epilogue* ep){
+
+    unsigned int threads = MZ_get_num_threads();
+    size_t threshold = __atomic_load_n(&_MZ_parallel_threshold, __ATOMIC_RELAXED);
+
+    if(threads > 1 && !_MZ_is_worker && m > 0 && n > 0 && (double)m * n * k >= (double)threshold){
+
+        const _MZ_Kernels* kernels = _MZ_kernels();
+
+        // about one tile per thread, the grid follows the shape of C so the tiles are close to square
+        size_t grid_m = (size_t)(sqrt((double)threads * m / n) + 0.5);
+        grid_m = MZ_MAX(MZ_MIN(grid_m, (size_t)threads), (size_t)1);
+        size_t grid_n = (threads + grid_m - 1) / grid_m;
+
+        // the tiles are whole blocks of the micro-kernel
+        size_t tile_m = ((m + grid_m - 1) / grid_m + kernels->mr - 1) / kernels->mr * kernels->mr;
+        size_t tile_n = ((n + grid_n - 1) / grid_n + kernels->nr - 1) / kernels->nr * kernels->nr;
+
+        _MZ_Gemm_Job job = {
+            m, n, k, alpha, a, rs_a, cs_a, b, rs_b, cs_b, beta, c, rs_c, cs_c, ep,
+            tile_m, tile_n, (n + tile_n - 1) / tile_n,
+        };
+
+        size_t tiles = (m + job.tile_m - 1) / job.tile_m * job.tiles_n;
+
+        if(tiles > 1){
+            MZ_parallel_for(tiles, _MZ_gemm_tile, &job);
+            return;
+        }
+    }
+
+    _MZ_gemm_serial(m, n, k, alpha, a, rs_a, cs_a, b, rs_b, cs_b, beta, c, rs_c, cs_c, ep);
+}
+
+/*
+*/
+void MZ_multiply_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2){
+    MZ_gemm_into(dest, 1.0f, matrix1, MZ_OP_N, matrix2, MZ_OP_N, 0.0f);
+}
+
+/*
+*/
+void MZ_gemm_into(MZ_Matrix* dest, float alpha, MZ_Matrix matrix1, MZ_Op op1, MZ_Matrix matrix2, MZ_Op op2, float beta){
+
+    // the transpose is a view, only the strides are swapped
+    if(op1 == MZ_OP_T) matrix1 = MZ_view_transpose(matrix1);
+    if(op2 == MZ_OP_T) matrix2 = MZ_view_transpose(matrix2);
+
+    MZ_assert(matrix1.cols == matrix2.rows, MZ_PROD_ERROR);
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix2.cols, MZ_EQUAL_ERROR);
+    MZ_assert(!MZ_do_matrices_overlap(*dest, matrix1) && !MZ_do_matrices_overlap(*dest, matrix2), MZ_ALIAS_ERROR);
+
+    _MZ_gemm(dest->rows, dest->cols, matrix1.cols, alpha,
+             matrix1.elements, matrix1.stride, matrix1.col_stride,
+             matrix2.elements, matrix2.stride, matrix2.col_stride,
+             beta, dest->elements, dest->stride, dest->col_stride, NULL);
+}
+
+/*
+    Distance between two elements of a matrix used as a vector, it can be a row or a col.
+*/
+static size_t _MZ_vector_inc(MZ_Matrix vector){
+    return vector.cols == 1 ? vector.stride : vector.col_stride;
+}
+
+/*
+*/
+void MZ_gemv_into(MZ_Matrix* y, float alpha, MZ_Matrix matrix, MZ_Matrix x, float beta){
+
+    MZ_assert((x.rows == 1 || x.cols == 1) && (y->rows == 1 || y->cols == 1), MZ_EQUAL_ERROR);
+    MZ_assert(x.rows * x.cols == matrix.cols && y->rows * y->cols == matrix.rows, MZ_PROD_ERROR);
+    MZ_assert(!MZ_do_matrices_overlap(*y, matrix) && !MZ_do_matrices_overlap(*y, x), MZ_ALIAS_ERROR);
+
+    _MZ_gemm(matrix.rows, 1, matrix.cols, alpha,
+             matrix.elements, matrix.stride, matrix.col_stride,
+             x.elements, _MZ_vector_inc(x), 0,
+             beta, y->elements, _MZ_vector_inc(*y), 0, NULL);
+}
+
+/*
+*/
+void MZ_rank1_update(MZ_Matrix* matrix, float alpha, MZ_Matrix x, MZ_Matrix y){
+
+    MZ_assert((x.rows == 1 || x.cols == 1) && (y.rows == 1 || y.cols == 1), MZ_EQUAL_ERROR);
+    MZ_assert(x.rows * x.cols == matrix->rows && y.rows * y.cols == matrix->cols, MZ_EQUAL_ERROR);
+    MZ_assert(!MZ_do_matrices_overlap(*matrix, x) && !MZ_do_matrices_overlap(*matrix, y), MZ_ALIAS_ERROR);
+
+    if(alpha == 0.0f) return;
+
+    const _MZ_Kernels* kernels = _MZ_kernels();
+    size_t inc_x = _MZ_vector_inc(x);
+    size_t inc_y = _MZ_vector_inc(y);
+
+    // each row of the matrix gets a multiple of y
+    if(matrix->col_stride == 1 && inc_y == 1){
+        for(unsigned int i = 0; i < matrix->rows; i++){
+            kernels->axpy(matrix->cols, alpha * x.elements[i * inc_x], y.elements, MZ_ROW_OF_MAT(*matrix, i));
+        }
+        return;
+    }
+
+    // each col of the matrix gets a multiple of x
+    if(matrix->stride == 1 && inc_x == 1){
+        for(unsigned int j = 0; j < matrix->cols; j++){
+            kernels->axpy(matrix->rows, alpha * y.elements[j * inc_y], x.elements, &MZ_VALUE_OF_MAT_POINTER_AT(matrix, 0, j));
+        }
+        return;
+    }
+
+    for(unsigned int i = 0; i < matrix->rows; i++){
+        float scale = alpha * x.elements[i * inc_x];
+        for(unsigned int j = 0; j < matrix->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(matrix, i, j) += scale * y.elements[j * inc_y];
+        }
+    }
+}
+
+
+/*
+*/
+void MZ_dense_forward_into(MZ_Matrix* dest, MZ_Matrix weights, MZ_Matrix input, const MZ_Matrix* bias, MZ_Activation act, MZ_Accuracy accuracy){
+
+    MZ_assert(weights.cols == input.rows, MZ_PROD_ERROR);
+    MZ_assert(dest->rows == weights.rows && dest->cols == input.cols, MZ_EQUAL_ERROR);
+    MZ_assert(!MZ_do_matrices_overlap(*dest, weights) && !MZ_do_matrices_overlap(*dest, input), MZ_ALIAS_ERROR);
+
+    _MZ_Epilogue ep = { act, accuracy, false, NULL, 0, NULL, 0, 0 };
+
+    if(bias != NULL){
+        MZ_assert((bias->rows == 1 || bias->cols == 1) && bias->rows * bias->cols == weights.rows, MZ_EQUAL_ERROR);
+        ep.bias = bias->elements;
+        ep.inc_bias = _MZ_vector_inc(*bias);
+    }
+
+    _MZ_gemm(dest->rows, dest->cols, weights.cols, 1.0f,
+             weights.elements, weights.stride, weights.col_stride,
+             input.elements, input.stride, input.col_stride,
+             0.0f, dest->elements, dest->stride, dest->col_stride, &ep);
+}
+
+/*
+*/
+void MZ_dense_backward_into(MZ_Matrix* delta, MZ_Matrix weights, MZ_Op op, MZ_Matrix errors, MZ_Matrix outputs, MZ_Activation act){
+
+    if(op == MZ_OP_T) weights = MZ_view_transpose(weights);
+
+    MZ_assert(weights.cols == errors.rows, MZ_PROD_ERROR);
+    MZ_assert(delta->rows == weights.rows && delta->cols == errors.cols, MZ_EQUAL_ERROR);
+    MZ_assert(outputs.rows == delta->rows && outputs.cols == delta->cols, MZ_EQUAL_ERROR);
+    // the first panels of a deep product leave partial sums in delta, the outputs must survive them
+    MZ_assert(!MZ_do_matrices_overlap(*delta, weights) && !MZ_do_matrices_overlap(*delta, errors) &&
+              !MZ_do_matrices_overlap(*delta, outputs), MZ_ALIAS_ERROR);
+
+    _MZ_Epilogue ep = { act, MZ_ACCURACY_ACCURATE, true, NULL, 0, outputs.elements, outputs.stride, outputs.col_stride };
+
+    _MZ_gemm(delta->rows, delta->cols, weights.cols, 1.0f,
+             weights.elements, weights.stride, weights.col_stride,
+             errors.elements, errors.stride, errors.col_stride,
+             0.0f, delta->elements, delta->stride, delta->col_stride, &ep);
+}
+
+/*
+*/
+void MZ_activation_derivative_into(MZ_Matrix* dest, MZ_Matrix matrix, MZ_Matrix outputs, MZ_Activation act){
+
+    MZ_assert(matrix.rows == outputs.rows && matrix.cols == outputs.cols, MZ_EQUAL_ERROR);
+    MZ_assert(dest->rows == matrix.rows && dest->cols == matrix.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix) && _MZ_is_safe_alias(*dest, outputs), MZ_ALIAS_ERROR);
+
+    _MZ_Binary_Kernel kernel = act < MZ_ACT_COUNT ? _MZ_kernels()->derivative[act] : NULL;
+
+    if(kernel == NULL){
+        MZ_copy_matrix_into(dest, matrix);
+        return;
+    }
+
+    if(_MZ_map_binary(dest, matrix, outputs, kernel)) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        _MZ_map_binary_strided(kernel, dest->cols, MZ_ROW_OF_MAT(matrix, i), matrix.col_stride,
+                               MZ_ROW_OF_MAT(outputs, i), outputs.col_stride, MZ_ROW_OF_MAT(*dest, i), dest->col_stride);
+    }
+}
+
+/*
+*/
+void MZ_exp_into(MZ_Matrix* dest, MZ_Matrix matrix, MZ_Accuracy accuracy){
+
+    MZ_assert(dest->rows == matrix.rows && dest->cols == matrix.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix), MZ_ALIAS_ERROR);
+
+    _MZ_map_unary(dest, matrix, _MZ_kernels()->exp[accuracy]);
+}
+
+/*
+*/
+void MZ_activate_into(MZ_Matrix* dest, MZ_Matrix matrix, MZ_Activation act, MZ_Accuracy accuracy){
+
+    MZ_assert(dest->rows == matrix.rows && dest->cols == matrix.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix), MZ_ALIAS_ERROR);
+
+    _MZ_Unary_Kernel kernel = _MZ_activation_kernel(_MZ_kernels(), act, accuracy);
+
+    if(kernel == NULL){
+        MZ_copy_matrix_into(dest, matrix);
+        return;
+    }
+
+    _MZ_map_unary(dest, matrix, kernel);
+}
+
+/*
+*/
+const char* MZ_activation_name(MZ_Activation act){
+    return _MZ_name_of(_MZ_activation_names, MZ_ACT_COUNT, act);
+}
+
+/*
+*/
+bool MZ_activation_from_name(const char* name, MZ_Activation* act){
+
+    int value;
+    if(!_MZ_value_of(_MZ_activation_names, MZ_ACT_COUNT, "activation", name, &value)) return false;
+
+    *act = (MZ_Activation)value;
+    return true;
+}
+
+/*
+*/
+bool MZ_activation_needs_inputs(MZ_Activation act){
+    return act == MZ_ACT_GELU;
+}
+
+/*
+*/
+void MZ_softmax_cols_into(MZ_Matrix* dest, MZ_Matrix matrix){
+
+    MZ_assert(dest->rows == matrix.rows && dest->cols == matrix.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix), MZ_ALIAS_ERROR);
+
+    const _MZ_Kernels* kernels = _MZ_kernels();
+
+    if(dest->rows == 0 || dest->cols == 0) return;
+
+    // a contiguous col is a vector, its max and sum are horizontal reductions
+    if(dest->cols == 1 && MZ_is_matrix_contiguous(*dest) && MZ_is_matrix_contiguous(matrix)){
+        size_t n = dest->rows;
+        kernels->add_scalar(n, matrix.elements, -kernels->max(n, matrix.elements), dest->elements);
+        kernels->exp[MZ_ACCURACY_ACCURATE](n, dest->elements, dest->elements);
+        kernels->mul_scalar(n, dest->elements, 1.0f / kernels->sum(n, dest->elements), dest->elements);
+        return;
+    }
+
+    if(dest->col_stride == 1 && matrix.col_stride == 1){
+        kernels->softmax_cols(dest->rows, dest->cols, matrix.elements, matrix.stride, dest->elements, dest->stride);
+        return;
+    }
+
+    for(unsigned int j = 0; j < dest->cols; j++){
+        float max = -INFINITY;
+        float sum = 0.0f;
+        for(unsigned int i = 0; i < dest->rows; i++){
+            max = fmaxf(max, MZ_VALUE_OF_MAT_AT(matrix, i, j));
+        }
+        for(unsigned int i = 0; i < dest->rows; i++){
+            float e = expf(MZ_VALUE_OF_MAT_AT(matrix, i, j) - max);
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = e;
+            sum += e;
+        }
+        for(unsigned int i = 0; i < dest->rows; i++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) /= sum;
+        }
+    }
+}
+
+/*
+*/
+float MZ_softmax_cross_entropy_cols_into(MZ_Matrix* dest, MZ_Matrix logits, const unsigned int* labels){
+
+    MZ_assert(dest->rows == logits.rows && dest->cols == logits.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, logits), MZ_ALIAS_ERROR);
+
+    for(unsigned int j = 0; j < logits.cols; j++){
+        MZ_assert(labels[j] < logits.rows, MZ_BOUNDS_ERROR);
+    }
+
+    if(dest->col_stride == 1 && logits.col_stride == 1){
+        return _MZ_kernels()->softmax_xent_cols(logits.rows, logits.cols, logits.elements, logits.stride,
+                                                labels, dest->elements, dest->stride);
+    }
+
+    float loss = 0.0f;
+
+    for(unsigned int j = 0; j < logits.cols; j++){
+        float max = -INFINITY;
+        float sum = 0.0f;
+        float picked = MZ_VALUE_OF_MAT_AT(logits, labels[j], j);
+        for(unsigned int i = 0; i < logits.rows; i++){
+            max = fmaxf(max, MZ_VALUE_OF_MAT_AT(logits, i, j));
+        }
+        for(unsigned int i = 0; i < logits.rows; i++){
+            float e = expf(MZ_VALUE_OF_MAT_AT(logits, i, j) - max);
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = e;
+            sum += e;
+        }
+        for(unsigned int i = 0; i < logits.rows; i++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) / sum - (i == labels[j] ? 1.0f : 0.0f);
+        }
+        loss += logf(sum) + max - picked;
+    }
+
+    return loss;
+}
+
+/*
+*/
+void MZ_argmax_cols(MZ_Matrix matrix, unsigned int* indices){
+
+    MZ_assert(matrix.rows > 0, MZ_BOUNDS_ERROR);
+
+    if(matrix.col_stride == 1){
+        _MZ_kernels()->argmax_cols(matrix.rows, matrix.cols, matrix.elements, matrix.stride, indices);
+        return;
+    }
+
+    for(unsigned int j = 0; j < matrix.cols; j++){
+        unsigned int best = 0;
+        for(unsigned int i = 1; i < matrix.rows; i++){
+            if(MZ_VALUE_OF_MAT_AT(matrix, i, j) > MZ_VALUE_OF_MAT_AT(matrix, best, j)) best = i;
+        }
+        indices[j] = best;
+    }
+}
+
+/*
+*/
+void MZ_topk_cols(MZ_Matrix matrix, unsigned int k, unsigned int* indices){
+
+    MZ_assert(k > 0 && k <= matrix.rows, MZ_BOUNDS_ERROR);
+
+    if(k == 1){
+        MZ_argmax_cols(matrix, indices);
+        return;
+    }
+
+    // the k best rows of each col are kept sorted, a row enters by insertion when it beats the last
+    for(unsigned int j = 0; j < matrix.cols; j++){
+        unsigned int* best = indices + (size_t)j * k;
+        unsigned int count = 0;
+        for(unsigned int i = 0; i < matrix.rows; i++){
+            float value = MZ_VALUE_OF_MAT_AT(matrix, i, j);
+            if(count == k && !(value > MZ_VALUE_OF_MAT_AT(matrix, best[k - 1], j))) continue;
+            unsigned int pos = count < k ? count++ : k - 1;
+            while(pos > 0 && value > MZ_VALUE_OF_MAT_AT(matrix, best[pos - 1], j)){
+                best[pos] = best[pos - 1];
+                pos--;
+            }
+            best[pos] = i;
+        }
+    }
+}
+
+/*
+*/
+MZ_Optimizer_Config MZ_optimizer_default_config(MZ_Optimizer kind){
+
+    MZ_Optimizer_Config config = {
+        .kind = kind,
+        .momentum = 0.9f,
+        .beta2 = 0.999f,
+        .epsilon = 1e-8f,
+        .weight_decay = kind == MZ_OPT_ADAMW ? 0.01f : 0.0f,
+    };
+
+    return config;
+}
+
+/*
+*/
+unsigned int MZ_optimizer_moments(MZ_Optimizer kind){
+
+    switch(kind){
+        case MZ_OPT_MOMENTUM:
+        case MZ_OPT_NESTEROV: return 1;
+        case MZ_OPT_ADAM:
+        case MZ_OPT_ADAMW: return 2;
+        default: return 0;
+    }
+}
+
+/*
+*/
+const char* MZ_optimizer_name(MZ_Optimizer kind){
+    return _MZ_name_of(_MZ_optimizer_names, MZ_OPT_COUNT, kind);
+}
+
+/*
+*/
+bool MZ_optimizer_from_name(const char* name, MZ_Optimizer* kind){
+
+    int value;
+    if(!_MZ_value_of(_MZ_optimizer_names, MZ_OPT_COUNT, "optimizer", name, &value)) return false;
+
+    *kind = (MZ_Optimizer)value;
+    return true;
+}
+
+/*
+    Update kernel on strided arrays, the elements go through buffers when they are not contiguous.
+*/
+static void _MZ_update_strided(_MZ_Update_Kernel kernel, const _MZ_Update* u, size_t n, float* w, size_t inc_w,
+                               const float* g, size_t inc_g, float* m, size_t inc_m, float* v, size_t inc_v){
+
+    if(inc_w == 1 && inc_g == 1 && inc_m == 1 && inc_v == 1){
+        kernel(n, w, g, m, v, u);
+        return;
+    }
+
+    float buffer_w[64];
+    float buffer_g[64];
+    float buffer_m[64];
+    float buffer_v[64];
+
+    for(size_t i = 0; i < n; i += 64){
+        size_t len = MZ_MIN(n - i, (size_t)64);
+        for(size_t j = 0; j < len; j++){
+            buffer_w[j] = w[(i + j) * inc_w];
+            buffer_g[j] = g[(i + j) * inc_g];
+            if(m != NULL) buffer_m[j] = m[(i + j) * inc_m];
+            if(v != NULL) buffer_v[j] = v[(i + j) * inc_v];
+        }
+        kernel(len, buffer_w, buffer_g, buffer_m, buffer_v, u);
+        for(size_t j = 0; j < len; j++){
+            w[(i + j) * inc_w] = buffer_w[j];
+            if(m != NULL) m[(i + j) * inc_m] = buffer_m[j];
+            if(v != NULL) v[(i + j) * inc_v] = buffer_v[j];
+        }
+    }
+}
+
+/*
+*/
+void MZ_optimizer_update(MZ_Matrix* weights, MZ_Matrix gradient, MZ_Matrix* moment1, MZ_Matrix* moment2,
+                         const MZ_Optimizer_Config* config, float learning_rate, unsigned long step){
+
+    MZ_Optimizer kind = config->kind;
+    unsigned int moments = MZ_optimizer_moments(kind);
+
+    MZ_assert(kind < MZ_OPT_COUNT, MZ_BOUNDS_ERROR);
+    MZ_assert(weights->rows == gradient.rows && weights->cols == gradient.cols, MZ_EQUAL_ERROR);
+    MZ_assert(moments < 1 || (moment1 != NULL && moment1->rows == weights->rows && moment1->cols == weights->cols), MZ_EQUAL_ERROR);
+    MZ_assert(moments < 2 || (moment2 != NULL && moment2->rows == weights->rows && moment2->cols == weights->cols), MZ_EQUAL_ERROR);
+    MZ_assert(step > 0, MZ_BOUNDS_ERROR);
+
+    _MZ_Update u = {
+        .rate = learning_rate,
+        .momentum = config->momentum,
+        .beta2 = config->beta2,
+        .epsilon = config->epsilon,
+        .decay = kind == MZ_OPT_ADAMW ? 0.0f : config->weight_decay,
+        .shrink = kind == MZ_OPT_ADAMW ? 1.0f - learning_rate * config->weight_decay : 1.0f,
+    };
+
+    if(moments == 2){
+        // the powers are taken in double so the corrections stay exact over long trainings
+        double correction1 = 1.0 - pow(config->momentum, (double)step);
+        double correction2 = sqrt(1.0 - pow(config->beta2, (double)step));
+        u.rate = (float)(learning_rate * correction2 / correction1);
+        u.epsilon = (float)(config->epsilon * correction2);
+    }
+
+    _MZ_Update_Kernel kernel = _MZ_kernels()->update[kind];
+    MZ_Matrix m = moments >= 1 ? *moment1 : *weights;
+    MZ_Matrix v = moments >= 2 ? *moment2 : *weights;
+    float* m_elements = moments >= 1 ? m.elements : NULL;
+    float* v_elements = moments >= 2 ? v.elements : NULL;
+
+    if(MZ_is_matrix_contiguous(*weights) && MZ_is_matrix_contiguous(gradient) && MZ_is_matrix_contiguous(m) && MZ_is_matrix_contiguous(v)){
+        kernel((size_t)weights->rows * weights->cols, weights->elements, gradient.elements, m_elements, v_elements, &u);
+        return;
+    }
+
+    for(unsigned int i = 0; i < weights->rows; i++){
+        _MZ_update_strided(kernel, &u, weights->cols, MZ_ROW_OF_MAT(*weights, i), weights->col_stride,
+                           MZ_ROW_OF_MAT(gradient, i), gradient.col_stride,
+                           m_elements != NULL ? MZ_ROW_OF_MAT(m, i) : NULL, m.col_stride,
+                           v_elements != NULL ? MZ_ROW_OF_MAT(v, i) : NULL, v.col_stride);
+    }
+}
+
+/*
+*/
+void MZ_multiply_matrix_by_scalar_into(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar){
+
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix1.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix1), MZ_ALIAS_ERROR);
+
+    if(_MZ_map_scalar(dest, matrix1, scalar, _MZ_kernels()->mul_scalar)) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) * scalar;
+        }
+    }
+}
+
+/*
+*/
+void MZ_divide_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2){
+
+    MZ_assert(matrix1.rows == matrix2.rows && matrix1.cols == matrix2.cols, MZ_EQUAL_ERROR);
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix1.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix1) && _MZ_is_safe_alias(*dest, matrix2), MZ_ALIAS_ERROR);
+
+    if(_MZ_map_binary(dest, matrix1, matrix2, _MZ_kernels()->div)) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            if(MZ_VALUE_OF_MAT_AT(matrix2, i, j) != 0.0f){
+                MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) / MZ_VALUE_OF_MAT_AT(matrix2, i, j);
+            }else {
+                MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = 0.0f;
+            }
+        }
+    }
+}
+
+/*
+*/
+void MZ_divide_matrix_by_scalar_into(MZ_Matrix* dest, MZ_Matrix matrix1, float scalar){
+
+    MZ_assert(scalar != 0.0f, MZ_DIVISION_ERROR);
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix1.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix1), MZ_ALIAS_ERROR);
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) / scalar;
+        }
+    }
+}
+
+/*
+*/
+void MZ_hadamard_multiply_two_matrices_into(MZ_Matrix* dest, MZ_Matrix matrix1, MZ_Matrix matrix2){
+
+    MZ_assert(matrix1.rows == matrix2.rows && matrix1.cols == matrix2.cols, MZ_EQUAL_ERROR);
+    MZ_assert(dest->rows == matrix1.rows && dest->cols == matrix1.cols, MZ_EQUAL_ERROR);
+    MZ_assert(_MZ_is_safe_alias(*dest, matrix1) && _MZ_is_safe_alias(*dest, matrix2), MZ_ALIAS_ERROR);
+
+    if(_MZ_map_binary(dest, matrix1, matrix2, _MZ_kernels()->mul)) return;
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) * MZ_VALUE_OF_MAT_AT(matrix2, i, j);
+        }
+    }
+}
+
+/*
+*/
+void MZ_transposed_matrix_into(MZ_Matrix* dest, MZ_Matrix source){
+
+    MZ_assert(dest->rows == source.cols && dest->cols == source.rows, MZ_EQUAL_ERROR);
+    MZ_assert(!MZ_do_matrices_overlap(*dest, source), MZ_ALIAS_ERROR);
+
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = MZ_VALUE_OF_MAT_AT(source, j, i);
+        }
     }
+}
+
+/*
+*/
+MZ_Matrix MZ_add_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2){
+
+    MZ_assert(matrix1.rows == matrix2.rows && matrix1.cols == matrix2.cols, MZ_EQUAL_ERROR);
+    
+    MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
+
+    MZ_add_two_matrices_into(&result, matrix1, matrix2);
+
+    return result;
+
+}
+
+/*
+*/
+MZ_Matrix MZ_add_matrix_with_scalar(MZ_Matrix matrix1, float scalar){
+    
+    MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
+
+    MZ_add_matrix_with_scalar_into(&result, matrix1, scalar);
+
+    return result;
+
+}
+
+/*
+*/
+MZ_Matrix MZ_subtract_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2){
+
+    MZ_assert(matrix1.rows == matrix2.rows && matrix1.cols == matrix2.cols, MZ_EQUAL_ERROR);
+
+    MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
+
+    MZ_subtract_two_matrices_into(&result, matrix1, matrix2);
 
     return result;
 
@@ -1968,11 +5780,7 @@ MZ_Matrix MZ_subtract_matrix_with_scalar(MZ_Matrix matrix1, float scalar){
     
     MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
 
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) - scalar;
-        }
-    }
+    MZ_subtract_matrix_with_scalar_into(&result, matrix1, scalar);
 
     return result;
 
@@ -1986,14 +5794,7 @@ MZ_Matrix MZ_multiply_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2){
 
     MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix2.cols);
     
-    for(unsigned int i = 0; i < result.rows; i++){
-		for(unsigned int j = 0; j < result.cols; j++){
-			MZ_VALUE_OF_MAT_AT(result, i, j) = 0;
-			for(unsigned int k = 0; k < matrix2.rows; k++){
-				MZ_VALUE_OF_MAT_AT(result, i, j) += MZ_VALUE_OF_MAT_AT(matrix1, i, k) * MZ_VALUE_OF_MAT_AT(matrix2, k, j); 
-			}
-		}
-	}
+    MZ_multiply_two_matrices_into(&result, matrix1, matrix2);
 
     return result;
 
@@ -2005,11 +5806,7 @@ MZ_Matrix MZ_multiply_matrix_by_scalar(MZ_Matrix matrix1, float scalar){
     
     MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
 
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) * scalar;
-        }
-    }
+    MZ_multiply_matrix_by_scalar_into(&result, matrix1, scalar);
 
     return result;
 
@@ -2023,15 +5820,7 @@ MZ_Matrix MZ_divide_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2){
 
     MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
 
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            if(MZ_VALUE_OF_MAT_AT(matrix2, i, j) != 0.0f){
-                MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) / MZ_VALUE_OF_MAT_AT(matrix2, i, j);
-            }else {
-                MZ_VALUE_OF_MAT_AT(result, i, j) = 0.0f;
-            }
-        }
-    }
+    MZ_divide_two_matrices_into(&result, matrix1, matrix2);
 
     return result;
 
@@ -2041,17 +5830,13 @@ MZ_Matrix MZ_divide_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2){
 */
 MZ_Matrix MZ_divide_matrix_by_scalar(MZ_Matrix matrix1, float scalar){
     
+    if(scalar == 0.0f){
+        return NULL_MATRIX;
+    }
+
     MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
 
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            if(scalar != 0.0f){
-                MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) / scalar;
-            }else {
-                return NULL_MATRIX;
-            }
-        }
-    }
+    MZ_divide_matrix_by_scalar_into(&result, matrix1, scalar);
 
     return result;
 
@@ -2065,11 +5850,7 @@ MZ_Matrix MZ_hadamard_multiply_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2
 
     MZ_Matrix result = MZ_alloc_matrix(matrix1.rows, matrix1.cols);
     
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(matrix1, i, j) * MZ_VALUE_OF_MAT_AT(matrix2, i, j);
-        }
-    }
+    MZ_hadamard_multiply_two_matrices_into(&result, matrix1, matrix2);
 
     return result;
     
@@ -2080,11 +5861,7 @@ MZ_Matrix MZ_hadamard_multiply_two_matrices(MZ_Matrix matrix1, MZ_Matrix matrix2
 MZ_Matrix MZ_transposed_matrix(MZ_Matrix source){
     MZ_Matrix result = MZ_alloc_matrix(source.cols, source.rows);
 
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = MZ_VALUE_OF_MAT_AT(source, j, i);
-        }
-    }
+    MZ_transposed_matrix_into(&result, source);
 
     return result;
 }
@@ -2099,9 +5876,11 @@ bool MZ_swap_two_matrix_rows(MZ_Matrix *source, unsigned int row1, unsigned int
         return false;
     }
 
-    float* tmp = source->elements[row1];
-    source->elements[row1] = source->elements[row2];
-    source->elements[row2] = tmp; 
+    for(unsigned int i = 0; i < source->cols; i++){
+        float tmp = MZ_VALUE_OF_MAT_POINTER_AT(source, row1, i);
+        MZ_VALUE_OF_MAT_POINTER_AT(source, row1, i) = MZ_VALUE_OF_MAT_POINTER_AT(source, row2, i);
+        MZ_VALUE_OF_MAT_POINTER_AT(source, row2, i) = tmp;
+    }
 
     return true;
 }
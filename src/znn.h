@@ -22,13 +22,18 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#pragma once
+
 #ifndef ZNN_H_
 #define ZNN_H_
 
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
 #include <unistd.h>
+#include <sys/stat.h>
+#define ZN_MKDIR(path) mkdir((path), 0777)
 #elif _WIN32
 #include <direct.h>
+#define ZN_MKDIR(path) _mkdir(path)
 #endif
 
 #define ZMATH_IMPLEMENTATION
@@ -37,26 +42,151 @@ SOFTWARE.
 #define ZIMG_IMPLEMENTATION
 #include "zimg.h"
 
+// images classified at once by zn_nn_predict_imgs
+#ifndef ZN_PREDICT_BATCH
+#define ZN_PREDICT_BATCH 128
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// samples of each shard of a batch in synchronous training, the shards and the order their gradients
+// are summed in depend only on the batch size. Smaller shards spread smaller batches on more threads
+// but every shard adds a gradient to sum, and below the width of the GEMM micro-kernel they waste it.
+#ifndef ZN_SHARD_SIZE
+#define ZN_SHARD_SIZE 32
+#endif
+
+typedef struct nn_workspace{
+    unsigned int batch;
+    MZ_Matrix inputs;
+    MZ_Matrix targets;
+    MZ_Matrix hidden_sums;
+    MZ_Matrix hidden_outputs;
+    MZ_Matrix final_sums;
+    MZ_Matrix final_outputs;
+    MZ_Matrix output_errors;
+    MZ_Matrix hidden_errors;
+    unsigned int* labels;
+}ZN_Workspace;
+
+typedef enum nn_loss{
+    ZN_LOSS_MSE = 0,
+    ZN_LOSS_CROSS_ENTROPY,
+    ZN_LOSS_COUNT
+}ZN_Loss;
+
+typedef enum nn_schedule{
+    ZN_SCHEDULE_CONSTANT = 0,
+    ZN_SCHEDULE_STEP,
+    ZN_SCHEDULE_COSINE,
+    ZN_SCHEDULE_ONE_CYCLE,
+    ZN_SCHEDULE_COUNT
+}ZN_Schedule;
+
+typedef enum nn_parallel{
+    ZN_PARALLEL_HOGWILD = 0,
+    ZN_PARALLEL_SYNC,
+    ZN_PARALLEL_COUNT
+}ZN_Parallel;
+
+struct nn_train_config;
+struct nn;
+
+// trains an epoch on the images imgs[order[0]] ... imgs[order[n - 1]] and gives the sum of the losses of the samples,
+// NAN stops the training
+typedef double (*ZN_Epoch_Fn)(void* arg, struct nn* nn, ZI_Img** imgs, const unsigned int* order, int n,
+                              const struct nn_train_config* config, double base_rate, unsigned long first_step, unsigned long steps);
+
+// epochs: passes over the training images, each in a new random order
+// step_epochs, step_gamma: the step schedule multiplies the rate by step_gamma every step_epochs
+// validation: fraction of the images held out at the end to score each epoch, 0 for none
+// patience: epochs without a better validation score before stopping, 0 never stops
+// threads: workers that train the network, 1 trains on the calling thread
+// parallel: hogwild workers update the shared weights without locks, sync ones split each batch in shards
+//           of ZN_SHARD_SIZE samples and sum their gradients in a fixed order before a single update,
+//           for a given seed the weights come out the same on any number of threads
+// trainer, trainer_arg: when set the epochs are trained by trainer instead of the threads (see zdist.h)
+// trainer_label: what the trainer runs on for the log of each epoch, NULL for the threads
+typedef struct nn_train_config{
+    int epochs;
+    int batch_size;
+    ZN_Schedule schedule;
+    int step_epochs;
+    double step_gamma;
+    double validation;
+    int patience;
+    int threads;
+    ZN_Parallel parallel;
+    ZN_Epoch_Fn trainer;
+    void* trainer_arg;
+    const char* trainer_label;
+}ZN_Train_Config;
+
+typedef struct nn_optimizer{
+    MZ_Optimizer_Config config;
+    unsigned long step;
+    MZ_Matrix hidden_gradient;
+    MZ_Matrix output_gradient;
+    MZ_Matrix hidden_moments[2];
+    MZ_Matrix output_moments[2];
+}ZN_Optimizer;
+
 typedef struct nn{
     int input;
     int hidden;
     int output;
     double learning_rate;
+    MZ_Accuracy accuracy;
+    MZ_Activation hidden_activation;
+    MZ_Activation output_activation;
+    ZN_Loss loss;
     MZ_Matrix hidden_weights;
     MZ_Matrix output_weights;
+    ZN_Workspace workspace;
+    ZN_Optimizer optimizer;
 }ZN_NN;
 
 MZ_Matrix MZ_new_random_uniform_float_matrix(unsigned int rows, unsigned int cols, float n);
 MZ_Matrix MZ_apply_function_to_matrix(MZ_Matrix source,double (*func)(double));
+void MZ_apply_function_to_matrix_into(MZ_Matrix* dest, MZ_Matrix source, double (*func)(double));
+MZ_Matrix MZ_sigmoidPrime(MZ_Matrix matrix);
+void MZ_sigmoidPrime_into(MZ_Matrix* dest, MZ_Matrix matrix);
 MZ_Matrix MZ_softmax(MZ_Matrix matrix);
+void MZ_softmax_into(MZ_Matrix* dest, MZ_Matrix matrix);
 void MZ_matrix_save(MZ_Matrix matrix, char* filename);
 MZ_Matrix MZ_matrix_load(char* filename);
 int MZ_matrix_argmax(MZ_Matrix matrix);
+void zn_seed(unsigned long long seed);
+unsigned int zn_rand(void);
 double zn_uniform_distribution(double low, double high);
 double zn_sigmoid_func(double x);
+void zn_nn_reserve(ZN_NN* nn, unsigned int batch);
 ZN_NN* zn_nn_new(int input, int hidden, int output, double learning_rate);
+void zn_nn_set_optimizer(ZN_NN* nn, MZ_Optimizer_Config config);
+void zn_layer_forward(MZ_Matrix* outputs, MZ_Matrix* sums, MZ_Matrix weights, MZ_Matrix inputs, MZ_Activation act, MZ_Accuracy accuracy);
+MZ_Matrix zn_layer_derivative_source(MZ_Matrix outputs, MZ_Matrix sums, MZ_Activation act);
+void zn_nn_forward(ZN_NN* nn, MZ_Matrix input_data, MZ_Matrix* hidden_outputs, MZ_Matrix* final_outputs);
+const char* zn_loss_name(ZN_Loss loss);
+bool zn_loss_from_name(const char* name, ZN_Loss* loss);
 void zn_nn_train(ZN_NN* nn, MZ_Matrix input_data, MZ_Matrix output_data);
-void zn_nn_train_batch_imgs(ZN_NN* nn, ZI_Img** imgs, int batch_size);
+void zn_nn_backward(ZN_NN* nn, MZ_Matrix input_batch);
+double zn_nn_gradient_labels(ZN_NN* nn, MZ_Matrix input_batch, const unsigned int* labels,
+                             MZ_Matrix* hidden_gradient, MZ_Matrix* output_gradient, float alpha);
+void zn_nn_apply_gradients(ZN_NN* nn, MZ_Matrix hidden_gradient, MZ_Matrix output_gradient);
+double zn_nn_train_batch(ZN_NN* nn, MZ_Matrix input_batch, MZ_Matrix output_batch);
+double zn_nn_train_batch_labels(ZN_NN* nn, MZ_Matrix input_batch, const unsigned int* labels);
+MZ_Matrix zn_nn_stage_imgs(ZN_NN* nn, ZI_Img** imgs, const unsigned int* order, int first, int size);
+void zn_nn_train_batch_imgs(ZN_NN* nn, ZI_Img** imgs, int n, int batch_size);
+const char* zn_schedule_name(ZN_Schedule schedule);
+bool zn_schedule_from_name(const char* name, ZN_Schedule* schedule);
+const char* zn_parallel_name(ZN_Parallel parallel);
+bool zn_parallel_from_name(const char* name, ZN_Parallel* parallel);
+ZN_Train_Config zn_train_default_config(void);
+double zn_schedule_rate(const ZN_Train_Config* config, double base_rate, double progress);
+double zn_nn_fit(ZN_NN* nn, ZI_Img** imgs, int n, const ZN_Train_Config* config);
+double zn_nn_fit_stream(ZN_NN* nn, ZI_Loader* loader, const ZN_Train_Config* config);
 MZ_Matrix zn_nn_predict_img(ZN_NN* nn, ZI_Img* img);
 double zn_nn_predict_imgs(ZN_NN* nn, ZI_Img** imgs, int n);
 MZ_Matrix zn_nn_predict(ZN_NN* nn, MZ_Matrix input_data);
@@ -72,8 +202,6 @@ void zn_nn_free(ZN_NN* nn);
 MZ_Matrix MZ_new_random_uniform_float_matrix(unsigned int rows, unsigned int cols, float n){
 
     MZ_Matrix result = MZ_alloc_matrix(rows, cols);
-    
-    MZ_SRAND();
 
     float min = -1 / sqrt(n);
     float max =  1 / sqrt(n);
@@ -90,49 +218,62 @@ MZ_Matrix MZ_new_random_uniform_float_matrix(unsigned int rows, unsigned int col
 
 MZ_Matrix MZ_apply_function_to_matrix(MZ_Matrix source,double (*func)(double)){
 
-    MZ_Matrix result;
+    MZ_Matrix result = MZ_alloc_matrix(source.rows, source.cols);
+
+    MZ_apply_function_to_matrix_into(&result, source, func);
+
+    return result;
+}
+
+void MZ_apply_function_to_matrix_into(MZ_Matrix* dest, MZ_Matrix source, double (*func)(double)){
 
-    MZ_copy_matrix_pointer(&source, &result);
+    MZ_assert(dest->rows == source.rows && dest->cols == source.cols, MZ_EQUAL_ERROR);
 
-    for(unsigned int i = 0; i < result.rows; i++){
-        for(unsigned int j = 0; j < result.cols; j++){
-                MZ_VALUE_OF_MAT_AT(result, i, j) = (*func)(MZ_VALUE_OF_MAT_AT(result, i, j));
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+                MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = (*func)(MZ_VALUE_OF_MAT_AT(source, i, j));
         }
     }
-
-    return result;
 }
 
 MZ_Matrix MZ_sigmoidPrime(MZ_Matrix matrix) {
 
-    MZ_Matrix ones = MZ_new_default_matrix(matrix.rows, matrix.cols, 1.0f);
-    MZ_Matrix minus = MZ_subtract_two_matrices(ones, matrix);
-    MZ_Matrix mult = MZ_hadamard_multiply_two_matrices(matrix, minus);
-    return mult;
+    MZ_Matrix result = MZ_alloc_matrix(matrix.rows, matrix.cols);
+
+    MZ_sigmoidPrime_into(&result, matrix);
+
+    return result;
 
 }
 
-MZ_Matrix MZ_softmax(MZ_Matrix matrix) {
+void MZ_sigmoidPrime_into(MZ_Matrix* dest, MZ_Matrix matrix) {
 
-    double total = 0;
+    MZ_assert(dest->rows == matrix.rows && dest->cols == matrix.cols, MZ_EQUAL_ERROR);
 
-    for(unsigned int i = 0; i < matrix.rows; i++) {
-        for(unsigned int j = 0; j < matrix.cols; j++){
-            total += exp(MZ_VALUE_OF_MAT_AT(matrix, i, j));
+    for(unsigned int i = 0; i < dest->rows; i++){
+        for(unsigned int j = 0; j < dest->cols; j++){
+            float value = MZ_VALUE_OF_MAT_AT(matrix, i, j);
+            MZ_VALUE_OF_MAT_POINTER_AT(dest, i, j) = value * (1.0f - value);
         }
     }
 
+}
+
+MZ_Matrix MZ_softmax(MZ_Matrix matrix) {
+
     MZ_Matrix result = MZ_alloc_matrix(matrix.rows, matrix.cols);
 
-    for(unsigned int i = 0; i < result.rows; i++) {
-        for(unsigned int j = 0; j < result.cols; j++){
-            MZ_VALUE_OF_MAT_AT(result, i, j) = exp(MZ_VALUE_OF_MAT_AT(matrix, i, j)) / total;
-        }
-    }
+    MZ_softmax_into(&result, matrix);
 
     return result;
 }
 
+void MZ_softmax_into(MZ_Matrix* dest, MZ_Matrix matrix) {
+
+    // each col is a sample, a single col gives the softmax of the whole vector
+    MZ_softmax_cols_into(dest, matrix);
+}
+
 void MZ_matrix_save(MZ_Matrix matrix, char* filename){
 	FILE* fp = fopen(filename, "w");
 
@@ -178,23 +319,38 @@ MZ_Matrix MZ_matrix_load(char* filename) {
 }
 
 int MZ_matrix_argmax(MZ_Matrix matrix) {
-	double max_score = 0;
-	int max_idx = 0;
-	for (int i = 0; i < matrix.rows; i++) {
-		if (MZ_VALUE_OF_MAT_AT(matrix, i, 0) > max_score) {
-			max_score = MZ_VALUE_OF_MAT_AT(matrix, i, 0);
-			max_idx = i;
-		}
-	}
+	unsigned int max_idx;
+	MZ_argmax_cols(MZ_view_col(matrix, 0), &max_idx);
 	return max_idx;
 }
 
 
+// The weights and the order of the training images come from this generator (splitmix64), it is seeded
+// from the clock at its first use unless zn_seed is called before. It is not meant for more than one thread.
+static unsigned long long zn_rng_state = 0;
+static bool zn_rng_seeded = false;
+
+void zn_seed(unsigned long long seed){
+    zn_rng_state = seed;
+    zn_rng_seeded = true;
+}
+
+unsigned int zn_rand(void){
+
+    if(!zn_rng_seeded){
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        zn_seed((unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+    }
+
+    unsigned long long z = (zn_rng_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return (unsigned int)((z ^ (z >> 31)) >> 32);
+}
+
 double zn_uniform_distribution(double low, double high) {
-	double difference = high - low; 
-	int scale = 10000;
-	int scaled_difference = (int)(difference * scale);
-	return low + (1.0 * (rand() % scaled_difference) / scale);
+	return low + (high - low) * (zn_rand() / 4294967296.0);
 }
 
 double zn_sigmoid_func(double x){
@@ -202,6 +358,44 @@ double zn_sigmoid_func(double x){
 }
 
 
+static void zn_workspace_release(ZN_Workspace* ws){
+
+    if(ws->batch == 0) return;
+
+    MZ_free_matrix(&ws->inputs);
+    MZ_free_matrix(&ws->targets);
+    MZ_free_matrix(&ws->hidden_sums);
+    MZ_free_matrix(&ws->hidden_outputs);
+    MZ_free_matrix(&ws->final_sums);
+    MZ_free_matrix(&ws->final_outputs);
+    MZ_free_matrix(&ws->output_errors);
+    MZ_free_matrix(&ws->hidden_errors);
+    free(ws->labels);
+    ws->batch = 0;
+}
+
+void zn_nn_reserve(ZN_NN* nn, unsigned int batch){
+
+    // The workspace only grows, a step on fewer samples uses the first cols of each matrix
+    ZN_Workspace* ws = &nn->workspace;
+
+    if(batch <= ws->batch) return;
+
+    zn_workspace_release(ws);
+
+    ws->batch = batch;
+    ws->inputs = MZ_alloc_matrix(nn->input, batch);
+    ws->targets = MZ_alloc_matrix(nn->output, batch);
+    ws->hidden_sums = MZ_alloc_matrix(nn->hidden, batch);
+    ws->hidden_outputs = MZ_alloc_matrix(nn->hidden, batch);
+    ws->final_sums = MZ_alloc_matrix(nn->output, batch);
+    ws->final_outputs = MZ_alloc_matrix(nn->output, batch);
+    ws->output_errors = MZ_alloc_matrix(nn->output, batch);
+    ws->hidden_errors = MZ_alloc_matrix(nn->hidden, batch);
+    ws->labels = (unsigned int*)malloc(batch * sizeof(unsigned int));
+    MZ_assert(ws->labels != NULL, MZ_ALLOC_ERROR);
+}
+
 ZN_NN* zn_nn_new(int input, int hidden, int output, double learning_rate){
 
     ZN_NN* nn = (ZN_NN*)malloc(sizeof(ZN_NN));
@@ -209,135 +403,977 @@ ZN_NN* zn_nn_new(int input, int hidden, int output, double learning_rate){
     nn->hidden = hidden;
     nn->output = output;
     nn->learning_rate = learning_rate;
+    nn->accuracy = MZ_ACCURACY_ACCURATE;
+    nn->hidden_activation = MZ_ACT_SIGMOID;
+    nn->output_activation = MZ_ACT_SIGMOID;
+    nn->loss = ZN_LOSS_MSE;
 
-    MZ_Matrix hidden_layer = MZ_alloc_matrix(hidden, input);
-    MZ_Matrix output_layer = MZ_alloc_matrix(output, hidden);
-
-    hidden_layer = MZ_new_random_uniform_float_matrix(hidden, input, hidden);
-    output_layer = MZ_new_random_uniform_float_matrix(output, hidden, output);
+    MZ_Matrix hidden_layer = MZ_new_random_uniform_float_matrix(hidden, input, hidden);
+    MZ_Matrix output_layer = MZ_new_random_uniform_float_matrix(output, hidden, output);
 
     nn->hidden_weights = hidden_layer;
     nn->output_weights = output_layer;
+    nn->workspace = (ZN_Workspace){0};
+    zn_nn_reserve(nn, 1);
+    nn->optimizer = (ZN_Optimizer){0};
+    zn_nn_set_optimizer(nn, MZ_optimizer_default_config(MZ_OPT_SGD));
 
     return nn;
 }
 
+static void zn_optimizer_release(ZN_Optimizer* opt){
+
+    MZ_Matrix* state[] = {
+        &opt->hidden_gradient, &opt->output_gradient,
+        &opt->hidden_moments[0], &opt->hidden_moments[1],
+        &opt->output_moments[0], &opt->output_moments[1],
+    };
+
+    for(size_t i = 0; i < sizeof(state) / sizeof(state[0]); i++){
+        if(state[i]->elements != NULL) MZ_free_matrix(state[i]);
+    }
+}
+
+void zn_nn_set_optimizer(ZN_NN* nn, MZ_Optimizer_Config config){
+
+    // The state of the optimizer is allocated here once and starts from zero, sgd needs none
+    // because its update is done by the products that compute the gradients
+    ZN_Optimizer* opt = &nn->optimizer;
+
+    zn_optimizer_release(opt);
+
+    opt->config = config;
+    opt->step = 0;
+
+    if(config.kind != MZ_OPT_SGD){
+        opt->hidden_gradient = MZ_alloc_matrix(nn->hidden, nn->input);
+        opt->output_gradient = MZ_alloc_matrix(nn->output, nn->hidden);
+    }
+
+    for(unsigned int i = 0; i < MZ_optimizer_moments(config.kind); i++){
+        opt->hidden_moments[i] = MZ_alloc_matrix(nn->hidden, nn->input);
+        opt->output_moments[i] = MZ_alloc_matrix(nn->output, nn->hidden);
+    }
+}
+
+
+void zn_layer_forward(MZ_Matrix* outputs, MZ_Matrix* sums, MZ_Matrix weights, MZ_Matrix inputs, MZ_Activation act, MZ_Accuracy accuracy){
+
+    // the activation is applied by the product as it writes the layer, unless its derivative needs the weighted sums
+    if(MZ_activation_needs_inputs(act)){
+        MZ_dense_forward_into(sums, weights, inputs, NULL, MZ_ACT_IDENTITY, accuracy);
+        MZ_activate_into(outputs, *sums, act, accuracy);
+    }else {
+        MZ_dense_forward_into(outputs, weights, inputs, NULL, act, accuracy);
+    }
+}
+
+MZ_Matrix zn_layer_derivative_source(MZ_Matrix outputs, MZ_Matrix sums, MZ_Activation act){
+    return MZ_activation_needs_inputs(act) ? sums : outputs;
+}
+
+void zn_nn_forward(ZN_NN* nn, MZ_Matrix input_data, MZ_Matrix* hidden_outputs, MZ_Matrix* final_outputs){
+
+    // the weighted sums kept for the derivatives live in the workspace
+    unsigned int batch = input_data.cols;
+
+    zn_nn_reserve(nn, batch);
+
+    MZ_Matrix hidden_sums = MZ_view_block(nn->workspace.hidden_sums, 0, 0, nn->hidden, batch);
+    MZ_Matrix final_sums = MZ_view_block(nn->workspace.final_sums, 0, 0, nn->output, batch);
+
+    // the output layer of a cross-entropy network gives the logits, the softmax is part of the loss
+    MZ_Activation output_activation = nn->loss == ZN_LOSS_CROSS_ENTROPY ? MZ_ACT_IDENTITY : nn->output_activation;
+
+    zn_layer_forward(hidden_outputs, &hidden_sums, nn->hidden_weights, input_data, nn->hidden_activation, nn->accuracy);
+    zn_layer_forward(final_outputs, &final_sums, nn->output_weights, *hidden_outputs, output_activation, nn->accuracy);
+}
+
+static const char* const zn_loss_names[ZN_LOSS_COUNT] = {
+    [ZN_LOSS_MSE] = "mse",
+    [ZN_LOSS_CROSS_ENTROPY] = "cross_entropy",
+};
+
+const char* zn_loss_name(ZN_Loss loss){
+    return _MZ_name_of(zn_loss_names, ZN_LOSS_COUNT, loss);
+}
+
+bool zn_loss_from_name(const char* name, ZN_Loss* loss){
+
+    int value;
+    if(!_MZ_value_of(zn_loss_names, ZN_LOSS_COUNT, "loss", name, &value)) return false;
+
+    *loss = (ZN_Loss)value;
+    return true;
+}
 
 void zn_nn_train(ZN_NN* nn, MZ_Matrix input_data, MZ_Matrix output_data){
 
+    // A single sample is a batch of one col, the products fall back to matrix by vector and rank-1 updates
+    zn_nn_train_batch(nn, input_data, output_data);
+}
+
+static void zn_nn_hidden_errors(ZN_NN* nn, unsigned int batch){
+
+    // The output errors of the workspace hold the gradient of the loss with respect to the weighted
+    // sums of the output layer, the hidden errors get it for the hidden layer
+    ZN_Workspace* ws = &nn->workspace;
+    MZ_Matrix hidden_sums = MZ_view_block(ws->hidden_sums, 0, 0, nn->hidden, batch);
+    MZ_Matrix hidden_outputs = MZ_view_block(ws->hidden_outputs, 0, 0, nn->hidden, batch);
+    MZ_Matrix output_errors = MZ_view_block(ws->output_errors, 0, 0, nn->output, batch);
+    MZ_Matrix hidden_errors = MZ_view_block(ws->hidden_errors, 0, 0, nn->hidden, batch);
+
+    // the hidden errors are multiplied by the derivative of the hidden activation as the product writes them
+    MZ_dense_backward_into(&hidden_errors, nn->output_weights, MZ_OP_T, output_errors,
+                           zn_layer_derivative_source(hidden_outputs, hidden_sums, nn->hidden_activation), nn->hidden_activation);
+}
+
+static void zn_nn_gradients(ZN_NN* nn, MZ_Matrix input_batch, MZ_Matrix* hidden_gradient, MZ_Matrix* output_gradient, float alpha){
+
+    // the gradients of the samples are summed by the product with the transposed layer inputs and scaled by alpha
+    unsigned int batch = input_batch.cols;
+
+    ZN_Workspace* ws = &nn->workspace;
+    MZ_Matrix hidden_outputs = MZ_view_block(ws->hidden_outputs, 0, 0, nn->hidden, batch);
+    MZ_Matrix output_errors = MZ_view_block(ws->output_errors, 0, 0, nn->output, batch);
+    MZ_Matrix hidden_errors = MZ_view_block(ws->hidden_errors, 0, 0, nn->hidden, batch);
+
+    MZ_gemm_into(output_gradient, alpha, output_errors, MZ_OP_N, hidden_outputs, MZ_OP_T, 0.0f);
+    MZ_gemm_into(hidden_gradient, alpha, hidden_errors, MZ_OP_N, input_batch, MZ_OP_T, 0.0f);
+}
+
+void zn_nn_apply_gradients(ZN_NN* nn, MZ_Matrix hidden_gradient, MZ_Matrix output_gradient){
+
+    ZN_Optimizer* opt = &nn->optimizer;
+
+    opt->step++;
+
+    MZ_optimizer_update(&nn->output_weights, output_gradient, &opt->output_moments[0], &opt->output_moments[1],
+                        &opt->config, nn->learning_rate, opt->step);
+    MZ_optimizer_update(&nn->hidden_weights, hidden_gradient, &opt->hidden_moments[0], &opt->hidden_moments[1],
+                        &opt->config, nn->learning_rate, opt->step);
+}
+
+void zn_nn_backward(ZN_NN* nn, MZ_Matrix input_batch){
+
+    // The update is the mean of the gradients of the samples so the learning rate does not depend on the batch size
+    unsigned int batch = input_batch.cols;
+
+    zn_nn_hidden_errors(nn, batch);
+
+    ZN_Optimizer* opt = &nn->optimizer;
+
+    if(opt->config.kind == MZ_OPT_SGD){
+        // the products update the weights themselves, w = (1 - lr wd) w - lr g
+        ZN_Workspace* ws = &nn->workspace;
+        MZ_Matrix hidden_outputs = MZ_view_block(ws->hidden_outputs, 0, 0, nn->hidden, batch);
+        MZ_Matrix output_errors = MZ_view_block(ws->output_errors, 0, 0, nn->output, batch);
+        MZ_Matrix hidden_errors = MZ_view_block(ws->hidden_errors, 0, 0, nn->hidden, batch);
+        float rate = nn->learning_rate / batch;
+        float shrink = 1.0f - nn->learning_rate * opt->config.weight_decay;
+
+        opt->step++;
+        MZ_gemm_into(&nn->output_weights, -rate, output_errors, MZ_OP_N, hidden_outputs, MZ_OP_T, shrink);
+        MZ_gemm_into(&nn->hidden_weights, -rate, hidden_errors, MZ_OP_N, input_batch, MZ_OP_T, shrink);
+        return;
+    }
+
+    zn_nn_gradients(nn, input_batch, &opt->hidden_gradient, &opt->output_gradient, 1.0f / batch);
+    zn_nn_apply_gradients(nn, opt->hidden_gradient, opt->output_gradient);
+}
+
+static double zn_nn_output_errors(ZN_NN* nn, MZ_Matrix input_batch, MZ_Matrix output_batch){
+
+    // Runs the batch forward and writes the output errors in the workspace, gives the sum of the losses of the samples
+    unsigned int batch = input_batch.cols;
+
+    ZN_Workspace* ws = &nn->workspace;
+    MZ_Matrix hidden_outputs = MZ_view_block(ws->hidden_outputs, 0, 0, nn->hidden, batch);
+    MZ_Matrix final_sums = MZ_view_block(ws->final_sums, 0, 0, nn->output, batch);
+    MZ_Matrix final_outputs = MZ_view_block(ws->final_outputs, 0, 0, nn->output, batch);
+    MZ_Matrix output_errors = MZ_view_block(ws->output_errors, 0, 0, nn->output, batch);
+
     // Forward propagation
 
-    MZ_Matrix hidden_inputs = MZ_multiply_two_matrices(nn->hidden_weights, input_data);
-    MZ_Matrix hidden_outputs = MZ_apply_function_to_matrix(hidden_inputs, zn_sigmoid_func);
-    MZ_Matrix final_inputs = MZ_multiply_two_matrices(nn->output_weights, hidden_outputs);
-    MZ_Matrix final_outputs = MZ_apply_function_to_matrix(final_inputs, zn_sigmoid_func);
+    zn_nn_forward(nn, input_batch, &hidden_outputs, &final_outputs);
 
     // Errors
 
-    MZ_Matrix output_errors = MZ_subtract_two_matrices(output_data, final_outputs);
-    MZ_Matrix transposed_mat = MZ_transposed_matrix(nn->output_weights);
-    MZ_Matrix hidden_errors = MZ_multiply_two_matrices(transposed_mat, output_errors);
-    MZ_free_matrix(&transposed_mat);
+    if(nn->loss == ZN_LOSS_CROSS_ENTROPY){
+        // through the softmax the gradient of the cross-entropy is the probabilities minus the targets
+        MZ_softmax_cols_into(&final_outputs, final_outputs);
+    }
 
-    // Back Propagation 
+    MZ_subtract_two_matrices_into(&output_errors, final_outputs, output_batch);
 
-    MZ_Matrix sigmoid_primed_mat = MZ_sigmoidPrime(final_outputs);
-    MZ_Matrix multiplied_mat = MZ_hadamard_multiply_two_matrices(output_errors, sigmoid_primed_mat);
-              transposed_mat = MZ_transposed_matrix(hidden_outputs);
-    MZ_Matrix dot_mat = MZ_multiply_two_matrices(multiplied_mat, transposed_mat);
-    MZ_Matrix scaled_mat = MZ_multiply_matrix_by_scalar(dot_mat, nn->learning_rate);
-    MZ_Matrix added_mat = MZ_add_two_matrices(nn->output_weights, scaled_mat);
+    double loss = 0.0;
 
-    MZ_free_matrix(&nn->output_weights);
-    nn->output_weights = added_mat;
-
-    MZ_free_matrix(&sigmoid_primed_mat);
-	MZ_free_matrix(&multiplied_mat);
-	MZ_free_matrix(&transposed_mat);
-	MZ_free_matrix(&dot_mat);
-	MZ_free_matrix(&scaled_mat);
-
-    sigmoid_primed_mat = MZ_sigmoidPrime(hidden_outputs);
-    multiplied_mat = MZ_hadamard_multiply_two_matrices(hidden_errors, sigmoid_primed_mat);
-    transposed_mat = MZ_transposed_matrix(input_data);
-    dot_mat = MZ_multiply_two_matrices(multiplied_mat, transposed_mat);
-    scaled_mat = MZ_multiply_matrix_by_scalar(dot_mat, nn->learning_rate);
-    added_mat = MZ_add_two_matrices(nn->hidden_weights, scaled_mat);
-
-    nn->hidden_weights = added_mat;
-
-    MZ_free_matrix(&sigmoid_primed_mat);
-	MZ_free_matrix(&multiplied_mat);
-	MZ_free_matrix(&transposed_mat);
-	MZ_free_matrix(&dot_mat);
-	MZ_free_matrix(&scaled_mat);
-    
-}
-
-void zn_nn_train_batch_imgs(ZN_NN* nn, ZI_Img** imgs, int batch_size){
-
-    for (int i = 0; i < batch_size; i++) {
-		if (i % 100 == 0) printf("Img No. %d\n", i);
-		ZI_Img* cur_img = imgs[i];
-        MZ_Matrix img_data = MZ_flatten_matrix(cur_img->img_data, VERTICAL);
-		MZ_Matrix output = MZ_alloc_matrix(10, 1);
-        MZ_VALUE_OF_MAT_AT(output, cur_img->label, 0) = 1;
-		zn_nn_train(nn, img_data, output);
-	}
+    for(int i = 0; i < nn->output; i++){
+        for(unsigned int j = 0; j < batch; j++){
+            float error = MZ_VALUE_OF_MAT_AT(output_errors, i, j);
+            float target = MZ_VALUE_OF_MAT_AT(output_batch, i, j);
+            if(nn->loss == ZN_LOSS_CROSS_ENTROPY){
+                if(target > 0.0f) loss -= target * log(MZ_MAX(error + target, 1e-30f));
+            }else {
+                loss += 0.5 * error * error;
+            }
+        }
+    }
+
+    if(nn->loss != ZN_LOSS_CROSS_ENTROPY){
+        MZ_activation_derivative_into(&output_errors, output_errors,
+                                      zn_layer_derivative_source(final_outputs, final_sums, nn->output_activation), nn->output_activation);
+    }
+
+    return loss;
+}
+
+static double zn_nn_output_errors_labels(ZN_NN* nn, MZ_Matrix input_batch, const unsigned int* labels){
+
+    // Each col of the batch is a sample of the class given by its label
+    unsigned int batch = input_batch.cols;
+
+    ZN_Workspace* ws = &nn->workspace;
+
+    if(nn->loss != ZN_LOSS_CROSS_ENTROPY){
+        // the squared error needs the targets, their one-hot cols are written in the workspace
+        MZ_Matrix output_batch = MZ_view_block(ws->targets, 0, 0, nn->output, batch);
+        MZ_fill_matrix(&output_batch, 0.0f);
+        for(unsigned int j = 0; j < batch; j++){
+            MZ_assert(labels[j] < output_batch.rows, MZ_BOUNDS_ERROR);
+            MZ_VALUE_OF_MAT_AT(output_batch, labels[j], j) = 1.0f;
+        }
+        return zn_nn_output_errors(nn, input_batch, output_batch);
+    }
+
+    MZ_Matrix hidden_outputs = MZ_view_block(ws->hidden_outputs, 0, 0, nn->hidden, batch);
+    MZ_Matrix final_outputs = MZ_view_block(ws->final_outputs, 0, 0, nn->output, batch);
+    MZ_Matrix output_errors = MZ_view_block(ws->output_errors, 0, 0, nn->output, batch);
+
+    zn_nn_forward(nn, input_batch, &hidden_outputs, &final_outputs);
+
+    // the softmax, the loss and its gradient p - onehot(label) come out of a single pass over the logits
+    return MZ_softmax_cross_entropy_cols_into(&output_errors, final_outputs, labels);
+}
+
+double zn_nn_train_batch(ZN_NN* nn, MZ_Matrix input_batch, MZ_Matrix output_batch){
+
+    // Each col of the batches is a sample, the layers see the whole batch at once
+    MZ_assert(input_batch.cols == output_batch.cols, MZ_EQUAL_ERROR);
+
+    unsigned int batch = input_batch.cols;
+
+    // Every temporary of the step is a view on the workspace, the weights are updated in place
+    zn_nn_reserve(nn, batch);
+
+    double loss = zn_nn_output_errors(nn, input_batch, output_batch);
+
+    // Back Propagation
+
+    zn_nn_backward(nn, input_batch);
+
+    return loss / batch;
+}
+
+double zn_nn_gradient_labels(ZN_NN* nn, MZ_Matrix input_batch, const unsigned int* labels,
+                             MZ_Matrix* hidden_gradient, MZ_Matrix* output_gradient, float alpha){
+
+    // The gradients of the batch scaled by alpha are written without touching the weights,
+    // the workspace must already hold the batch. Gives the sum of the losses of the samples.
+    double loss = zn_nn_output_errors_labels(nn, input_batch, labels);
+
+    zn_nn_hidden_errors(nn, input_batch.cols);
+    zn_nn_gradients(nn, input_batch, hidden_gradient, output_gradient, alpha);
+
+    return loss;
+}
+
+double zn_nn_train_batch_labels(ZN_NN* nn, MZ_Matrix input_batch, const unsigned int* labels){
+
+    unsigned int batch = input_batch.cols;
+
+    zn_nn_reserve(nn, batch);
+
+    double loss = zn_nn_output_errors_labels(nn, input_batch, labels);
+
+    zn_nn_backward(nn, input_batch);
+
+    return loss / batch;
+}
+
+MZ_Matrix zn_nn_stage_imgs(ZN_NN* nn, ZI_Img** imgs, const unsigned int* order, int first, int size){
+
+    // The images first ... first + size - 1, in the given order when there is one, are stacked as the
+    // cols of the workspace inputs and their labels written next to them
+    ZN_Workspace* ws = &nn->workspace;
+    MZ_Matrix input_batch = MZ_view_block(ws->inputs, 0, 0, nn->input, size);
+
+    for (int j = 0; j < size; j++) {
+        ZI_Img* cur_img = imgs[order != NULL ? order[first + j] : (unsigned int)(first + j)];
+        MZ_Matrix sample = MZ_view_col(input_batch, j);
+        MZ_copy_matrix_into(&sample, MZ_view_flatten(cur_img->img_data, VERTICAL));
+        ws->labels[j] = cur_img->label;
+    }
+
+    return input_batch;
+}
+
+void zn_nn_train_batch_imgs(ZN_NN* nn, ZI_Img** imgs, int n, int batch_size){
+
+    if (batch_size < 1) batch_size = 1;
+
+    // The images of a batch are stacked as the cols of the workspace inputs, the last batch may be shorter
+    zn_nn_reserve(nn, batch_size);
+
+    ZN_Workspace* ws = &nn->workspace;
+    size_t warm_allocs = 0;
+    double loss = 0.0;
+
+    for (int i = 0; i < n; i += batch_size) {
+        if (i % 100 < batch_size) printf("Img No. %d\n", i);
+
+        int size = MZ_MIN(n - i, batch_size);
+        MZ_Matrix input_batch = zn_nn_stage_imgs(nn, imgs, NULL, i, size);
+
+        loss += zn_nn_train_batch_labels(nn, input_batch, ws->labels) * size;
+
+        // the first step sizes the GEMM buffers, every following one must run on what is already there
+        if (i == 0) warm_allocs = MZ_alloc_count();
+    }
+
+    printf("Allocations after the first batch: %zu\n", MZ_alloc_count() - warm_allocs);
+    printf("Mean %s loss: %.5f\n", zn_loss_name(nn->loss), n > 0 ? loss / n : 0.0);
+}
+
+static const char* const zn_schedule_names[ZN_SCHEDULE_COUNT] = {
+    [ZN_SCHEDULE_CONSTANT] = "constant",
+    [ZN_SCHEDULE_STEP] = "step",
+    [ZN_SCHEDULE_COSINE] = "cosine",
+    [ZN_SCHEDULE_ONE_CYCLE] = "one_cycle",
+};
+
+const char* zn_schedule_name(ZN_Schedule schedule){
+    return _MZ_name_of(zn_schedule_names, ZN_SCHEDULE_COUNT, schedule);
+}
+
+bool zn_schedule_from_name(const char* name, ZN_Schedule* schedule){
+
+    int value;
+    if(!_MZ_value_of(zn_schedule_names, ZN_SCHEDULE_COUNT, "schedule", name, &value)) return false;
+
+    *schedule = (ZN_Schedule)value;
+    return true;
+}
+
+static const char* const zn_parallel_names[ZN_PARALLEL_COUNT] = {
+    [ZN_PARALLEL_HOGWILD] = "hogwild",
+    [ZN_PARALLEL_SYNC] = "sync",
+};
+
+const char* zn_parallel_name(ZN_Parallel parallel){
+    return _MZ_name_of(zn_parallel_names, ZN_PARALLEL_COUNT, parallel);
+}
+
+bool zn_parallel_from_name(const char* name, ZN_Parallel* parallel){
+
+    int value;
+    if(!_MZ_value_of(zn_parallel_names, ZN_PARALLEL_COUNT, "parallel mode", name, &value)) return false;
+
+    *parallel = (ZN_Parallel)value;
+    return true;
+}
+
+ZN_Train_Config zn_train_default_config(void){
+
+    ZN_Train_Config config = {
+        .epochs = 1,
+        .batch_size = 1,
+        .schedule = ZN_SCHEDULE_CONSTANT,
+        .step_epochs = 10,
+        .step_gamma = 0.1,
+        .validation = 0.0,
+        .patience = 0,
+        .threads = 1,
+        .parallel = ZN_PARALLEL_HOGWILD,
+        .trainer = NULL,
+        .trainer_arg = NULL,
+        .trainer_label = NULL,
+    };
+
+    return config;
+}
+
+double zn_schedule_rate(const ZN_Train_Config* config, double base_rate, double progress){
+
+    // progress goes from 0 at the first step of the training to 1 after the last
+    switch(config->schedule){
+        case ZN_SCHEDULE_STEP:{
+            int epoch = (int)(progress * config->epochs);
+            return base_rate * pow(config->step_gamma, epoch / MZ_MAX(config->step_epochs, 1));
+        }
+        case ZN_SCHEDULE_COSINE:{
+            return base_rate * 0.5 * (1.0 + cos(M_PI * progress));
+        }
+        case ZN_SCHEDULE_ONE_CYCLE:{
+            // a linear warm up from base / 25 over the first 30% of the steps, then a cosine down to base / 25e4
+            const double warmup = 0.3;
+            double low = base_rate / 25.0;
+            if(progress < warmup) return low + (base_rate - low) * progress / warmup;
+            double t = (progress - warmup) / (1.0 - warmup);
+            return low / 1e4 + (base_rate - low / 1e4) * 0.5 * (1.0 + cos(M_PI * t));
+        }
+        default:
+            return base_rate;
+    }
+}
+
+static double zn_seconds(void){
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// an epoch shared by the hogwild workers, the batches are taken from the next image not yet claimed
+typedef struct nn_epoch{
+    ZN_NN* nn;
+    ZI_Img** imgs;
+    const unsigned int* order;
+    int n;
+    const ZN_Train_Config* config;
+    double base_rate;
+    unsigned long first_step;
+    unsigned long steps;
+    ZN_Optimizer* optimizers;
+    unsigned int next_worker;
+    int next;
+    double loss;
+    pthread_mutex_t lock;
+}ZN_Epoch;
+
+static void* zn_epoch_worker(void* arg){
+
+    // The weights are shared with the other workers and updated without locks, a lost update only
+    // costs a little progress. The workspace and the optimizer state are the worker's own, the
+    // optimizer state is taken from the ones of the training and goes on from the last epoch.
+    ZN_Epoch* epoch = (ZN_Epoch*)arg;
+    int batch_size = MZ_MAX(epoch->config->batch_size, 1);
+    unsigned int worker = __atomic_fetch_add(&epoch->next_worker, 1, __ATOMIC_RELAXED);
+
+    ZN_NN local = *epoch->nn;
+    local.workspace = (ZN_Workspace){0};
+    local.optimizer = epoch->optimizers[worker];
+    zn_nn_reserve(&local, batch_size);
+
+    double loss = 0.0;
+    int i;
+
+    while ((i = __atomic_fetch_add(&epoch->next, batch_size, __ATOMIC_RELAXED)) < epoch->n) {
+        int size = MZ_MIN(epoch->n - i, batch_size);
+        MZ_Matrix input_batch = zn_nn_stage_imgs(&local, epoch->imgs, epoch->order, i, size);
+        double progress = (double)(epoch->first_step + i / batch_size) / epoch->steps;
+
+        local.learning_rate = zn_schedule_rate(epoch->config, epoch->base_rate, progress);
+        loss += zn_nn_train_batch_labels(&local, input_batch, local.workspace.labels) * size;
+    }
+
+    zn_workspace_release(&local.workspace);
+    epoch->optimizers[worker] = local.optimizer;
+
+    pthread_mutex_lock(&epoch->lock);
+    epoch->loss += loss;
+    pthread_mutex_unlock(&epoch->lock);
+
+    return NULL;
+}
+
+// the shards of the batches of a synchronous training, each one has its own workspace and gradients
+typedef struct nn_shards{
+    ZN_NN* nn;
+    unsigned int count;
+    ZN_NN* locals;
+    MZ_Matrix* hidden_gradients;
+    MZ_Matrix* output_gradients;
+    double* losses;
+    MZ_Matrix input_batch;
+    const unsigned int* labels;
+    unsigned int used;
+    unsigned int stride;
+}ZN_Shards;
+
+static void zn_shards_init(ZN_Shards* shards, ZN_NN* nn, int batch_size){
+
+    // Everything a batch needs is allocated once here, a full batch uses every shard
+    unsigned int count = (batch_size + ZN_SHARD_SIZE - 1) / ZN_SHARD_SIZE;
+
+    *shards = (ZN_Shards){ .nn = nn, .count = count };
+    shards->locals = (ZN_NN*)malloc(count * sizeof(ZN_NN));
+    shards->hidden_gradients = (MZ_Matrix*)malloc(count * sizeof(MZ_Matrix));
+    shards->output_gradients = (MZ_Matrix*)malloc(count * sizeof(MZ_Matrix));
+    shards->losses = (double*)malloc(count * sizeof(double));
+    MZ_assert(shards->locals != NULL && shards->hidden_gradients != NULL &&
+              shards->output_gradients != NULL && shards->losses != NULL, MZ_ALLOC_ERROR);
+
+    for(unsigned int s = 0; s < count; s++){
+        // the copies share the weights of the network
+        shards->locals[s] = *nn;
+        shards->locals[s].workspace = (ZN_Workspace){0};
+        shards->locals[s].optimizer = (ZN_Optimizer){0};
+        zn_nn_reserve(&shards->locals[s], ZN_SHARD_SIZE);
+        shards->hidden_gradients[s] = MZ_alloc_matrix(nn->hidden, nn->input);
+        shards->output_gradients[s] = MZ_alloc_matrix(nn->output, nn->hidden);
+    }
+}
+
+static void zn_shards_release(ZN_Shards* shards){
+
+    for(unsigned int s = 0; s < shards->count; s++){
+        zn_workspace_release(&shards->locals[s].workspace);
+        MZ_free_matrix(&shards->hidden_gradients[s]);
+        MZ_free_matrix(&shards->output_gradients[s]);
+    }
+
+    free(shards->locals);
+    free(shards->hidden_gradients);
+    free(shards->output_gradients);
+    free(shards->losses);
+    *shards = (ZN_Shards){0};
+}
+
+static void zn_shard_gradient(void* arg, size_t shard){
+
+    // The gradient of the shard is the sum of its samples over the size of the whole batch, so the
+    // sum of the shards is the mean gradient of the batch
+    ZN_Shards* shards = (ZN_Shards*)arg;
+    ZN_NN* local = &shards->locals[shard];
+    unsigned int first = shard * ZN_SHARD_SIZE;
+    unsigned int size = MZ_MIN(shards->input_batch.cols - first, (unsigned int)ZN_SHARD_SIZE);
+    MZ_Matrix input_shard = MZ_view_block(shards->input_batch, 0, first, local->input, size);
+
+    shards->losses[shard] = zn_nn_gradient_labels(local, input_shard, shards->labels + first, &shards->hidden_gradients[shard],
+                                                  &shards->output_gradients[shard], 1.0f / shards->input_batch.cols);
+}
+
+static void zn_shard_reduce(void* arg, size_t pair){
+
+    // shard left += shard left + stride, the pairs of a level are disjoint
+    ZN_Shards* shards = (ZN_Shards*)arg;
+    unsigned int left = pair * 2 * shards->stride;
+    unsigned int right = left + shards->stride;
+
+    if(right >= shards->used) return;
+
+    MZ_add_two_matrices_into(&shards->hidden_gradients[left], shards->hidden_gradients[left], shards->hidden_gradients[right]);
+    MZ_add_two_matrices_into(&shards->output_gradients[left], shards->output_gradients[left], shards->output_gradients[right]);
+}
+
+static double zn_nn_train_batch_sync(ZN_Shards* shards, MZ_Matrix input_batch, const unsigned int* labels){
+
+    // The shards are spread on the threads of the products, then their gradients are summed by a
+    // pairwise tree over the shard indices: which thread computes what never changes a single bit
+    shards->input_batch = input_batch;
+    shards->labels = labels;
+    shards->used = (input_batch.cols + ZN_SHARD_SIZE - 1) / ZN_SHARD_SIZE;
+
+    MZ_assert(shards->used <= shards->count, MZ_BOUNDS_ERROR);
+
+    MZ_parallel_for(shards->used, zn_shard_gradient, shards);
+
+    for(unsigned int stride = 1; stride < shards->used; stride *= 2){
+        shards->stride = stride;
+        MZ_parallel_for((shards->used + 2 * stride - 1) / (2 * stride), zn_shard_reduce, shards);
+    }
+
+    zn_nn_apply_gradients(shards->nn, shards->hidden_gradients[0], shards->output_gradients[0]);
+
+    double loss = 0.0;
+
+    for(unsigned int s = 0; s < shards->used; s++){
+        loss += shards->losses[s];
+    }
+
+    return loss / input_batch.cols;
+}
+
+// the optimizer state of each hogwild worker, allocated once for the whole training
+static ZN_Optimizer* zn_optimizers_new(ZN_NN* nn, int count){
+
+    ZN_Optimizer* optimizers = (ZN_Optimizer*)malloc(count * sizeof(ZN_Optimizer));
+    MZ_assert(optimizers != NULL, MZ_ALLOC_ERROR);
+
+    for (int t = 0; t < count; t++) {
+        ZN_NN local = *nn;
+        local.optimizer = (ZN_Optimizer){0};
+        zn_nn_set_optimizer(&local, nn->optimizer.config);
+        optimizers[t] = local.optimizer;
+    }
+
+    return optimizers;
+}
+
+static void zn_optimizers_free(ZN_Optimizer* optimizers, int count){
+
+    for (int t = 0; t < count; t++) {
+        zn_optimizer_release(&optimizers[t]);
+    }
+
+    free(optimizers);
+}
+
+static double zn_nn_train_epoch(ZN_NN* nn, ZI_Img** imgs, const unsigned int* order, int n, const ZN_Train_Config* config,
+                                ZN_Shards* shards, ZN_Optimizer* optimizers, double base_rate, unsigned long first_step, unsigned long steps){
+
+    // Trains on the images in the given order and gives the sum of the losses of the samples
+    int batch_size = MZ_MAX(config->batch_size, 1);
+    ZN_Epoch epoch = {
+        .nn = nn,
+        .imgs = imgs,
+        .order = order,
+        .n = n,
+        .config = config,
+        .base_rate = base_rate,
+        .first_step = first_step,
+        .steps = steps,
+        .optimizers = optimizers,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+
+    if (config->trainer != NULL) {
+        return config->trainer(config->trainer_arg, nn, imgs, order, n, config, base_rate, first_step, steps);
+    }
+
+    if (shards != NULL) {
+        for (int i = 0; i < n; i += batch_size) {
+            int size = MZ_MIN(n - i, batch_size);
+            MZ_Matrix input_batch = zn_nn_stage_imgs(nn, imgs, order, i, size);
+
+            nn->learning_rate = zn_schedule_rate(config, base_rate, (double)(first_step + i / batch_size) / steps);
+            epoch.loss += zn_nn_train_batch_sync(shards, input_batch, nn->workspace.labels) * size;
+        }
+        return epoch.loss;
+    }
+
+    if (config->threads <= 1) {
+        for (int i = 0; i < n; i += batch_size) {
+            int size = MZ_MIN(n - i, batch_size);
+            MZ_Matrix input_batch = zn_nn_stage_imgs(nn, imgs, order, i, size);
+
+            nn->learning_rate = zn_schedule_rate(config, base_rate, (double)(first_step + i / batch_size) / steps);
+            epoch.loss += zn_nn_train_batch_labels(nn, input_batch, nn->workspace.labels) * size;
+        }
+        return epoch.loss;
+    }
+
+    pthread_t* threads = (pthread_t*)malloc(config->threads * sizeof(pthread_t));
+    MZ_assert(threads != NULL, MZ_ALLOC_ERROR);
+
+    int started = 0;
+
+    for (; started < config->threads; started++) {
+        if (pthread_create(&threads[started], NULL, zn_epoch_worker, &epoch) != 0) break;
+    }
+
+    // without any worker the epoch is done here, a partial start is finished by the workers that run
+    if (started == 0) zn_epoch_worker(&epoch);
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    free(threads);
+
+    nn->learning_rate = zn_schedule_rate(config, base_rate, (double)(first_step + (n - 1) / batch_size) / steps);
+
+    return epoch.loss;
+}
+
+double zn_nn_fit(ZN_NN* nn, ZI_Img** imgs, int n, const ZN_Train_Config* config){
+
+    // The last images are held out for validation. Each epoch shuffles the order of the others, only
+    // their indices move. The learning rate of every step comes from the schedule, nn->learning_rate
+    // is its base and is restored at the end. With a validation split the weights of the best epoch are kept.
+    // With more than one thread the epochs are run by hogwild workers, a synchronous training runs
+    // the shards of every batch on the threads of the products.
+    int batch_size = MZ_MAX(config->batch_size, 1);
+    int n_valid = config->validation > 0.0 ? (int)(n * config->validation) : 0;
+    int n_train = n - n_valid;
+
+    MZ_assert(n_train > 0, MZ_BOUNDS_ERROR);
+
+    // the validation goes through the workspace too, it is sized for both up front
+    zn_nn_reserve(nn, n_valid > 0 ? MZ_MAX(batch_size, ZN_PREDICT_BATCH) : batch_size);
+
+    unsigned int* order = (unsigned int*)malloc(n_train * sizeof(unsigned int));
+    MZ_assert(order != NULL, MZ_ALLOC_ERROR);
+
+    for (int i = 0; i < n_train; i++) order[i] = i;
+
+    MZ_Matrix best_hidden = {0};
+    MZ_Matrix best_output = {0};
+
+    if (n_valid > 0) {
+        best_hidden = MZ_alloc_matrix(nn->hidden, nn->input);
+        best_output = MZ_alloc_matrix(nn->output, nn->hidden);
+    }
+
+    double base_rate = nn->learning_rate;
+    unsigned long steps_per_epoch = (n_train + batch_size - 1) / batch_size;
+    unsigned long steps = steps_per_epoch * MZ_MAX(config->epochs, 1);
+    double best_score = -1.0;
+    int best_epoch = 0;
+    double loss = 0.0;
+    size_t warm_allocs = 0;
+    unsigned int math_threads = MZ_get_num_threads();
+    bool sync = config->parallel == ZN_PARALLEL_SYNC;
+    bool hogwild = !sync && config->threads > 1 && config->trainer == NULL;
+    ZN_Shards shards = {0};
+    ZN_Optimizer* optimizers = NULL;
+
+    if (sync) {
+        zn_shards_init(&shards, nn, batch_size);
+        MZ_set_num_threads(MZ_MAX(config->threads, 1));
+    } else if (config->threads > 1) {
+        // the workers already use every core, each one runs its products on its own thread
+        MZ_set_num_threads(1);
+    }
+
+    if (hogwild) optimizers = zn_optimizers_new(nn, config->threads);
+
+    for (int epoch = 0; epoch < MZ_MAX(config->epochs, 1); epoch++) {
+
+        for (int i = n_train - 1; i > 0; i--) {
+            int j = (int)((unsigned long long)zn_rand() * (i + 1) >> 32);
+            unsigned int tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+
+        double start = zn_seconds();
+
+        loss = zn_nn_train_epoch(nn, imgs, order, n_train, config, sync ? &shards : NULL, optimizers,
+                                 base_rate, epoch * steps_per_epoch, steps) / n_train;
+
+        double elapsed = zn_seconds() - start;
+
+        // a diverged training, or a trainer that could not finish the epoch, goes no further
+        if (isnan(loss)) {
+            fprintf(stderr, "[ERROR]: The loss of epoch %d is not a number, the training stops\n", epoch + 1);
+            break;
+        }
+
+        printf("Epoch %d: mean %s loss %.5f, learning rate %.6f, %.0f samples/s on ", epoch + 1, zn_loss_name(nn->loss),
+               loss, nn->learning_rate, n_train / elapsed);
+
+        if (config->trainer_label != NULL) printf("%s", config->trainer_label);
+        else printf("%d threads", MZ_MAX(config->threads, 1));
+
+        double score = n_valid > 0 ? zn_nn_predict_imgs(nn, imgs + n_train, n_valid) : 0.0;
+
+        // the first epoch and its validation size the GEMM buffers, the following ones must run on what is already there
+        if (epoch == 0) warm_allocs = MZ_alloc_count();
+
+        if (n_valid == 0) {
+            printf("\n");
+            continue;
+        }
+
+        printf(", validation score %.5f\n", score);
+
+        if (score > best_score) {
+            best_score = score;
+            best_epoch = epoch;
+            MZ_copy_matrix_into(&best_hidden, nn->hidden_weights);
+            MZ_copy_matrix_into(&best_output, nn->output_weights);
+        } else if (config->patience > 0 && epoch - best_epoch >= config->patience && epoch + 1 < config->epochs) {
+            printf("Stopping early, no better validation score for %d epochs\n", config->patience);
+            break;
+        }
+    }
+
+    if (n_valid > 0) {
+        printf("Keeping the weights of epoch %d, validation score %.5f\n", best_epoch + 1, best_score);
+        MZ_copy_matrix_into(&nn->hidden_weights, best_hidden);
+        MZ_copy_matrix_into(&nn->output_weights, best_output);
+        MZ_free_matrix(&best_hidden);
+        MZ_free_matrix(&best_output);
+    }
+
+    // the hogwild workers are started for each epoch and size their own GEMM buffers again, the
+    // workers of the products size theirs at the first shard they happen to take
+    if (config->threads <= 1) printf("Allocations after the first epoch: %zu\n", MZ_alloc_count() - warm_allocs);
+
+    if (sync) zn_shards_release(&shards);
+    if (hogwild) zn_optimizers_free(optimizers, config->threads);
+
+    MZ_set_num_threads(math_threads);
+
+    nn->learning_rate = base_rate;
+    free(order);
+
+    return loss;
+}
+
+double zn_nn_fit_stream(ZN_NN* nn, ZI_Loader* loader, const ZN_Train_Config* config){
+
+    // The images come from the loader in the order of the file and each batch is trained while the
+    // loader parses the next ones, an epoch is a pass of the loader. The images are never all in
+    // memory so there is no shuffling nor validation, the batch size is the one of the loader. Only
+    // sync spreads the batches on the threads, hogwild ones are trained on the calling thread.
+    // The stalls of each epoch tell whether the training waited on the file or the other way round.
+    // A loader that fails stops the training with a NAN loss.
+    int batch_size = loader->batch_size;
+    unsigned long steps_per_epoch = (loader->number_of_images + batch_size - 1) / batch_size;
+    unsigned long steps = steps_per_epoch * loader->passes;
+    unsigned long step = 0;
+    double base_rate = nn->learning_rate;
+    double loss = 0.0;
+    unsigned int math_threads = MZ_get_num_threads();
+    bool sync = config->parallel == ZN_PARALLEL_SYNC;
+    ZN_Shards shards = {0};
+
+    zn_nn_reserve(nn, batch_size);
+
+    if (sync) {
+        zn_shards_init(&shards, nn, batch_size);
+        MZ_set_num_threads(MZ_MAX(config->threads, 1));
+    }
+
+    for (int epoch = 0; epoch < loader->passes; epoch++) {
+
+        ZI_Loader_Stats before = zi_loader_stats(loader);
+        double start = zn_seconds();
+        ZI_Batch* batch;
+        int samples = 0;
+
+        loss = 0.0;
+
+        // a batch of the next pass stays in the loader for the next epoch
+        while ((batch = zi_loader_next(loader)) != NULL && batch->pass == epoch) {
+            MZ_Matrix input_batch = MZ_view_block(batch->inputs, 0, 0, nn->input, batch->count);
+
+            nn->learning_rate = zn_schedule_rate(config, base_rate, (double)step++ / steps);
+            loss += (sync ? zn_nn_train_batch_sync(&shards, input_batch, batch->labels)
+                          : zn_nn_train_batch_labels(nn, input_batch, batch->labels)) * batch->count;
+            samples += batch->count;
+
+            zi_loader_release(loader);
+        }
+
+        // the loader printed why, no epoch is reported on a part of the file
+        if (zi_loader_failed(loader)) {
+            loss = NAN;
+            break;
+        }
+
+        if (samples == 0) break;
+
+        double elapsed = zn_seconds() - start;
+        ZI_Loader_Stats after = zi_loader_stats(loader);
+        loss /= samples;
+
+        printf("Epoch %d: mean %s loss %.5f, learning rate %.6f, %.0f samples/s, trainer stalled %lu times for %.3fs, loader stalled %lu times for %.3fs\n",
+               epoch + 1, zn_loss_name(nn->loss), loss, nn->learning_rate, samples / elapsed,
+               after.trainer_stalls - before.trainer_stalls, after.trainer_wait - before.trainer_wait,
+               after.loader_stalls - before.loader_stalls, after.loader_wait - before.loader_wait);
+    }
+
+    if (sync) zn_shards_release(&shards);
+
+    MZ_set_num_threads(math_threads);
+
+    nn->learning_rate = base_rate;
+
+    return loss;
 }
 
 MZ_Matrix zn_nn_predict_img(ZN_NN* nn, ZI_Img* img){
-    MZ_Matrix img_data = MZ_flatten_matrix(img->img_data, VERTICAL);
+    MZ_Matrix img_data = MZ_view_flatten(img->img_data, VERTICAL);
     MZ_Matrix result = zn_nn_predict(nn, img_data);
     return result;
 }
 
 double zn_nn_predict_imgs(ZN_NN* nn, ZI_Img** imgs, int n){
+
+    // The images are stacked as the cols of the workspace inputs like in training, the softmax
+    // does not change the largest output so the classes are taken from the outputs themselves
+    zn_nn_reserve(nn, ZN_PREDICT_BATCH);
+
+    ZN_Workspace* ws = &nn->workspace;
+    unsigned int classes[ZN_PREDICT_BATCH];
     int n_correct = 0;
-    for(unsigned int i = 0; i < n; i++){
-        MZ_Matrix prediction = zn_nn_predict_img(nn, imgs[i]);
-        if(MZ_matrix_argmax(prediction) == imgs[i]->label){
-            n_correct++;
+
+    for(int i = 0; i < n; i += ZN_PREDICT_BATCH){
+        int size = MZ_MIN(n - i, ZN_PREDICT_BATCH);
+        MZ_Matrix input_batch = MZ_view_block(ws->inputs, 0, 0, nn->input, size);
+        MZ_Matrix hidden_outputs = MZ_view_block(ws->hidden_outputs, 0, 0, nn->hidden, size);
+        MZ_Matrix final_outputs = MZ_view_block(ws->final_outputs, 0, 0, nn->output, size);
+
+        for(int j = 0; j < size; j++){
+            MZ_Matrix sample = MZ_view_col(input_batch, j);
+            MZ_copy_matrix_into(&sample, MZ_view_flatten(imgs[i + j]->img_data, VERTICAL));
+        }
+
+        zn_nn_forward(nn, input_batch, &hidden_outputs, &final_outputs);
+        MZ_argmax_cols(final_outputs, classes);
+
+        for(int j = 0; j < size; j++){
+            if(classes[j] == (unsigned int)imgs[i + j]->label) n_correct++;
         }
     }
+
     return 1.0f * n_correct / n;
 }
 
 MZ_Matrix zn_nn_predict(ZN_NN* nn, MZ_Matrix input_data){
 
-    MZ_Matrix hidden_inputs = MZ_multiply_two_matrices(nn->hidden_weights, input_data);
-    MZ_Matrix hidden_outputs = MZ_apply_function_to_matrix(hidden_inputs, zn_sigmoid_func);
-    MZ_Matrix final_inputs = MZ_multiply_two_matrices(nn->output_weights, hidden_outputs);
-    MZ_Matrix final_outputs = MZ_apply_function_to_matrix(final_inputs, zn_sigmoid_func);
-    MZ_Matrix result = MZ_softmax(final_outputs);
+    unsigned int batch = input_data.cols;
 
-    return result;
+    zn_nn_reserve(nn, batch);
+
+    MZ_Matrix hidden_outputs = MZ_view_block(nn->workspace.hidden_outputs, 0, 0, nn->hidden, batch);
+    MZ_Matrix final_outputs = MZ_view_block(nn->workspace.final_outputs, 0, 0, nn->output, batch);
+
+    zn_nn_forward(nn, input_data, &hidden_outputs, &final_outputs);
+
+    // The result outlives the workspace so it is taken from the heap
+    return MZ_softmax(final_outputs);
 }
 
 void zn_nn_save(ZN_NN* nn, const char* filename){
-	_mkdir(filename);
+	char path[MAXCHAR];
+	ZN_MKDIR(filename);
 	// Write the descriptor file
-	_chdir(filename);
-	FILE* NN_Inputs = fopen("NN_Inputs_Data", "w");
+	snprintf(path, sizeof(path), "%s/NN_Inputs_Data", filename);
+	FILE* NN_Inputs = fopen(path, "w");
+
+    if(NN_Inputs==NULL) {
+        fprintf(stderr,"[ERROR] Could not write file '%s'\n", path);
+        return;
+    }
+
 	fprintf(NN_Inputs, "%d\n", nn->input);
 	fprintf(NN_Inputs, "%d\n", nn->hidden);
 	fprintf(NN_Inputs, "%d\n", nn->output);
+	fprintf(NN_Inputs, "%s\n", MZ_activation_name(nn->hidden_activation));
+	fprintf(NN_Inputs, "%s\n", MZ_activation_name(nn->output_activation));
+	fprintf(NN_Inputs, "%s\n", zn_loss_name(nn->loss));
 	fclose(NN_Inputs);
-	MZ_matrix_save(nn->hidden_weights, "NN_Hidden_Layer");
-	MZ_matrix_save(nn->output_weights, "NN_Output_Layer");
+	snprintf(path, sizeof(path), "%s/NN_Hidden_Layer", filename);
+	MZ_matrix_save(nn->hidden_weights, path);
+	snprintf(path, sizeof(path), "%s/NN_Output_Layer", filename);
+	MZ_matrix_save(nn->output_weights, path);
 	printf("Successfully written to '%s'\n", filename);
-	_chdir("-"); // Go back to the orignal directory
 }
 
 ZN_NN* zn_nn_load(const char* filename){
 	ZN_NN* nn = malloc(sizeof(ZN_NN));
 	char entry[MAXCHAR];
-	_chdir(filename);
+	char path[MAXCHAR];
+	snprintf(path, sizeof(path), "%s/NN_Inputs_Data", filename);
 
-	FILE* NN_Inputs = fopen("NN_Inputs_Data", "r");
+	FILE* NN_Inputs = fopen(path, "r");
 
     if(NN_Inputs==NULL) {
-        fprintf(stderr,"[ERROR] Could not open file 'NN_Inputs'\n");
+        fprintf(stderr,"[ERROR] Could not open file '%s'\n", path);
         exit(EXIT_FAILURE);
     }
 
@@ -347,11 +1383,34 @@ ZN_NN* zn_nn_load(const char* filename){
 	nn->hidden = atoi(entry);
 	fgets(entry, MAXCHAR, NN_Inputs);
 	nn->output = atoi(entry);
+	// the networks saved before the activations were selectable are sigmoid on both layers
+	nn->hidden_activation = MZ_ACT_SIGMOID;
+	nn->output_activation = MZ_ACT_SIGMOID;
+	if(fgets(entry, MAXCHAR, NN_Inputs) != NULL){
+		entry[strcspn(entry, "\r\n")] = '\0';
+		MZ_activation_from_name(entry, &nn->hidden_activation);
+	}
+	if(fgets(entry, MAXCHAR, NN_Inputs) != NULL){
+		entry[strcspn(entry, "\r\n")] = '\0';
+		MZ_activation_from_name(entry, &nn->output_activation);
+	}
+	nn->loss = ZN_LOSS_MSE;
+	if(fgets(entry, MAXCHAR, NN_Inputs) != NULL){
+		entry[strcspn(entry, "\r\n")] = '\0';
+		zn_loss_from_name(entry, &nn->loss);
+	}
 	fclose(NN_Inputs);
-	nn->hidden_weights = MZ_matrix_load("NN_Hidden_Layer");
-	nn->output_weights = MZ_matrix_load("NN_Output_Layer");
+	nn->accuracy = MZ_ACCURACY_ACCURATE;
+	snprintf(path, sizeof(path), "%s/NN_Hidden_Layer", filename);
+	nn->hidden_weights = MZ_matrix_load(path);
+	snprintf(path, sizeof(path), "%s/NN_Output_Layer", filename);
+	nn->output_weights = MZ_matrix_load(path);
+	nn->workspace = (ZN_Workspace){0};
+	zn_nn_reserve(nn, 1);
+	nn->learning_rate = 0.1;
+	nn->optimizer = (ZN_Optimizer){0};
+	zn_nn_set_optimizer(nn, MZ_optimizer_default_config(MZ_OPT_SGD));
 	printf("Successfully loaded network from '%s'\n", filename);
-	_chdir("-"); // Go back to the original directory
 	return nn;
 }
 
@@ -368,6 +1427,8 @@ void zn_nn_print(ZN_NN* nn){
 void zn_nn_free(ZN_NN* nn) {
 	MZ_free_matrix(&nn->hidden_weights);
     MZ_free_matrix(&nn->output_weights);
+    zn_workspace_release(&nn->workspace);
+    zn_optimizer_release(&nn->optimizer);
 	free(nn);
 	nn = NULL;
 }